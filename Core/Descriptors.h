@@ -0,0 +1,25 @@
+#ifndef DESCRIPTORS_H__
+#define DESCRIPTORS_H__
+
+#include <opencv.hpp>
+
+// Key point descriptors stay in the memory of the backend that extracts
+// and matches them. The host type keeps the transfer calls of GpuMat so
+// frames, key frames and the tracker are the same for both backends.
+#ifdef HOST_BACKEND
+struct DescriptorMat : public cv::Mat {
+
+	void upload(const cv::Mat & src) {
+		src.copyTo(*this);
+	}
+
+	void download(cv::Mat & dst) const {
+		copyTo(dst);
+	}
+};
+#else
+#include <core/cuda.hpp>
+typedef cv::cuda::GpuMat DescriptorMat;
+#endif
+
+#endif
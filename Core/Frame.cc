@@ -3,7 +3,6 @@
 #include "Reduction.h"
 
 #include <Eigen/Dense>
-#include <core/cuda.hpp>
 
 using namespace cv;
 using namespace std;
@@ -15,7 +14,11 @@ float Frame::mDepthScale = 1000.0f;
 int Frame::mCols[NUM_PYRS];
 int Frame::mRows[NUM_PYRS];
 unsigned long Frame::nextId = 0;
+#ifdef HOST_BACKEND
+cv::Ptr<cv::xfeatures2d::SURF> Frame::surfExt;
+#else
 cv::cuda::SURF_CUDA Frame::surfExt;
+#endif
 cv::Ptr<cv::BRISK> Frame::briskExt;
 
 Frame::Frame():frameId(0), N(0), bad(false) {}
@@ -27,7 +30,11 @@ Frame::Frame(const Frame * other):frameId(other->frameId), N(0) {
 void Frame::Create(int cols_, int rows_) {
 
 	if(mbFirstCall) {
+#ifdef HOST_BACKEND
+		surfExt = cv::xfeatures2d::SURF::create(20);
+#else
 		surfExt = cv::cuda::SURF_CUDA(20);
+#endif
 		briskExt = cv::BRISK::create(30, 4);
 		for(int i = 0; i < NUM_PYRS; ++i) {
 			mCols[i] = cols_ / (1 << i);
@@ -60,6 +67,11 @@ void Frame::FillImages(const cv::Mat & range_, const cv::Mat & color_) {
 
 	temp.upload(range_.data, range_.step);
 	color.upload(color_.data, color_.step);
+#ifdef HOST_BACKEND
+	BuildPyramid(temp, color, range, depth, image, vmap, nmap, dIdx, dIdy,
+			NUM_PYRS, Intrinsics(fx(0), fy(0), cx(0), cy(0)), mDepthScale,
+			mDepthCutoff);
+#else
 	FilterDepth(temp, range, depth[0], mDepthScale, mDepthCutoff);
 	ImageToIntensity(color, image[0]);
 	for(int i = 1; i < NUM_PYRS; ++i) {
@@ -72,6 +84,7 @@ void Frame::FillImages(const cv::Mat & range_, const cv::Mat & color_) {
 		ComputeNMap(vmap[i], nmap[i]);
 		ComputeDerivativeImage(image[i], dIdx[i], dIdy[i]);
 	}
+#endif
 
 	frameId = nextId++;
 	bad = false;
@@ -177,9 +190,14 @@ void Frame::ExtractKeyPoints() {
 	mapPoints.clear();
 	descriptors.release();
 
+#ifdef HOST_BACKEND
+	cv::Mat img(image[0].rows, image[0].cols, CV_8UC1, image[0].data, image[0].step);
+	surfExt->detectAndCompute(img, cv::noArray(), rawKeyPoints, rawDescriptors);
+#else
 	cv::cuda::GpuMat img(image[0].rows, image[0].cols, CV_8UC1, image[0].data, image[0].step);
 	surfExt(img, cv::cuda::GpuMat(), rawKeyPoints, descriptors);
 	descriptors.download(rawDescriptors);
+#endif
 
 	cv::Mat desc;
 	N = rawKeyPoints.size();
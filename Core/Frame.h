@@ -4,13 +4,18 @@
 #include "DeviceMap.h"
 #include "DeviceArray.h"
 #include "KeyFrame.h"
+#include "Descriptors.h"
 
 #include <vector>
 #include <opencv.hpp>
 #include <features2d.hpp>
-#include <cudaarithm.hpp>
 #include <Eigen/Dense>
+#ifdef HOST_BACKEND
+#include <xfeatures2d.hpp>
+#else
+#include <cudaarithm.hpp>
 #include <xfeatures2d/cuda.hpp>
+#endif
 
 struct ORBKey;
 struct KeyFrame;
@@ -79,12 +84,16 @@ struct Frame {
 
 	int N;
 	bool bad;
-	cv::cuda::GpuMat descriptors;
+	DescriptorMat descriptors;
 	std::vector<float4> pointNormal;
 	std::vector<Eigen::Vector3f> mapPoints;
 	std::vector<cv::KeyPoint> keyPoints;
 
+#ifdef HOST_BACKEND
+	static cv::Ptr<cv::xfeatures2d::SURF> surfExt;
+#else
 	static cv::cuda::SURF_CUDA surfExt;
+#endif
 	static cv::Ptr<cv::BRISK> briskExt;
 
 	static cv::Mat mK[NUM_PYRS];
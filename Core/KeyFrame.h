@@ -3,6 +3,7 @@
 
 #include "Frame.h"
 #include "DeviceArray.h"
+#include "Descriptors.h"
 
 #include <Eigen/Dense>
 #include <opencv.hpp>
@@ -33,7 +34,7 @@ struct KeyFrame {
 	Eigen::Matrix4f pose;
 	Eigen::Matrix4f newPose;
 
-	cv::cuda::GpuMat descriptors;
+	DescriptorMat descriptors;
 	std::vector<float4> pointNormal;
 	std::vector<cv::KeyPoint> keyPoints;
 	std::vector<int> observations;
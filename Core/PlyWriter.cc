@@ -0,0 +1,131 @@
+#include "PlyWriter.h"
+#include "ThreadPool.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Vertices or faces read from the buffers and written out at a time.
+static const uint ChunkSize = 1 << 16;
+
+// ASCII chunks are formatted by the thread pool in pieces of this size.
+static const uint PieceSize = 4096;
+
+static const size_t VertexBytes = 6 * sizeof(float) + 3;
+static const size_t FaceBytes = 1 + 3 * sizeof(uint);
+
+// The file is written in host byte order, which is assumed to be little
+// endian as on every platform the system runs on.
+template<class T> static inline char * Put(char * dst, const T & value) {
+	memcpy(dst, &value, sizeof(T));
+	return dst + sizeof(T);
+}
+
+static bool WriteBytes(FILE * file, const void * data, size_t size) {
+	return fwrite(data, 1, size, file) == size;
+}
+
+// Formats lines [0, count) with format(i, line, size), which returns the
+// length of line i, and writes them out in order.
+template<class Format> static bool WriteLines(FILE * file, uint count, Format format) {
+
+	int noPieces = DivUp(count, (int) PieceSize);
+	std::vector<std::string> pieces(noPieces);
+	ThreadPool::Global().ParallelFor(0, noPieces, [&](int p) {
+		char line[256];
+		uint end = std::min(count, (p + 1) * PieceSize);
+		for (uint i = p * PieceSize; i < end; ++i)
+			pieces[p].append(line, format(i, line, sizeof(line)));
+	});
+
+	for (const std::string & piece : pieces)
+		if (!WriteBytes(file, piece.data(), piece.size()))
+			return false;
+
+	return true;
+}
+
+bool WritePly(const std::string & path, bool ascii,
+		const DeviceArray<float3> & vertex, const DeviceArray<float3> & normal,
+		const DeviceArray<uchar3> & color, uint noVertices,
+		const DeviceArray<uint> & index, uint noTriangles) {
+
+	FILE * file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	std::string header = "ply\n";
+	header += ascii ? "format ascii 1.0\n" : "format binary_little_endian 1.0\n";
+	header += "element vertex " + std::to_string(noVertices) + "\n";
+	header += "property float x\n";
+	header += "property float y\n";
+	header += "property float z\n";
+	header += "property float nx\n";
+	header += "property float ny\n";
+	header += "property float nz\n";
+	header += "property uchar red\n";
+	header += "property uchar green\n";
+	header += "property uchar blue\n";
+	header += "element face " + std::to_string(noTriangles) + "\n";
+	header += "property list uchar uint vertex_indices\n";
+	header += "end_header\n";
+	bool ok = WriteBytes(file, header.data(), header.size());
+
+	std::vector<float3> v(ChunkSize), n(ChunkSize);
+	std::vector<uchar3> c(ChunkSize);
+	std::vector<char> bytes(ChunkSize * VertexBytes);
+	for (uint begin = 0; ok && begin < noVertices; begin += ChunkSize) {
+		uint count = std::min(ChunkSize, noVertices - begin);
+		vertex.download(v.data(), begin, count);
+		normal.download(n.data(), begin, count);
+		color.download(c.data(), begin, count);
+
+		if (ascii) {
+			ok = WriteLines(file, count, [&](uint i, char * line, size_t size) {
+				return snprintf(line, size, "%g %g %g %g %g %g %d %d %d\n",
+						v[i].x, v[i].y, v[i].z, n[i].x, n[i].y, n[i].z,
+						(int) c[i].x, (int) c[i].y, (int) c[i].z);
+			});
+			continue;
+		}
+
+		char * dst = bytes.data();
+		for (uint i = 0; i < count; ++i) {
+			dst = Put(dst, v[i].x);
+			dst = Put(dst, v[i].y);
+			dst = Put(dst, v[i].z);
+			dst = Put(dst, n[i].x);
+			dst = Put(dst, n[i].y);
+			dst = Put(dst, n[i].z);
+			dst = Put(dst, c[i].x);
+			dst = Put(dst, c[i].y);
+			dst = Put(dst, c[i].z);
+		}
+		ok = WriteBytes(file, bytes.data(), count * VertexBytes);
+	}
+
+	std::vector<uint> idx(3 * ChunkSize);
+	bytes.resize(ChunkSize * FaceBytes);
+	for (uint begin = 0; ok && begin < noTriangles; begin += ChunkSize) {
+		uint count = std::min(ChunkSize, noTriangles - begin);
+		index.download(idx.data(), 3 * (size_t) begin, 3 * count);
+
+		if (ascii) {
+			ok = WriteLines(file, count, [&](uint i, char * line, size_t size) {
+				return snprintf(line, size, "3 %u %u %u\n", idx[3 * i], idx[3 * i + 1], idx[3 * i + 2]);
+			});
+			continue;
+		}
+
+		char * dst = bytes.data();
+		for (uint i = 0; i < count; ++i) {
+			dst = Put(dst, (unsigned char) 3);
+			dst = Put(dst, idx[3 * i]);
+			dst = Put(dst, idx[3 * i + 1]);
+			dst = Put(dst, idx[3 * i + 2]);
+		}
+		ok = WriteBytes(file, bytes.data(), count * FaceBytes);
+	}
+
+	return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,17 @@
+#ifndef PLYWRITER_H__
+#define PLYWRITER_H__
+
+#include "DeviceArray.h"
+
+#include <string>
+
+// Writes the first noVertices vertices and noTriangles triangles of an
+// indexed mesh to a PLY file, binary little endian unless ascii is set.
+// The buffers are read and written a chunk at a time, so no full host
+// copy of the mesh is made. Returns false if the file can not be written.
+bool WritePly(const std::string & path, bool ascii,
+		const DeviceArray<float3> & vertex, const DeviceArray<float3> & normal,
+		const DeviceArray<uchar3> & color, uint noVertices,
+		const DeviceArray<uint> & index, uint noTriangles);
+
+#endif
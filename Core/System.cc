@@ -1,5 +1,6 @@
 #include "System.h"
-#include <fstream>
+#include "PlyWriter.h"
+#include <iostream>
 
 Matrix3f eigen_to_mat3f(Eigen::Matrix3d mat) {
 	Matrix3f mat3f;
@@ -20,8 +21,7 @@ System::System(SysDesc* pParam) :
 		requestReadMap(false) {
 
 	if(pParam) {
-		param = new SysDesc();
-		memcpy((void*) param, (void*) pParam, sizeof(SysDesc));
+		param = new SysDesc(*pParam);
 	}
 	else {
 		param = new SysDesc();
@@ -34,6 +34,17 @@ System::System(SysDesc* pParam) :
 		param->cols = 640;
 		param->rows = 480;
 		param->TrackModel = true;
+		param->MapSize = 100000;
+		param->MaxMapSize = 700000;
+		param->MapType = MapDefault;
+		param->StreamDistance = 0;
+		param->TemporalRaycast = false;
+		param->MeshPath = "scene.ply";
+		param->MeshAscii = false;
+		param->MapPath = "map.bin";
+		param->MapCompress = false;
+		param->MapLoadRadius = 0;
+		param->Verbose = false;
 	}
 
 	mK = cv::Mat::eye(3, 3, CV_32FC1);
@@ -43,8 +54,18 @@ System::System(SysDesc* pParam) :
 	mK.at<float>(1, 2) = param->cy;
 	Frame::SetK(mK);
 
-	map = new Mapping();
+	if (param->MapType < 0 || param->MapType >= (int) (sizeof(MapConfigs) / sizeof(MapConfig))) {
+		std::cout << "Unknown map type " << param->MapType << ", using the default" << std::endl;
+		param->MapType = MapDefault;
+	}
+
+	DeviceMap::verbose = param->Verbose;
+	map = new Mapping(param->MapSize, param->MaxMapSize, MapConfigs[param->MapType]);
 	map->Create();
+	if (param->StreamDistance > 0)
+		map->EnableStreaming(param->StreamDistance,
+				(size_t) param->StreamCache * 1024 * 1024, param->StreamPath);
+	map->SetTemporalRaycast(param->TemporalRaycast);
 
 	optimizer = new Optimizer();
 	viewer = new Viewer();
@@ -113,6 +134,9 @@ bool System::GrabImage(const cv::Mat & image, const cv::Mat & depth) {
 
 		if (!tracker->mappingDisabled && tracker->state != -1) {
 			map->RayTrace(noBlocks, tracker->LastFrame);
+			map->CollectGarbage(tracker->LastFrame);
+			map->StreamBlocks(tracker->LastFrame);
+			map->GrowMap();
 		} else {
 			map->UpdateVisibility(tracker->LastFrame, noBlocks);
 			map->RayTrace(noBlocks, tracker->LastFrame);
@@ -141,128 +165,29 @@ void System::WriteMeshToDisk() {
 
 	map->CreateModel();
 
-	float3 * host_vertex = (float3*) malloc(sizeof(float3) * map->noTrianglesHost * 3);
-	float3 * host_normal = (float3*) malloc(sizeof(float3) * map->noTrianglesHost * 3);
-	uchar3 * host_color = (uchar3*) malloc(sizeof(uchar3) * map->noTrianglesHost * 3);
-	map->modelVertex.download(host_vertex, map->noTrianglesHost * 3);
-	map->modelNormal.download(host_normal, map->noTrianglesHost * 3);
-	map->modelColor.download(host_color, map->noTrianglesHost * 3);
-
-	std::ofstream file;
-	file.open("/home/xyang/scene.ply");
-		file << "ply\n";
-		file << "format ascii 1.0\n";
-		file << "element vertex " << map->noTrianglesHost * 3 << "\n";
-		file << "property float x\n";
-		file << "property float y\n";
-		file << "property float z\n";
-		file << "property float nx\n";
-		file << "property float ny\n";
-		file << "property float nz\n";
-		file << "property uchar red\n";
-		file << "property uchar green\n";
-		file << "property uchar blue\n";
-		file << "element face " << map->noTrianglesHost << "\n";
-		file << "property list uchar uint vertex_indices\n";
-		file << "end_header" << std::endl;
-
-	for (uint i = 0; i <  map->noTrianglesHost * 3; ++i) {
-		file << host_vertex[i].x << " "
-			 << host_vertex[i].y << " "
-			 << host_vertex[i].z << " "
-		     << host_normal[i].x << " "
-			 << host_normal[i].y << " "
-			 << host_normal[i].z << " "
-		     << (int) host_color[i].x << " "
-			 << (int) host_color[i].y << " "
-			 << (int) host_color[i].z << std::endl;
-	}
-
-	uchar numFaces = 3;
-	for (uint i = 0; i <  map->noTrianglesHost; ++i) {
-		file << (static_cast<int>(numFaces) & 0xFF) << " "
-			 << (int) i * 3 + 0 << " "
-			 << (int) i * 3 + 1 << " "
-			 << (int) i * 3 + 2 << std::endl;
-	}
-
-	file.close();
-	delete host_vertex;
-	delete host_normal;
-	delete host_color;
+	if (!WritePly(param->MeshPath, param->MeshAscii, map->modelVertex, map->modelNormal,
+			map->modelColor, map->noVerticesHost, map->modelIndex, map->noTrianglesHost))
+		std::cout << "Failed to write " << param->MeshPath << std::endl;
 }
 
 void System::WriteMapToDisk() {
 
-	map->DownloadToRAM();
-
-	auto file = std::fstream("/home/xyang/map.bin", std::ios::out | std::ios::binary);
-
-	const int NumSdfBlocks = DeviceMap::NumSdfBlocks;
-	const int NumBuckets = DeviceMap::NumBuckets;
-	const int NumVoxels = DeviceMap::NumVoxels;
-	const int NumEntries = DeviceMap::NumEntries;
-
-	// begin writing of general map info
-	file.write((const char*)&NumSdfBlocks, sizeof(int));
-	file.write((const char*)&NumBuckets, sizeof(int));
-	file.write((const char*)&NumVoxels, sizeof(int));
-	file.write((const char*)&NumEntries, sizeof(int));
-
-	// begin writing of dense map
-	file.write((char*) map->heapCounterRAM, sizeof(int));
-	file.write((char*) map->hashCounterRAM, sizeof(int));
-	file.write((char*) map->noVisibleEntriesRAM, sizeof(uint));
-	file.write((char*) map->heapRAM, sizeof(int) * DeviceMap::NumSdfBlocks);
-	file.write((char*) map->bucketMutexRAM, sizeof(int) * DeviceMap::NumBuckets);
-	file.write((char*) map->sdfBlockRAM, sizeof(Voxel) * DeviceMap::NumVoxels);
-	file.write((char*) map->hashEntriesRAM, sizeof(HashEntry) * DeviceMap::NumEntries);
-	file.write((char*) map->visibleEntriesRAM, sizeof(HashEntry) * DeviceMap::NumEntries);
-
-	// begin writing of feature map
-	file.write((char*) map->mutexKeysRAM, sizeof(int) * KeyMap::MaxKeys);
-	file.write((char*) map->mapKeysRAM, sizeof(SURF) * KeyMap::maxEntries);
-
-	// clean up
-	file.close();
-	map->ReleaseRAM();
+	if (!map->SaveMap(param->MapPath, param->MapCompress))
+		std::cout << "Failed to write " << param->MapPath << std::endl;
 }
 
 void System::ReadMapFromDisk() {
 
-	int NumSdfBlocks;
-	int NumBuckets;
-	int NumVoxels;
-	int NumEntries;
-
-	auto file = std::fstream("/home/xyang/map.bin", std::ios::in | std::ios::binary);
-
-	// begin reading of general map info
-	file.read((char *) &NumSdfBlocks, sizeof(int));
-	file.read((char *) &NumBuckets, sizeof(int));
-	file.read((char *) &NumVoxels, sizeof(int));
-	file.read((char *) &NumEntries, sizeof(int));
-
-	map->CreateRAM();
-
-	// begin reading of dense map
-	file.read((char*) map->heapCounterRAM, sizeof(int));
-	file.read((char*) map->hashCounterRAM, sizeof(int));
-	file.read((char*) map->noVisibleEntriesRAM, sizeof(uint));
-	file.read((char*) map->heapRAM, sizeof(int) * DeviceMap::NumSdfBlocks);
-	file.read((char*) map->bucketMutexRAM, sizeof(int) * DeviceMap::NumBuckets);
-	file.read((char*) map->sdfBlockRAM, sizeof(Voxel) * DeviceMap::NumVoxels);
-	file.read((char*) map->hashEntriesRAM, sizeof(HashEntry) * DeviceMap::NumEntries);
-	file.read((char*) map->visibleEntriesRAM, sizeof(HashEntry) * DeviceMap::NumEntries);
-
-	// begin reading of feature map
-	file.read((char*) map->mutexKeysRAM, sizeof(int) * KeyMap::MaxKeys);
-	file.read((char*) map->mapKeysRAM, sizeof(SURF) * KeyMap::maxEntries);
-
-	map->UploadFromRAM();
-	map->ReleaseRAM();
+	float3 centre = make_float3(0, 0, 0);
+	if (param->MapLoadRadius > 0) {
+		Eigen::Matrix4f pose = tracker->GetCurrentPose();
+		centre = make_float3(pose(0, 3), pose(1, 3), pose(2, 3));
+	}
 
-	file.close();
+	if (!map->LoadMap(param->MapPath, centre, param->MapLoadRadius)) {
+		std::cout << "Failed to read " << param->MapPath << std::endl;
+		return;
+	}
 
 	map->CreateModel();
 	tracker->mappingDisabled = true;
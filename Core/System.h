@@ -24,6 +24,19 @@ struct SysDesc {
 	bool TrackModel;
 	std::string path;
 	bool bUseDataset;
+	int MapSize;      // voxel blocks allocated up front, and per growth
+	int MaxMapSize;   // voxel blocks the map may grow to
+	int MapType;      // resolution preset, see MAPTYPE
+	float StreamDistance;   // blocks farther from the camera leave the map, 0 keeps all
+	int StreamCache;        // MB of streamed blocks kept in memory before going to disk
+	std::string StreamPath; // directory for streamed blocks
+	bool TemporalRaycast;   // start rays at the surface warped from the last frame
+	std::string MeshPath;   // PLY file the mesh is saved to
+	bool MeshAscii;         // save the mesh as ASCII instead of binary PLY
+	std::string MapPath;    // file the map is saved to and loaded from
+	bool MapCompress;       // run length encode the saved blocks, the host maps only raw ones
+	float MapLoadRadius;    // metres around the camera loaded from the map, 0 loads all
+	bool Verbose;           // print mapping statistics now and then
 };
 
 class System {
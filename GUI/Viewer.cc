@@ -3,17 +3,26 @@
 
 #include <unistd.h>
 #include <algorithm>
-#include <pangolin/gl/glcuda.h>
 #include <pangolin/gl/glvbo.h>
+
+#ifndef HOST_BACKEND
+#include <pangolin/gl/glcuda.h>
 #include <cuda_profiler_api.h>
+#endif
 
 using namespace std;
 using namespace pangolin;
 
+#ifdef HOST_BACKEND
+Viewer::Viewer() :
+		map(NULL), tracker(NULL), system(NULL), vao(0), quit(false) {
+}
+#else
 Viewer::Viewer() :
 		map(NULL), tracker(NULL), system(NULL), vao(0), vertexMaped(NULL),
-		normalMaped(NULL), colorMaped(NULL), quit(false) {
+		normalMaped(NULL), colorMaped(NULL), indexMaped(NULL), quit(false) {
 }
+#endif
 
 void Viewer::signalQuit() {
 	quit = true;
@@ -46,6 +55,17 @@ void Viewer::spin() {
 	glGenVertexArrays(1, &vao);
 	glGenVertexArrays(1, &vao_color);
 
+#ifdef HOST_BACKEND
+	vertex.Reinitialise(GlArrayBuffer, DeviceMap::MaxVertices, GL_FLOAT, 3, GL_STREAM_DRAW);
+	normal.Reinitialise(GlArrayBuffer, DeviceMap::MaxVertices, GL_FLOAT, 3, GL_STREAM_DRAW);
+	color.Reinitialise(GlArrayBuffer, DeviceMap::MaxVertices, GL_UNSIGNED_BYTE, 3, GL_STREAM_DRAW);
+	index.Reinitialise(GlElementArrayBuffer, DeviceMap::MaxIndices, GL_UNSIGNED_INT, 1, GL_STREAM_DRAW);
+
+	colorImage.Reinitialise(640, 480, GL_RGBA, true, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	depthImage.Reinitialise(640, 480, GL_RGBA, true, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	renderedImage.Reinitialise(640, 480, GL_RGBA, true, 0,  GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	topDownImage.Reinitialise(640, 480, GL_RGBA, true, 0,  GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+#else
 	vertex.Reinitialise(GlArrayBuffer, DeviceMap::MaxVertices,
 	GL_FLOAT, 3, cudaGraphicsMapFlagsWriteDiscard, GL_STREAM_DRAW);
 	vertexMaped = new CudaScopedMappedPtr(vertex);
@@ -58,6 +78,10 @@ void Viewer::spin() {
 	GL_UNSIGNED_BYTE, 3, cudaGraphicsMapFlagsWriteDiscard, GL_STREAM_DRAW);
 	colorMaped = new CudaScopedMappedPtr(color);
 
+	index.Reinitialise(GlElementArrayBuffer, DeviceMap::MaxIndices,
+	GL_UNSIGNED_INT, 1, cudaGraphicsMapFlagsWriteDiscard, GL_STREAM_DRAW);
+	indexMaped = new CudaScopedMappedPtr(index);
+
 	colorImage.Reinitialise(640, 480, GL_RGB, true, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 	colorImageMaped = new CudaScopedMappedArray(colorImage);
 
@@ -69,6 +93,7 @@ void Viewer::spin() {
 
 	topDownImage.Reinitialise(640, 480, GL_RGBA, true, 0,  GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 	topDownImageMaped = new CudaScopedMappedArray(topDownImage);
+#endif
 
 	View & dCam = CreateDisplay().SetAspect(-640.0 / 480).SetHandler(new Handler3D(sCam));
 	View & Image0 = CreateDisplay().SetAspect(-640.0 / 480);
@@ -106,7 +131,9 @@ void Viewer::spin() {
 		}
 
 		if (ShouldQuit()) {
+#ifndef HOST_BACKEND
 			SafeCall(cudaProfilerStop());
+#endif
 			system->requestStop = true;
 		}
 
@@ -224,12 +251,24 @@ void Viewer::spin() {
 	}
 }
 
+#ifdef HOST_BACKEND
+void Viewer::UploadImage(GlTexture & texture, const DeviceArray2D<uchar4> & image) {
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, image.step / sizeof(uchar4));
+	texture.Upload(image.data, GL_RGBA, GL_UNSIGNED_BYTE);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+#endif
+
 void Viewer::topDownView() {
 	if(system->imageUpdated) {
+#ifdef HOST_BACKEND
+		UploadImage(topDownImage, system->renderedImage);
+#else
 		SafeCall(cudaMemcpy2DToArray(**topDownImageMaped, 0, 0,
 				(void*) system->renderedImage.data,
 				system->renderedImage.step, sizeof(uchar4) * 640, 480,
 				cudaMemcpyDeviceToDevice));
+#endif
 	}
 	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
 	topDownImage.RenderToViewport(true);
@@ -238,10 +277,14 @@ void Viewer::topDownView() {
 void Viewer::showPrediction() {
 	if(tracker->imageUpdated) {
 		if(tracker->updateImageMutex.try_lock()) {
+#ifdef HOST_BACKEND
+			UploadImage(renderedImage, tracker->renderedImage);
+#else
 			SafeCall(cudaMemcpy2DToArray(**renderedImageMaped, 0, 0,
 					(void*) tracker->renderedImage.data,
 					 tracker->renderedImage.step, sizeof(uchar4) * 640, 480,
 					 cudaMemcpyDeviceToDevice));
+#endif
 			tracker->updateImageMutex.unlock();
 		}
 	}
@@ -252,10 +295,14 @@ void Viewer::showPrediction() {
 void Viewer::showDepthImage() {
 	if(tracker->imageUpdated) {
 		if(tracker->updateImageMutex.try_lock()) {
+#ifdef HOST_BACKEND
+			UploadImage(depthImage, tracker->renderedDepth);
+#else
 			SafeCall(cudaMemcpy2DToArray(**depthImageMaped, 0, 0,
 					(void*) tracker->renderedDepth.data,
 					 tracker->renderedDepth.step, sizeof(uchar4) * 640, 480,
 					 cudaMemcpyDeviceToDevice));
+#endif
 			tracker->updateImageMutex.unlock();
 		}
 	}
@@ -267,10 +314,14 @@ void Viewer::showDepthImage() {
 void Viewer::showColorImage() {
 	if(tracker->imageUpdated) {
 		if(tracker->updateImageMutex.try_lock()) {
+#ifdef HOST_BACKEND
+			UploadImage(colorImage, tracker->rgbaImage);
+#else
 			SafeCall(cudaMemcpy2DToArray(**colorImageMaped, 0, 0,
 					(void*) tracker->rgbaImage.data,
 					tracker->rgbaImage.step, sizeof(uchar4) * 640, 480,
 					cudaMemcpyDeviceToDevice));
+#endif
 			tracker->updateImageMutex.unlock();
 		}
 	}
@@ -280,9 +331,17 @@ void Viewer::showColorImage() {
 
 void Viewer::drawColor() {
 	if (map->meshUpdated) {
-		cudaMemcpy((void*) **vertexMaped, (void*) map->modelVertex, sizeof(float3) * map->noTrianglesHost * 3,  cudaMemcpyDeviceToDevice);
-		cudaMemcpy((void*) **normalMaped, (void*) map->modelNormal, sizeof(float3) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
-		cudaMemcpy((void*) **colorMaped, (void*) map->modelColor, sizeof(uchar3) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
+#ifdef HOST_BACKEND
+		vertex.Upload((void*) map->modelVertex, sizeof(float3) * map->noVerticesHost);
+		normal.Upload((void*) map->modelNormal, sizeof(float3) * map->noVerticesHost);
+		color.Upload((void*) map->modelColor, sizeof(uchar3) * map->noVerticesHost);
+		index.Upload((void*) map->modelIndex, sizeof(uint) * map->noTrianglesHost * 3);
+#else
+		cudaMemcpy((void*) **vertexMaped, (void*) map->modelVertex, sizeof(float3) * map->noVerticesHost,  cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **normalMaped, (void*) map->modelNormal, sizeof(float3) * map->noVerticesHost, cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **colorMaped, (void*) map->modelColor, sizeof(uchar3) * map->noVerticesHost, cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **indexMaped, (void*) map->modelIndex, sizeof(uint) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
+#endif
 		map->meshUpdated = false;
 	}
 
@@ -300,7 +359,9 @@ void Viewer::drawColor() {
 	glEnableVertexAttribArray(1);
 	color.Unbind();
 
-	glDrawArrays(GL_TRIANGLES, 0, map->noTrianglesHost * 3);
+	index.Bind();
+	glDrawElements(GL_TRIANGLES, map->noTrianglesHost * 3, GL_UNSIGNED_INT, 0);
+	index.Unbind();
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
 	colorShader.Unbind();
@@ -329,9 +390,17 @@ void Viewer::drawMesh(bool bNormal) {
 		return;
 
 	if (map->meshUpdated) {
-		cudaMemcpy((void*) **vertexMaped, (void*) map->modelVertex, sizeof(float3) * map->noTrianglesHost * 3,  cudaMemcpyDeviceToDevice);
-		cudaMemcpy((void*) **normalMaped, (void*) map->modelNormal, sizeof(float3) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
-		cudaMemcpy((void*) **colorMaped, (void*) map->modelColor, sizeof(uchar3) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
+#ifdef HOST_BACKEND
+		vertex.Upload((void*) map->modelVertex, sizeof(float3) * map->noVerticesHost);
+		normal.Upload((void*) map->modelNormal, sizeof(float3) * map->noVerticesHost);
+		color.Upload((void*) map->modelColor, sizeof(uchar3) * map->noVerticesHost);
+		index.Upload((void*) map->modelIndex, sizeof(uint) * map->noTrianglesHost * 3);
+#else
+		cudaMemcpy((void*) **vertexMaped, (void*) map->modelVertex, sizeof(float3) * map->noVerticesHost,  cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **normalMaped, (void*) map->modelNormal, sizeof(float3) * map->noVerticesHost, cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **colorMaped, (void*) map->modelColor, sizeof(uchar3) * map->noVerticesHost, cudaMemcpyDeviceToDevice);
+		cudaMemcpy((void*) **indexMaped, (void*) map->modelIndex, sizeof(uint) * map->noTrianglesHost * 3, cudaMemcpyDeviceToDevice);
+#endif
 		map->meshUpdated = false;
 	}
 
@@ -356,7 +425,9 @@ void Viewer::drawMesh(bool bNormal) {
 	glEnableVertexAttribArray(1);
 	normal.Unbind();
 
-	glDrawArrays(GL_TRIANGLES, 0, map->noTrianglesHost * 3);
+	index.Bind();
+	glDrawElements(GL_TRIANGLES, map->noTrianglesHost * 3, GL_UNSIGNED_INT, 0);
+	index.Unbind();
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
 	program->Unbind();
@@ -6,9 +6,12 @@
 #include <atomic>
 #include <vector>
 #include <pangolin/pangolin.h>
-#include <pangolin/gl/glcuda.h>
 #include <pangolin/gl/glvbo.h>
 
+#ifndef HOST_BACKEND
+#include <pangolin/gl/glcuda.h>
+#endif
+
 class System;
 class Mapping;
 class Tracker;
@@ -39,6 +42,10 @@ private:
 	void showDepthImage();
 	void topDownView();
 
+#ifdef HOST_BACKEND
+	void UploadImage(pangolin::GlTexture & texture, const DeviceArray2D<uchar4> & image);
+#endif
+
 	System * system;
 	Mapping * map;
 	Tracker * tracker;
@@ -51,12 +58,26 @@ private:
 	pangolin::GlSlProgram phongShader;
 	pangolin::GlSlProgram normalShader;
 	pangolin::GlSlProgram colorShader;
+
+#ifdef HOST_BACKEND
+	pangolin::GlBuffer vertex;
+	pangolin::GlBuffer normal;
+	pangolin::GlBuffer color;
+	pangolin::GlBuffer index;
+
+	pangolin::GlTexture colorImage;
+	pangolin::GlTexture depthImage;
+	pangolin::GlTexture renderedImage;
+	pangolin::GlTexture topDownImage;
+#else
 	pangolin::GlBufferCudaPtr vertex;
 	pangolin::GlBufferCudaPtr normal;
 	pangolin::GlBufferCudaPtr color;
+	pangolin::GlBufferCudaPtr index;
 	pangolin::CudaScopedMappedPtr * vertexMaped;
 	pangolin::CudaScopedMappedPtr * normalMaped;
 	pangolin::CudaScopedMappedPtr * colorMaped;
+	pangolin::CudaScopedMappedPtr * indexMaped;
 
 	pangolin::GlTextureCudaArray colorImage;
 	pangolin::GlTextureCudaArray depthImage;
@@ -66,6 +87,7 @@ private:
 	pangolin::CudaScopedMappedArray * depthImageMaped;
 	pangolin::CudaScopedMappedArray * renderedImageMaped;
 	pangolin::CudaScopedMappedArray * topDownImageMaped;
+#endif
 };
 
 #endif
@@ -72,6 +72,17 @@ int main(int argc, char** argv) {
 	desc.cy = 240;
 	desc.TrackModel = true;
 	desc.bUseDataset = false;
+	desc.MapSize = 100000;
+	desc.MaxMapSize = 700000;
+	desc.MapType = MapDefault;
+	desc.StreamDistance = 0;
+	desc.TemporalRaycast = false;
+	desc.MeshPath = "scene.ply";
+	desc.MeshAscii = false;
+	desc.MapPath = "map.bin";
+	desc.MapCompress = false;
+	desc.MapLoadRadius = 0;
+	desc.Verbose = false;
 
 	System slam(&desc);
 
@@ -0,0 +1,202 @@
+#include "BlockGrid.h"
+
+#include <cmath>
+
+long long BlockGrid::Key(const int3 & pos) {
+	const long long mask = (1 << 21) - 1;
+	return ((long long) (pos.x & mask) << 42) |
+		   ((long long) (pos.y & mask) << 21) |
+		   (long long) (pos.z & mask);
+}
+
+int3 BlockGrid::CellPos(const int3 & blockPos) {
+	int3 pos;
+	pos.x = blockPos.x < 0 ? (blockPos.x + 1) / CellSize - 1 : blockPos.x / CellSize;
+	pos.y = blockPos.y < 0 ? (blockPos.y + 1) / CellSize - 1 : blockPos.y / CellSize;
+	pos.z = blockPos.z < 0 ? (blockPos.z + 1) / CellSize - 1 : blockPos.z / CellSize;
+	return pos;
+}
+
+BlockGrid::BlockGrid() :
+		noCells(0), dirty(true) {
+	Clear();
+}
+
+int BlockGrid::Find(const int3 & pos) const {
+	uint mask = table.size() - 1;
+	uint slot = GridCell::Hash(pos, table.size());
+	while (table[slot].noBlocks != EntryAvailable) {
+		if (table[slot].pos == pos)
+			return slot;
+		slot = (slot + 1) & mask;
+	}
+	return EntryAvailable;
+}
+
+// Keeps the table at most half full and drops the cells that ran empty.
+void BlockGrid::Grow() {
+
+	std::vector<GridCell> old;
+	old.swap(table);
+	GridCell empty = { };
+	empty.noBlocks = EntryAvailable;
+	table.assign(old.size() * 2, empty);
+	noCells = 0;
+
+	uint mask = table.size() - 1;
+	for (const GridCell & cell : old) {
+		if (cell.noBlocks <= 0)
+			continue;
+		uint slot = GridCell::Hash(cell.pos, table.size());
+		while (table[slot].noBlocks != EntryAvailable)
+			slot = (slot + 1) & mask;
+		table[slot] = cell;
+		noCells++;
+	}
+}
+
+void BlockGrid::Insert(const int3 & blockPos) {
+
+	int3 pos = CellPos(blockPos);
+	int slot = Find(pos);
+	if (slot == EntryAvailable) {
+		if ((noCells + 1) * 2 > (int) table.size())
+			Grow();
+		uint mask = table.size() - 1;
+		slot = GridCell::Hash(pos, table.size());
+		while (table[slot].noBlocks != EntryAvailable)
+			slot = (slot + 1) & mask;
+		GridCell & cell = table[slot];
+		cell = GridCell();
+		cell.pos = pos;
+		cell.noBlocks = 0;
+		noCells++;
+	}
+
+	GridCell & cell = table[slot];
+	int idx = GridCell::LocalIdx(blockPos, pos);
+	if (!cell.test(idx)) {
+		cell.mask[idx >> 5] |= 1u << (idx & 31);
+		cell.noBlocks++;
+		dirty = true;
+	}
+}
+
+// A cell that runs empty keeps its slot until the table grows.
+void BlockGrid::Erase(const int3 & blockPos) {
+
+	int3 pos = CellPos(blockPos);
+	int slot = Find(pos);
+	if (slot == EntryAvailable)
+		return;
+
+	GridCell & cell = table[slot];
+	int idx = GridCell::LocalIdx(blockPos, pos);
+	if (cell.test(idx)) {
+		cell.mask[idx >> 5] &= ~(1u << (idx & 31));
+		cell.noBlocks--;
+		dirty = true;
+	}
+}
+
+void BlockGrid::Clear() {
+
+	GridCell empty = { };
+	empty.noBlocks = EntryAvailable;
+	table.assign(1024, empty);
+	noCells = 0;
+	dirty = true;
+}
+
+int BlockGrid::NumCells() const {
+	return noCells;
+}
+
+void BlockGrid::Upload() {
+
+	if (!dirty)
+		return;
+
+	if (deviceCells.size != table.size())
+		deviceCells.create(table.size());
+	deviceCells.upload(table.data(), table.size());
+	dirty = false;
+}
+
+const DeviceArray<GridCell> & BlockGrid::DeviceCells() const {
+	return deviceCells;
+}
+
+// Cells are tested as spheres against the frustum planes, which keeps
+// every cell holding a visible block. The cells are looked up in the box
+// around the frustum, or all walked when the grid holds fewer of them.
+void BlockGrid::CollectEnteringBlocks(Matrix3f Rview, Matrix3f RviewInv,
+		float3 tview, int cols, int rows, float fx, float fy, float cx, float cy,
+		float depthMin, float depthMax, float blockWidth,
+		std::unordered_set<long long> & cells, std::vector<int3> & blocks) const {
+
+	float cellWidth = blockWidth * CellSize;
+	float radius = 0.5f * sqrtf(3.0f) * cellWidth;
+	float3 planes[4] = {
+		normalised(make_float3(fx, 0, cx)),
+		normalised(make_float3(-fx, 0, cols - cx)),
+		normalised(make_float3(0, fy, cy)),
+		normalised(make_float3(0, -fy, rows - cy))
+	};
+
+	float3 lo = tview, hi = tview;
+	for (int v = 0; v <= rows; v += rows) {
+		for (int u = 0; u <= cols; u += cols) {
+			float3 corner = make_float3((u - cx) / fx, (v - cy) / fy, 1) * depthMax;
+			corner = Rview * corner + tview;
+			lo = fminf(lo, corner);
+			hi = fmaxf(hi, corner);
+		}
+	}
+
+	std::unordered_set<long long> inView;
+	auto visit = [&](const GridCell & cell) {
+		if (cell.noBlocks <= 0)
+			return;
+
+		long long key = Key(cell.pos);
+		float3 centre = (make_float3(cell.pos) + 0.5f) * cellWidth;
+		centre = RviewInv * (centre - tview);
+		if (centre.z + radius < depthMin || centre.z - radius > depthMax)
+			return;
+		for (const float3 & plane : planes)
+			if (plane * centre < -radius)
+				return;
+
+		inView.insert(key);
+		if (cells.count(key))
+			return;
+
+		for (int i = 0; i < GridCell::Size3; ++i) {
+			if (cell.test(i)) {
+				int3 local = make_int3(i % CellSize, i / CellSize % CellSize, i / (CellSize * CellSize));
+				blocks.push_back(cell.pos * CellSize + local);
+			}
+		}
+	};
+
+	int3 begin = make_int3(floor(lo / cellWidth));
+	int3 end = make_int3(floor(hi / cellWidth));
+	size_t noBoxCells = (size_t) (end.x - begin.x + 1) * (end.y - begin.y + 1) * (end.z - begin.z + 1);
+	if (noBoxCells < table.size()) {
+		for (int z = begin.z; z <= end.z; ++z) {
+			for (int y = begin.y; y <= end.y; ++y) {
+				for (int x = begin.x; x <= end.x; ++x) {
+					int slot = Find(make_int3(x, y, z));
+					if (slot != EntryAvailable)
+						visit(table[slot]);
+				}
+			}
+		}
+	} else {
+		for (const GridCell & cell : table)
+			visit(cell);
+	}
+
+	cells.swap(inView);
+}
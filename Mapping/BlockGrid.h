@@ -0,0 +1,66 @@
+#ifndef BLOCKGRID_H__
+#define BLOCKGRID_H__
+
+#include "DeviceMap.h"
+
+#include <vector>
+#include <unordered_set>
+
+// Coarse occupancy of the map with one cell per CellSize^3 blocks and a
+// bit per allocated block. Deleted blocks may keep their bit until they
+// are looked up and found missing, so the grid is only a hint. A copy of
+// the cells is kept on the device for the raycaster to skip empty space.
+class BlockGrid {
+
+public:
+
+	BlockGrid();
+
+	void Insert(const int3 & blockPos);
+
+	void Erase(const int3 & blockPos);
+
+	void Clear();
+
+	int NumCells() const;
+
+	// Brings the device copy of the cells up to date.
+	void Upload();
+
+	const DeviceArray<GridCell> & DeviceCells() const;
+
+	// Appends the blocks of cells in the view frustum that are not in
+	// cells yet, and leaves cells holding the cells in view.
+	void CollectEnteringBlocks(Matrix3f Rview, Matrix3f RviewInv, float3 tview,
+			int cols, int rows, float fx, float fy, float cx, float cy,
+			float depthMin, float depthMax, float blockWidth,
+			std::unordered_set<long long> & cells, std::vector<int3> & blocks) const;
+
+	static long long Key(const int3 & pos);
+
+	static int3 CellPos(const int3 & blockPos);
+
+	static constexpr int CellSize = GridCell::Size;
+
+protected:
+
+	int Find(const int3 & pos) const;
+
+	void Grow();
+
+	std::vector<GridCell> table;
+	int noCells;
+	bool dirty;
+	DeviceArray<GridCell> deviceCells;
+};
+
+// Blocks a camera may see, kept from one visibility update to the next:
+// the blocks of the grid cells that were in view, and the ones allocated
+// since the last update.
+struct VisibleSet {
+	std::vector<int3> blocks;
+	std::vector<int3> newBlocks;
+	std::unordered_set<long long> cells;
+};
+
+#endif
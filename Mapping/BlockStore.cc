@@ -0,0 +1,252 @@
+#include "BlockStore.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sys/stat.h>
+
+static const size_t BlockBytes = sizeof(int3) + sizeof(Voxel) * DeviceMap::BlockSize3;
+
+BlockStore::BlockStore(const std::string & path, size_t maxBytes) :
+		path(path), maxBytes(maxBytes), cachedBytes(0), writingBytes(0),
+		clock(0), generation(0), quit(false) {
+
+	mkdir(path.c_str(), 0755);
+	worker = new std::thread(&BlockStore::Run, this);
+}
+
+BlockStore::~BlockStore() {
+
+	Clear();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond.notify_one();
+	worker->join();
+	delete worker;
+}
+
+std::string BlockStore::FileName(long long key) const {
+	return path + "/chunk" + std::to_string(key) + ".bin";
+}
+
+void BlockStore::Insert(const int3 & blockPos, const Voxel * block) {
+
+	std::unique_lock<std::mutex> lock(mutex);
+	Chunk & chunk = chunks[BlockGrid::Key(BlockGrid::CellPos(blockPos))];
+	chunk.poses.push_back(blockPos);
+	chunk.blocks.insert(chunk.blocks.end(), block, block + DeviceMap::BlockSize3);
+	chunk.lastUsed = ++clock;
+	cachedBytes += BlockBytes;
+	Evict();
+}
+
+uint BlockStore::Fetch(const int3 & pos, float radius, uint maxBlocks,
+		std::vector<int3> & blockPoses, std::vector<Voxel> & blocks) {
+
+	blockPoses.clear();
+	blocks.clear();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (chunks.empty() && onDisk.empty())
+		return 0;
+
+	bool requested = false;
+	int3 centre = BlockGrid::CellPos(pos);
+	int r = (int) ceilf(radius / BlockGrid::CellSize) + 1;
+	for (int z = -r; z <= r; ++z) {
+		for (int y = -r; y <= r; ++y) {
+			for (int x = -r; x <= r; ++x) {
+				int3 chunkPos = centre + make_int3(x, y, z);
+				float3 dist = make_float3(chunkPos * BlockGrid::CellSize) + 0.5f * BlockGrid::CellSize - make_float3(pos);
+				if (norm(dist) > radius)
+					continue;
+
+				long long key = BlockGrid::Key(chunkPos);
+				auto iter = chunks.find(key);
+				if (iter != chunks.end() &&
+					blockPoses.size() + iter->second.poses.size() <= maxBlocks) {
+					Chunk & chunk = iter->second;
+					blockPoses.insert(blockPoses.end(), chunk.poses.begin(), chunk.poses.end());
+					blocks.insert(blocks.end(), chunk.blocks.begin(), chunk.blocks.end());
+					cachedBytes -= chunk.poses.size() * BlockBytes;
+					chunks.erase(iter);
+				}
+
+				if (onDisk.count(key) && !reading.count(key)) {
+					Request request;
+					request.key = key;
+					request.write = false;
+					request.append = false;
+					requests.push_back(std::move(request));
+					reading.insert(key);
+					requested = true;
+				}
+			}
+		}
+	}
+
+	if (requested)
+		cond.notify_one();
+
+	return blockPoses.size();
+}
+
+// Called with the mutex held.
+void BlockStore::Evict() {
+
+	bool evicted = false;
+	while (cachedBytes > maxBytes && !chunks.empty()) {
+		auto lru = chunks.begin();
+		for (auto iter = chunks.begin(); iter != chunks.end(); ++iter)
+			if (iter->second.lastUsed < lru->second.lastUsed)
+				lru = iter;
+
+		size_t bytes = lru->second.poses.size() * BlockBytes;
+		Request request;
+		request.key = lru->first;
+		request.write = true;
+		request.append = onDisk.count(lru->first) > 0;
+		request.chunk = std::move(lru->second);
+		requests.push_back(std::move(request));
+		onDisk.insert(lru->first);
+		chunks.erase(lru);
+		cachedBytes -= bytes;
+		writingBytes += bytes;
+		evicted = true;
+	}
+
+	if (evicted)
+		cond.notify_one();
+}
+
+void BlockStore::ReadChunk(const std::string & name, Chunk & chunk) {
+
+	FILE * file = fopen(name.c_str(), "rb");
+	if (!file)
+		return;
+
+	int3 pos;
+	size_t n = chunk.poses.size();
+	while (fread(&pos, sizeof(int3), 1, file) == 1) {
+		chunk.blocks.resize((n + 1) * DeviceMap::BlockSize3);
+		if (fread(&chunk.blocks[n * DeviceMap::BlockSize3], sizeof(Voxel),
+				DeviceMap::BlockSize3, file) != DeviceMap::BlockSize3)
+			break;
+		chunk.poses.push_back(pos);
+		n++;
+	}
+	chunk.blocks.resize(n * DeviceMap::BlockSize3);
+	fclose(file);
+}
+
+// Requests are served in order, so a chunk is read back only after every
+// write queued for it before the read has reached the file.
+void BlockStore::Run() {
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+
+		idle.notify_all();
+		cond.wait(lock, [this] { return quit || !requests.empty(); });
+		if (quit)
+			return;
+
+		Request request = std::move(requests.front());
+		requests.pop_front();
+		int gen = generation;
+		std::string name = FileName(request.key);
+		lock.unlock();
+
+		if (request.write) {
+			const Chunk & chunk = request.chunk;
+			FILE * file = fopen(name.c_str(), request.append ? "ab" : "wb");
+			if (file) {
+				for (size_t i = 0; i < chunk.poses.size(); ++i) {
+					fwrite(&chunk.poses[i], sizeof(int3), 1, file);
+					fwrite(&chunk.blocks[i * DeviceMap::BlockSize3], sizeof(Voxel),
+							DeviceMap::BlockSize3, file);
+				}
+				fclose(file);
+			} else
+				std::cout << "Failed to write " << name << std::endl;
+
+			lock.lock();
+			writingBytes -= chunk.poses.size() * BlockBytes;
+			if (gen != generation)
+				remove(name.c_str());
+		} else {
+			Chunk chunk;
+			ReadChunk(name, chunk);
+			remove(name.c_str());
+
+			lock.lock();
+			reading.erase(request.key);
+			if (gen != generation)
+				continue;
+
+			bool written = false;
+			for (const Request & r : requests)
+				written = written || (r.write && r.key == request.key);
+			if (!written)
+				onDisk.erase(request.key);
+
+			Chunk & dst = chunks[request.key];
+			dst.poses.insert(dst.poses.end(), chunk.poses.begin(), chunk.poses.end());
+			dst.blocks.insert(dst.blocks.end(), chunk.blocks.begin(), chunk.blocks.end());
+			dst.lastUsed = ++clock;
+			cachedBytes += chunk.poses.size() * BlockBytes;
+			Evict();
+		}
+	}
+}
+
+// The lock is held throughout, so the worker stays idle and no chunk
+// moves between memory and disk while the blocks are visited.
+void BlockStore::ForEach(const std::function<void(const int3 &, const Voxel *)> & visit) {
+
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] {
+		return quit || (requests.empty() && reading.empty() && writingBytes == 0);
+	});
+
+	for (const auto & entry : chunks)
+		for (size_t i = 0; i < entry.second.poses.size(); ++i)
+			visit(entry.second.poses[i], &entry.second.blocks[i * DeviceMap::BlockSize3]);
+
+	for (long long key : onDisk) {
+		Chunk chunk;
+		ReadChunk(FileName(key), chunk);
+		for (size_t i = 0; i < chunk.poses.size(); ++i)
+			visit(chunk.poses[i], &chunk.blocks[i * DeviceMap::BlockSize3]);
+	}
+}
+
+void BlockStore::Clear() {
+
+	std::unique_lock<std::mutex> lock(mutex);
+	generation++;
+	for (const Request & request : requests)
+		if (request.write)
+			writingBytes -= request.chunk.poses.size() * BlockBytes;
+
+	for (long long key : onDisk)
+		remove(FileName(key).c_str());
+
+	requests.clear();
+	chunks.clear();
+	onDisk.clear();
+	reading.clear();
+	cachedBytes = 0;
+}
+
+size_t BlockStore::CachedBytes() const {
+	std::unique_lock<std::mutex> lock(mutex);
+	return cachedBytes + writingBytes;
+}
+
+int BlockStore::NumChunksOnDisk() const {
+	std::unique_lock<std::mutex> lock(mutex);
+	return onDisk.size();
+}
@@ -0,0 +1,90 @@
+#ifndef BLOCKSTORE_H__
+#define BLOCKSTORE_H__
+
+#include "BlockGrid.h"
+
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+// Host side store of voxel blocks streamed out of the map. Blocks are kept
+// in chunks, one per BlockGrid cell; once the chunks in memory pass maxBytes
+// the least recently used ones are written to one file each under path.
+// Files are written and read back by a worker thread, so neither Insert
+// nor Fetch waits on the disk.
+class BlockStore {
+
+public:
+
+	BlockStore(const std::string & path, size_t maxBytes);
+
+	~BlockStore();
+
+	void Insert(const int3 & blockPos, const Voxel * block);
+
+	// Takes out the chunks whose centre lies within radius blocks of pos,
+	// as long as they add up to at most maxBlocks blocks. Chunks on disk
+	// are queued for reading and returned by a later call.
+	uint Fetch(const int3 & pos, float radius, uint maxBlocks,
+			std::vector<int3> & blockPoses, std::vector<Voxel> & blocks);
+
+	// Has visit see every stored block, in memory or on disk, leaving it
+	// stored. Waits for the worker to finish the requests queued so far.
+	void ForEach(const std::function<void(const int3 &, const Voxel *)> & visit);
+
+	void Clear();
+
+	size_t CachedBytes() const;
+
+	int NumChunksOnDisk() const;
+
+protected:
+
+	struct Chunk {
+		Chunk() : lastUsed(0) {}
+		std::vector<int3> poses;
+		std::vector<Voxel> blocks;
+		size_t lastUsed;
+	};
+
+	struct Request {
+		long long key;
+		bool write;
+		bool append;
+		Chunk chunk;
+	};
+
+	std::string FileName(long long key) const;
+
+	static void ReadChunk(const std::string & name, Chunk & chunk);
+
+	void Evict();
+
+	void Run();
+
+	std::string path;
+	size_t maxBytes;
+	size_t cachedBytes;
+	size_t writingBytes;
+	size_t clock;
+	int generation;
+	bool quit;
+
+	std::unordered_map<long long, Chunk> chunks;
+	std::unordered_set<long long> onDisk;
+	std::unordered_set<long long> reading;
+	std::deque<Request> requests;
+
+	mutable std::mutex mutex;
+	std::condition_variable cond;
+	std::condition_variable idle;
+	std::thread * worker;
+};
+
+#endif
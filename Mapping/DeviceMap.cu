@@ -1,11 +1,22 @@
 #include "DeviceMap.h"
 
+#ifdef HOST_BACKEND
+#include <thread>
+#endif
+
+bool DeviceMap::verbose = false;
+
 __device__ uint DeviceMap::Hash(const int3 & pos) {
+#ifdef HOST_BACKEND
+	const int size = hashEntries.size;
+#else
+	const int size = bucketMutex.size;
+#endif
 	int res = ((pos.x * 73856093) ^ (pos.y * 19349669) ^ (pos.z * 83492791))
-			% NumBuckets;
+			% size;
 
 	if (res < 0)
-		res += NumBuckets;
+		res += size;
 	return res;
 }
 
@@ -14,12 +25,205 @@ __device__ HashEntry DeviceMap::CreateEntry(const int3 & pos,
 	int old = atomicSub(heapCounter, 1);
 	if (old >= 0) {
 		int ptr = heapMem[old];
-		if (ptr != -1)
+		if (ptr != -1) {
+			if (allocLog.size) {
+				int i = atomicAdd(noAllocs, 1);
+				if (i < (int) allocLog.size)
+					allocLog[i] = pos;
+			}
 			return HashEntry(pos, ptr * BlockSize3, offset);
+		}
 	}
-	return HashEntry(pos, EntryAvailable, 0);
+	else
+		atomicAdd(heapCounter, 1);
+	return HashEntry(pos, EntryAvailable, offset);
+}
+
+// Slot of the grid cell at cellPos, EntryAvailable if there is none.
+__device__ int DeviceMap::FindCell(const int3 & cellPos) const {
+	uint slot = GridCell::Hash(cellPos, gridCells.size);
+	while (gridCells[slot].noBlocks != EntryAvailable) {
+		if (gridCells[slot].pos == cellPos)
+			return slot;
+		slot = (slot + 1) & (gridCells.size - 1);
+	}
+	return EntryAvailable;
+}
+
+// 2 if no block of the grid cell holding blockPos is allocated, 1 if only
+// blockPos is free and 0 if it may be allocated. cellCache keeps the cell
+// looked up last, with its slot as ptr.
+__device__ int DeviceMap::FindEmptyLevel(const int3 & blockPos, HashEntry & cellCache) const {
+	if (gridCells.size == 0)
+		return 0;
+
+	int3 cellPos = blockPosToCellPos(blockPos);
+	if (!(cellCache.pos == cellPos))
+		cellCache = HashEntry(cellPos, FindCell(cellPos), 0);
+
+	if (cellCache.ptr == EntryAvailable)
+		return 2;
+
+	const GridCell & cell = gridCells[cellCache.ptr];
+	if (cell.noBlocks == 0)
+		return 2;
+
+	return cell.test(GridCell::LocalIdx(blockPos, cellPos)) ? 0 : 1;
+}
+
+// Lower edge of cell k of size voxels along one axis. Positions map to the
+// voxel they truncate to, so the cells next to zero reach one voxel further.
+static __device__ __forceinline__ float CellEdge(int k, int size) {
+	return (float) (k * size - (k <= 0 ? 1 : 0));
+}
+
+static __device__ __forceinline__ float ExitDist(float p, float d, int k, int size) {
+	if (d > 0)
+		return (CellEdge(k + 1, size) - p) / d;
+	if (d < 0)
+		return (CellEdge(k, size) - p) / d;
+	return 1e10f;
 }
 
+// Walks the ray from pos along dir, both in voxels, over empty grid cells
+// and blocks, testing only the bits of the cells it passes. Returns how
+// far it got, at most a little past maxDist, or 0 if the block at pos may
+// be allocated.
+__device__ float DeviceMap::FindEmptySpan(const float3 & pos, const float3 & dir,
+		float maxDist, HashEntry & cellCache) const {
+	float dist = 0;
+	int3 blockPos = voxelPosToBlockPos(make_int3(pos));
+	while (dist < maxDist) {
+		int level = FindEmptyLevel(blockPos, cellCache);
+		if (level == 0)
+			break;
+
+		int size = (int) BlockSize;
+		int3 k = blockPos;
+		if (level == 2) {
+			size *= GridCell::Size;
+			k = cellCache.pos;
+		}
+
+		float3 pt = pos + dist * dir;
+		float exit = fminf(ExitDist(pt.x, dir.x, k.x, size),
+					 fminf(ExitDist(pt.y, dir.y, k.y, size), ExitDist(pt.z, dir.z, k.z, size)));
+		dist += fmaxf(exit, 0.0f) + 1e-2f;
+		blockPos = voxelPosToBlockPos(make_int3(pos + dist * dir));
+	}
+	return dist;
+}
+
+__device__ void DeviceMap::ReleaseBlock(int ptr) {
+	for (uint i = 0; i < BlockSize3; ++i)
+		SetVoxel(ptr, i, Voxel());
+	int top = atomicAdd(heapCounter, 1) + 1;
+	heapMem[top] = ptr / BlockSize3;
+}
+
+#ifdef HOST_BACKEND
+// The host backend drops the bucket chains for open addressing over all
+// hash entries. A thread claims an empty slot by swapping its ptr from
+// EntryAvailable to EntryOccupied, writes the position and then publishes
+// the block pointer, so no request is ever dropped while the heap lasts.
+// Lookups never write and treat a slot that is still being filled as a
+// miss. Slots are only claimed while blocks remain, so probing always
+// reaches an empty slot.
+unsigned long DeviceMap::noSlotConflicts = 0;
+
+__device__ void DeviceMap::CreateBlock(const int3& blockPos) {
+	uint slot = Hash(blockPos);
+	while (true) {
+		HashEntry* e = &hashEntries[slot];
+		int ptr = __atomic_load_n(&e->ptr, __ATOMIC_ACQUIRE);
+		if (ptr == EntryAvailable) {
+			if (atomicCAS(&e->ptr, EntryAvailable, EntryOccupied) == EntryAvailable) {
+				e->pos = blockPos;
+				e->offset = 0;
+				ptr = CreateEntry(blockPos, 0).ptr;
+				__atomic_store_n(&e->ptr, ptr, __ATOMIC_RELEASE);
+				if (ptr != EntryAvailable && insertLog.size) {
+					int i = atomicAdd(noLoggedInserts, 1);
+					if (i < (int) insertLog.size)
+						insertLog[i] = blockPos;
+				}
+				return;
+			}
+			__atomic_fetch_add(&noSlotConflicts, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// Another thread is filling this slot and it may be the same block.
+		if (ptr == EntryOccupied) {
+			__atomic_fetch_add(&noSlotConflicts, 1, __ATOMIC_RELAXED);
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (e->pos == blockPos)
+			return;
+
+		slot = slot + 1 == hashEntries.size ? 0 : slot + 1;
+	}
+}
+
+__device__ HashEntry DeviceMap::FindEntry(const int3& blockPos) {
+	uint slot = Hash(blockPos);
+	while (true) {
+		const HashEntry* e = &hashEntries[slot];
+		int ptr = __atomic_load_n(&e->ptr, __ATOMIC_ACQUIRE);
+		if (ptr == EntryAvailable)
+			return HashEntry(blockPos, EntryAvailable, 0);
+
+		if (ptr != EntryOccupied && e->pos == blockPos)
+			return HashEntry(blockPos, ptr, e->offset);
+
+		slot = slot + 1 == hashEntries.size ? 0 : slot + 1;
+	}
+}
+
+// Fills a table that nobody else is reading yet, used when rebuilding.
+__device__ void DeviceMap::InsertEntry(const HashEntry & entry) {
+	uint slot = Hash(entry.pos);
+	while (hashEntries[slot].ptr != EntryAvailable) {
+		if (hashEntries[slot].pos == entry.pos)
+			return;
+		slot = slot + 1 == hashEntries.size ? 0 : slot + 1;
+	}
+	hashEntries[slot] = HashEntry(entry.pos, entry.ptr, 0);
+}
+
+// Not safe to run alongside CreateBlock. Entries after the hole are moved
+// back into it unless that would put them before their home slot, so
+// every remaining block stays reachable without tombstones.
+__device__ void DeviceMap::DeleteBlock(const int3& blockPos) {
+	uint hole = Hash(blockPos);
+	while (!(hashEntries[hole].pos == blockPos && hashEntries[hole].ptr != EntryAvailable)) {
+		if (hashEntries[hole].ptr == EntryAvailable)
+			return;
+		hole = hole + 1 == hashEntries.size ? 0 : hole + 1;
+	}
+
+	ReleaseBlock(hashEntries[hole].ptr);
+
+	uint slot = hole;
+	while (true) {
+		slot = slot + 1 == hashEntries.size ? 0 : slot + 1;
+		HashEntry* e = &hashEntries[slot];
+		if (e->ptr == EntryAvailable)
+			break;
+
+		uint home = Hash(e->pos);
+		bool reachable = hole <= slot ? (home > hole && home <= slot) :
+										(home > hole || home <= slot);
+		if (!reachable) {
+			hashEntries[hole] = *e;
+			hole = slot;
+		}
+	}
+	hashEntries[hole].release();
+}
+#else
 __device__ void DeviceMap::CreateBlock(const int3& blockPos) {
 	int bucketId = Hash(blockPos);
 	int* mutex = &bucketMutex[bucketId];
@@ -32,7 +236,7 @@ __device__ void DeviceMap::CreateBlock(const int3& blockPos) {
 		eEmpty = e;
 
 	while (e->offset > 0) {
-		bucketId = NumBuckets + e->offset - 1;
+		bucketId = bucketMutex.size + e->offset - 1;
 		e = &hashEntries[bucketId];
 		if (e->pos == blockPos && e->ptr != EntryAvailable)
 			return;
@@ -44,15 +248,15 @@ __device__ void DeviceMap::CreateBlock(const int3& blockPos) {
 	if (eEmpty) {
 		int old = atomicExch(mutex, EntryOccupied);
 		if (old == EntryAvailable) {
-			*eEmpty = CreateEntry(blockPos, e->offset);
+			*eEmpty = CreateEntry(blockPos, eEmpty->offset);
 			atomicExch(mutex, EntryAvailable);
 		}
 	} else {
 		int old = atomicExch(mutex, EntryOccupied);
 		if (old == EntryAvailable) {
 			int offset = atomicAdd(entryPtr, 1);
-			if (offset <= NumExcess) {
-				eEmpty = &hashEntries[NumBuckets + offset - 1];
+			if (offset <= hashEntries.size - bucketMutex.size) {
+				eEmpty = &hashEntries[bucketMutex.size + offset - 1];
 				*eEmpty = CreateEntry(blockPos, 0);
 				e->offset = offset;
 			}
@@ -61,6 +265,41 @@ __device__ void DeviceMap::CreateBlock(const int3& blockPos) {
 	}
 }
 
+__device__ HashEntry DeviceMap::FindEntry(const int3& blockPos) {
+	uint bucketId = Hash(blockPos);
+	HashEntry* e = &hashEntries[bucketId];
+	if (e->ptr != EntryAvailable && e->pos == blockPos)
+		return *e;
+
+	while (e->offset > 0) {
+		bucketId = bucketMutex.size + e->offset - 1;
+		e = &hashEntries[bucketId];
+		if (e->pos == blockPos && e->ptr != EntryAvailable)
+			return *e;
+	}
+	return HashEntry(blockPos, EntryAvailable, 0);
+}
+
+// Released entries keep their offset so the rest of the chain stays
+// linked; CreateBlock fills such holes before growing the chain.
+__device__ void DeviceMap::DeleteBlock(const int3& blockPos) {
+	uint bucketId = Hash(blockPos);
+	HashEntry* e = &hashEntries[bucketId];
+	while (true) {
+		if (e->pos == blockPos && e->ptr != EntryAvailable) {
+			ReleaseBlock(e->ptr);
+			e->release();
+			return;
+		}
+
+		if (e->offset <= 0)
+			return;
+
+		e = &hashEntries[bucketMutex.size + e->offset - 1];
+	}
+}
+#endif
+
 __device__ bool DeviceMap::FindVoxel(const float3 & pos, Voxel & vox) {
 	int3 voxel_pos = worldPosToVoxelPos(pos);
 	return FindVoxel(voxel_pos, vox);
@@ -70,8 +309,7 @@ __device__ bool DeviceMap::FindVoxel(const int3 & pos, Voxel & vox) {
 	HashEntry entry = FindEntry(voxelPosToBlockPos(pos));
 	if (entry.ptr == EntryAvailable)
 		return false;
-	int idx = voxelPosToLocalIdx(pos);
-	vox = voxelBlocks[entry.ptr + idx];
+	vox = GetVoxel(entry.ptr, voxelPosToLocalIdx(pos));
 	return true;
 }
 
@@ -80,7 +318,7 @@ __device__ Voxel DeviceMap::FindVoxel(const int3 & pos) {
 	Voxel voxel;
 	if (entry.ptr == EntryAvailable)
 		return voxel;
-	return voxelBlocks[entry.ptr + voxelPosToLocalIdx(pos)];
+	return GetVoxel(entry.ptr, voxelPosToLocalIdx(pos));
 }
 
 __device__ Voxel DeviceMap::FindVoxel(const float3 & pos) {
@@ -91,7 +329,7 @@ __device__ Voxel DeviceMap::FindVoxel(const float3 & pos) {
 	if (entry.ptr == EntryAvailable)
 		return voxel;
 
-	return voxelBlocks[entry.ptr + voxelPosToLocalIdx(p)];
+	return GetVoxel(entry.ptr, voxelPosToLocalIdx(p));
 }
 
 __device__ Voxel DeviceMap::FindVoxel(const float3 & pos, HashEntry & cache, bool & valid) {
@@ -99,7 +337,7 @@ __device__ Voxel DeviceMap::FindVoxel(const float3 & pos, HashEntry & cache, boo
 	int3 blockPos = voxelPosToBlockPos(p);
 	if(blockPos == cache.pos) {
 		valid = true;
-		return voxelBlocks[cache.ptr + voxelPosToLocalIdx(p)];
+		return GetVoxel(cache.ptr, voxelPosToLocalIdx(p));
 	}
 
 	HashEntry entry = FindEntry(blockPos);
@@ -110,41 +348,101 @@ __device__ Voxel DeviceMap::FindVoxel(const float3 & pos, HashEntry & cache, boo
 
 	valid = true;
 	cache = entry;
-	return voxelBlocks[entry.ptr + voxelPosToLocalIdx(p)];
+	return GetVoxel(entry.ptr, voxelPosToLocalIdx(p));
 }
 
-__device__ HashEntry DeviceMap::FindEntry(const float3 & pos) {
-	int3 blockIdx = worldPosToBlockPos(pos);
+// Same as FindVoxel, but only reads the sdf; NaN where nothing is fused.
+__device__ float DeviceMap::FindSdf(const int3 & pos) {
+	HashEntry entry = FindEntry(voxelPosToBlockPos(pos));
+	if (entry.ptr == EntryAvailable)
+		return std::nanf("0x7fffffff");
+	return GetSdf(entry.ptr, voxelPosToLocalIdx(pos));
+}
 
-	return FindEntry(blockIdx);
+__device__ float DeviceMap::FindSdf(const float3 & pos, HashEntry & cache, bool & valid) {
+	int3 p = make_int3(pos);
+	int3 blockPos = voxelPosToBlockPos(p);
+	if(blockPos == cache.pos) {
+		valid = true;
+		return GetSdf(cache.ptr, voxelPosToLocalIdx(p));
+	}
+
+	HashEntry entry = FindEntry(blockPos);
+	if (entry.ptr == EntryAvailable) {
+		valid = false;
+		return std::nanf("0x7fffffff");
+	}
+
+	valid = true;
+	cache = entry;
+	return GetSdf(entry.ptr, voxelPosToLocalIdx(p));
 }
 
-__device__ HashEntry DeviceMap::FindEntry(const int3& blockPos) {
-	uint bucketId = Hash(blockPos);
-	HashEntry* e = &hashEntries[bucketId];
-	if (e->ptr != EntryAvailable && e->pos == blockPos)
-		return *e;
+// Block pointer of blockPos through the window of cache, EntryAvailable
+// if the block is not allocated.
+__device__ int DeviceMap::FindBlock(const int3 & blockPos, BlockCache & cache) {
+	int3 d = blockPos + cache.base * -1;
+	if (d.x < 0 || d.x > 1 || d.y < 0 || d.y > 1 || d.z < 0 || d.z > 1) {
+		cache.base = blockPos;
+		cache.resolved = 0;
+		d = make_int3(0);
+	}
 
-	while (e->offset > 0) {
-		bucketId = NumBuckets + e->offset - 1;
-		e = &hashEntries[bucketId];
-		if (e->pos == blockPos && e->ptr != EntryAvailable)
-			return *e;
+	int k = (d.z * 2 + d.y) * 2 + d.x;
+	if (!(cache.resolved & (1 << k))) {
+		cache.ptr[k] = FindEntry(blockPos).ptr;
+		cache.resolved |= 1 << k;
 	}
-	return HashEntry(blockPos, EntryAvailable, 0);
+
+	return cache.ptr[k];
+}
+
+// Starts the window of cache at the block holding voxel pos.
+__device__ void DeviceMap::MoveCache(const int3 & pos, BlockCache & cache) const {
+	int3 base = voxelPosToBlockPos(pos);
+	if (!(base == cache.base)) {
+		cache.base = base;
+		cache.resolved = 0;
+	}
+}
+
+__device__ float DeviceMap::FindSdf(const int3 & pos, BlockCache & cache, bool & valid) {
+	int ptr = FindBlock(voxelPosToBlockPos(pos), cache);
+	valid = ptr != EntryAvailable;
+	if (!valid)
+		return std::nanf("0x7fffffff");
+	return GetSdf(ptr, voxelPosToLocalIdx(pos));
+}
+
+__device__ float DeviceMap::FindSdf(const float3 & pos, BlockCache & cache, bool & valid) {
+	return FindSdf(make_int3(pos), cache, valid);
+}
+
+__device__ Voxel DeviceMap::FindVoxel(const int3 & pos, BlockCache & cache, bool & valid) {
+	int ptr = FindBlock(voxelPosToBlockPos(pos), cache);
+	valid = ptr != EntryAvailable;
+	if (!valid)
+		return Voxel();
+	return GetVoxel(ptr, voxelPosToLocalIdx(pos));
+}
+
+__device__ HashEntry DeviceMap::FindEntry(const float3 & pos) {
+	int3 blockIdx = worldPosToBlockPos(pos);
+
+	return FindEntry(blockIdx);
 }
 
 __device__ int3 DeviceMap::worldPosToVoxelPos(float3 pos) const {
-	float3 p = pos / VoxelSize;
+	float3 p = pos / voxelSize;
 	return make_int3(p);
 }
 
 __device__ float3 DeviceMap::worldPosToVoxelPosF(float3 pos) const {
-	return pos / VoxelSize;
+	return pos / voxelSize;
 }
 
 __device__ float3 DeviceMap::voxelPosToWorldPos(int3 pos) const {
-	return pos * VoxelSize;
+	return pos * voxelSize;
 }
 
 __device__ int3 DeviceMap::voxelPosToBlockPos(const int3 & pos) const {
@@ -164,6 +462,19 @@ __device__ int3 DeviceMap::blockPosToVoxelPos(const int3 & pos) const {
 	return pos * BlockSize;
 }
 
+__device__ int3 DeviceMap::blockPosToCellPos(const int3 & pos) const {
+	int3 cell = pos;
+
+	if (cell.x < 0)
+		cell.x -= GridCell::Size - 1;
+	if (cell.y < 0)
+		cell.y -= GridCell::Size - 1;
+	if (cell.z < 0)
+		cell.z -= GridCell::Size - 1;
+
+	return cell / GridCell::Size;
+}
+
 __device__ int3 DeviceMap::voxelPosToLocalPos(const int3 & pos) const {
 	int3 local = pos % BlockSize;
 
@@ -200,6 +511,14 @@ __device__ int DeviceMap::voxelPosToLocalIdx(const int3 & pos) const {
 	return localPosToLocalIdx(voxelPosToLocalPos(pos));
 }
 
+void DeviceMap::SetConfig(const MapConfig & config) {
+	voxelSize = config.voxelSize;
+	voxelSizeInv = 1.0 / voxelSize;
+	blockWidth = voxelSize * BlockSize;
+	truncateDist = config.truncateDist;
+	stepScale = 0.5 * truncateDist * voxelSizeInv;
+}
+
 ///////////////////////////////////////////////////////
 // Implementation - Key Maps
 ///////////////////////////////////////////////////////
@@ -287,10 +606,10 @@ __device__ void KeyMap::InsertKey(SURF * key, int & hashIndex) {
 
 __device__ void KeyMap::ResetKeys(int index) {
 
-	if (index < Mutex.size)
+	if (index < (int) Mutex.size)
 		Mutex[index] = -1;
 
-	if (index < Keys.size) {
+	if (index < (int) Keys.size) {
 		Keys[index].valid = false;
 	}
 }
@@ -8,6 +8,22 @@
 
 enum ENTRYTYPE { EntryAvailable = -1, EntryOccupied = -2 };
 
+enum MAPTYPE { MapDefault = 0, MapFine = 1, MapCoarse = 2 };
+
+// Resolution of the dense map, picked at start-up by MAPTYPE.
+struct MapConfig {
+
+	float voxelSize;
+
+	float truncateDist;
+};
+
+static const MapConfig MapConfigs[] = {
+	{ 0.006f, 0.048f },  // room scale
+	{ 0.004f, 0.024f },  // object capture
+	{ 0.02f, 0.08f }     // large scans such as warehouses
+};
+
 struct __align__(8) RenderingBlock {
 
 	short2 upperLeft;
@@ -58,13 +74,15 @@ struct __align__(16) HashEntry {
 	int  offset;
 };
 
-struct __align__(8) Voxel {
+struct __align__(8) FloatVoxel {
+
+	static constexpr int MaxWeight = 255;
 
-	__device__ __forceinline__ Voxel() :
+	__device__ __forceinline__ FloatVoxel() :
 			sdf(std::nanf("0x7fffffff")), weight(0), color(make_uchar3(0)) {
 	}
 
-	__device__ __forceinline__ Voxel(float sdf_, short weight_, uchar3 color_) :
+	__device__ __forceinline__ FloatVoxel(float sdf_, short weight_, uchar3 color_) :
 			sdf(sdf_), weight(weight_), color(color_) {
 	}
 
@@ -79,12 +97,45 @@ struct __align__(8) Voxel {
 		color_ = color;
 	}
 
-	__device__ __forceinline__ void operator=(const Voxel & other) {
+	__device__ __forceinline__ float getSdf() const {
+		return sdf;
+	}
+
+	__device__ __forceinline__ int getWeight() const {
+		return weight;
+	}
+
+	__device__ __forceinline__ uchar3 getColor() const {
+		return color;
+	}
+
+	__device__ __forceinline__ void operator=(const FloatVoxel & other) {
 		sdf = other.sdf;
 		weight = other.weight;
 		color = other.color;
 	}
 
+	// Split layout of a block of n voxels: all sdfs, then weights, then colours.
+	static __device__ __forceinline__ float LoadSdf(const FloatVoxel * block, int n, int i) {
+		return ((const float*) block)[i];
+	}
+
+	static __device__ __forceinline__ FloatVoxel Load(const FloatVoxel * block, int n, int i) {
+		const float * sdf = (const float*) block;
+		const unsigned char * weight = (const unsigned char*) (sdf + n);
+		const uchar3 * color = (const uchar3*) (weight + n);
+		return FloatVoxel(sdf[i], weight[i], color[i]);
+	}
+
+	static __device__ __forceinline__ void Store(FloatVoxel * block, int n, int i, const FloatVoxel & voxel) {
+		float * sdf = (float*) block;
+		unsigned char * weight = (unsigned char*) (sdf + n);
+		uchar3 * color = (uchar3*) (weight + n);
+		sdf[i] = voxel.sdf;
+		weight[i] = voxel.weight;
+		color[i] = voxel.color;
+	}
+
 	float sdf;
 
 	unsigned char weight;
@@ -92,6 +143,135 @@ struct __align__(8) Voxel {
 	uchar3 color;
 };
 
+// Half the size of FloatVoxel: a 12 bit normalised sdf and a 4 bit weight
+// share one short, colour is RGB565. The sdf step is 1/2047 of the
+// truncation distance; the low weight cap keeps averaging updates above
+// that step. Reads of an unobserved voxel give a NaN sdf like FloatVoxel.
+struct __align__(4) CompactVoxel {
+
+	static constexpr int MaxWeight = 15;
+
+	__device__ __forceinline__ CompactVoxel() :
+			sdfWeight(0), rgb(0) {
+	}
+
+	__device__ __forceinline__ CompactVoxel(float sdf_, short weight_, uchar3 color_) {
+		int val = __float2int_rn(fmaxf(-1.0f, fminf(1.0f, sdf_)) * 2047.0f);
+		sdfWeight = (short) (val * 16 | (weight_ < MaxWeight ? weight_ : MaxWeight));
+		int r = (color_.x * 31 + 127) / 255;
+		int g = (color_.y * 63 + 127) / 255;
+		int b = (color_.z * 31 + 127) / 255;
+		rgb = (unsigned short) ((r << 11) | (g << 5) | b);
+	}
+
+	__device__ __forceinline__ void release() {
+		sdfWeight = 0;
+		rgb = 0;
+	}
+
+	__device__ __forceinline__ void getValue(float & sdf_, uchar3 & color_) const {
+		sdf_ = getSdf();
+		color_ = getColor();
+	}
+
+	__device__ __forceinline__ float getSdf() const {
+		if (getWeight() == 0)
+			return std::nanf("0x7fffffff");
+		return (sdfWeight >> 4) * (1.0f / 2047.0f);
+	}
+
+	__device__ __forceinline__ int getWeight() const {
+		return sdfWeight & 0xf;
+	}
+
+	__device__ __forceinline__ uchar3 getColor() const {
+		int r = rgb >> 11, g = (rgb >> 5) & 0x3f, b = rgb & 0x1f;
+		return make_uchar3((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+	}
+
+	__device__ __forceinline__ void operator=(const CompactVoxel & other) {
+		sdfWeight = other.sdfWeight;
+		rgb = other.rgb;
+	}
+
+	// Split layout of a block of n voxels: all sdf-weight pairs, then colours.
+	static __device__ __forceinline__ float LoadSdf(const CompactVoxel * block, int n, int i) {
+		CompactVoxel voxel;
+		voxel.sdfWeight = ((const short*) block)[i];
+		return voxel.getSdf();
+	}
+
+	static __device__ __forceinline__ CompactVoxel Load(const CompactVoxel * block, int n, int i) {
+		CompactVoxel voxel;
+		voxel.sdfWeight = ((const short*) block)[i];
+		voxel.rgb = ((const unsigned short*) block)[n + i];
+		return voxel;
+	}
+
+	static __device__ __forceinline__ void Store(CompactVoxel * block, int n, int i, const CompactVoxel & voxel) {
+		((short*) block)[i] = voxel.sdfWeight;
+		((unsigned short*) block)[n + i] = voxel.rgb;
+	}
+
+	short sdfWeight;
+
+	unsigned short rgb;
+};
+
+#ifdef COMPACT_VOXEL
+typedef CompactVoxel Voxel;
+#else
+typedef FloatVoxel Voxel;
+#endif
+
+// Cell of the coarse occupancy grid kept by BlockGrid, with a bit for
+// each of its Size^3 blocks that is allocated. Cells live in an open
+// addressed table of power of two size; noBlocks is EntryAvailable for an
+// empty slot.
+struct GridCell {
+
+	static constexpr int Size = 8;
+	static constexpr int Size3 = Size * Size * Size;
+
+	static __host__ __device__ __forceinline__ uint Hash(const int3 & pos, uint size) {
+		return (((uint) pos.x * 73856093u) ^ ((uint) pos.y * 19349669u)
+				^ ((uint) pos.z * 83492791u)) & (size - 1);
+	}
+
+	static __host__ __device__ __forceinline__ int LocalIdx(const int3 & blockPos, const int3 & cellPos) {
+		int3 local = blockPos + cellPos * -Size;
+		return (local.z * Size + local.y) * Size + local.x;
+	}
+
+	__host__ __device__ __forceinline__ bool test(int idx) const {
+		return (mask[idx >> 5] >> (idx & 31)) & 1;
+	}
+
+	int3 pos;
+
+	int noBlocks;
+
+	uint mask[Size3 / 32];
+};
+
+// Pointers of the 2x2x2 voxel blocks from base on, each looked up the
+// first time one of its voxels is read. Trilinear reads and central
+// differences around a point fall within one such window, so they cost a
+// hash lookup per block rather than one per voxel. A read outside the
+// window moves it to start at the block read.
+struct BlockCache {
+
+	__device__ __forceinline__ BlockCache() :
+			base(make_int3(0)), resolved(0) {
+	}
+
+	int3 base;
+
+	int ptr[8];
+
+	int resolved;
+};
+
 struct KeyPoint {
 
 };
@@ -113,16 +293,32 @@ struct DeviceMap {
 	__device__ Voxel FindVoxel(const int3 & pos);
 	__device__ Voxel FindVoxel(const float3 & pos);
 	__device__ Voxel FindVoxel(const float3 & pos, HashEntry & cache, bool & valid);
+	__device__ float FindSdf(const int3 & pos);
+	__device__ float FindSdf(const float3 & pos, HashEntry & cache, bool & valid);
+	__device__ float FindSdf(const int3 & pos, BlockCache & cache, bool & valid);
+	__device__ float FindSdf(const float3 & pos, BlockCache & cache, bool & valid);
+	__device__ Voxel FindVoxel(const int3 & pos, BlockCache & cache, bool & valid);
+	__device__ int FindBlock(const int3 & blockPos, BlockCache & cache);
+	__device__ void MoveCache(const int3 & pos, BlockCache & cache) const;
 	__device__ HashEntry FindEntry(const int3 & pos);
 	__device__ HashEntry FindEntry(const float3 & pos);
 	__device__ void CreateBlock(const int3 & blockPos);
 	__device__ bool FindVoxel(const int3 & pos, Voxel & vox);
 	__device__ bool FindVoxel(const float3 & pos, Voxel & vox);
 	__device__ HashEntry CreateEntry(const int3 & pos, const int & offset);
+	__device__ void DeleteBlock(const int3 & blockPos);
+	__device__ void ReleaseBlock(int ptr);
+	__device__ int FindCell(const int3 & cellPos) const;
+	__device__ int FindEmptyLevel(const int3 & blockPos, HashEntry & cellCache) const;
+	__device__ float FindEmptySpan(const float3 & pos, const float3 & dir, float maxDist, HashEntry & cellCache) const;
+#ifdef HOST_BACKEND
+	__device__ void InsertEntry(const HashEntry & entry);
+#endif
 
 	__device__ int3 worldPosToVoxelPos(float3 pos) const;
 	__device__ int3 voxelPosToBlockPos(const int3 & pos) const;
 	__device__ int3 blockPosToVoxelPos(const int3 & pos) const;
+	__device__ int3 blockPosToCellPos(const int3 & pos) const;
 	__device__ int3 voxelPosToLocalPos(const int3 & pos) const;
 	__device__ int3 localIdxToLocalPos(const int & idx) const;
 	__device__ int3 worldPosToBlockPos(const float3 & pos) const;
@@ -132,23 +328,49 @@ struct DeviceMap {
 	__device__ int localPosToLocalIdx(const int3 & pos) const;
 	__device__ int voxelPosToLocalIdx(const int3 & pos) const;
 
+	void SetConfig(const MapConfig & config);
+
+	// Voxel idx of the block starting at ptr. With SPLIT_VOXEL_BLOCKS each
+	// block keeps its sdfs apart from the colours, so reading only the sdf
+	// touches fewer cache lines; the block still takes BlockSize3 voxels.
+	__device__ __forceinline__ Voxel GetVoxel(int ptr, int idx) const {
+#ifdef SPLIT_VOXEL_BLOCKS
+		return Voxel::Load(&voxelBlocks[ptr], BlockSize3, idx);
+#else
+		return voxelBlocks[ptr + idx];
+#endif
+	}
+
+	__device__ __forceinline__ float GetSdf(int ptr, int idx) const {
+#ifdef SPLIT_VOXEL_BLOCKS
+		return Voxel::LoadSdf(&voxelBlocks[ptr], BlockSize3, idx);
+#else
+		return voxelBlocks[ptr + idx].getSdf();
+#endif
+	}
+
+	__device__ __forceinline__ void SetVoxel(int ptr, int idx, const Voxel & voxel) const {
+#ifdef SPLIT_VOXEL_BLOCKS
+		Voxel::Store(&voxelBlocks[ptr], BlockSize3, idx, voxel);
+#else
+		voxelBlocks[ptr + idx] = voxel;
+#endif
+	}
+
 	static constexpr uint BlockSize = 8;
 	static constexpr uint BlockSize3 = 512;
 	static constexpr float DepthMin = 0.1f;
 	static constexpr float DepthMax = 3.0f;
-	static constexpr uint NumExcess = 500000;
-	static constexpr uint NumBuckets = 1000000;
-	static constexpr uint NumSdfBlocks = 700000;
-	static constexpr uint NumVoxels = NumSdfBlocks * BlockSize3;
-	static constexpr uint MaxTriangles = 20000000; // roughly 700MB memory
-	static constexpr uint MaxVertices = MaxTriangles * 3;
-	static constexpr float VoxelSize = 0.006f;
-	static constexpr float TruncateDist = VoxelSize * 8;
+	static constexpr uint MaxTriangles = 20000000; // roughly 800MB memory
+	static constexpr uint MaxVertices = MaxTriangles; // welded, about half are used
+	static constexpr uint MaxIndices = MaxTriangles * 3;
 	static constexpr int MaxRenderingBlocks = 260000;
-	static constexpr float voxelSizeInv = 1.0 / VoxelSize;
-	static constexpr float blockWidth = VoxelSize * BlockSize;
-	static constexpr uint NumEntries = NumBuckets + NumExcess;
-	static constexpr float stepScale = 0.5 * TruncateDist * voxelSizeInv;
+
+	float voxelSize;
+	float voxelSizeInv;
+	float blockWidth;
+	float truncateDist;
+	float stepScale;
 
 	PtrSz<int> heapMem;
 	PtrSz<int> entryPtr;
@@ -158,6 +380,26 @@ struct DeviceMap {
 	PtrSz<uint> noVisibleBlocks;
 	PtrSz<HashEntry> hashEntries;
 	PtrSz<HashEntry> visibleEntries;
+
+	// Blocks allocated since the log was last emptied, none if it is empty.
+	PtrSz<int3> allocLog;
+	PtrSz<int> noAllocs;
+
+	// Cells of the occupancy grid, used to skip empty space when
+	// raycasting. Without them every block is taken as maybe allocated.
+	PtrSz<GridCell> gridCells;
+
+#ifdef HOST_BACKEND
+	// Blocks created while the hash table is being rebuilt, empty otherwise.
+	PtrSz<int3> insertLog;
+	PtrSz<int> noLoggedInserts;
+
+	// Times CreateBlock found a slot claimed by another thread.
+	static unsigned long noSlotConflicts;
+#endif
+
+	// Prints raycast, recycling and streaming statistics now and then.
+	static bool verbose;
 };
 
 struct KeyMap {
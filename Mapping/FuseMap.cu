@@ -46,7 +46,7 @@ struct Fusion {
 
 	__device__ inline bool CheckBlockVisibility(const int3& pos) {
 
-		float scale = DeviceMap::blockWidth;
+		float scale = map.blockWidth;
 		float3 corner = pos * scale;
 		if (CheckVertexVisibility(corner))
 			return true;
@@ -89,14 +89,14 @@ struct Fusion {
 			z > DeviceMap::DepthMax)
 			return;
 
-		float thresh = DeviceMap::TruncateDist / 2;
+		float thresh = map.truncateDist / 2;
 		float z_near = min(DeviceMap::DepthMax, z - thresh);
 		float z_far = min(DeviceMap::DepthMax, z + thresh);
 		if (z_near >= z_far)
 			return;
 
-		float3 pt_near = unproject(x, y, z_near) * DeviceMap::voxelSizeInv;
-		float3 pt_far = unproject(x, y, z_far) * DeviceMap::voxelSizeInv;
+		float3 pt_near = unproject(x, y, z_near) * map.voxelSizeInv;
+		float3 pt_far = unproject(x, y, z_far) * map.voxelSizeInv;
 		float3 dir = pt_far - pt_near;
 
 		float length = norm(dir);
@@ -110,31 +110,19 @@ struct Fusion {
 		}
 	}
 
-	__device__ inline void CheckFullVisibility() {
+	// A block is recyclable once it is out of view and none of its voxels
+	// lies within the truncation band, i.e. it holds no surface.
+	__device__ inline bool CheckBlockRecyclable(const HashEntry & entry) {
 
-		__shared__ bool bScan;
-		if (threadIdx.x == 0)
-			bScan = false;
-		__syncthreads();
-		uint val = 0;
-		int x = blockDim.x * blockIdx.x + threadIdx.x;
-		if (x < map.hashEntries.size) {
-			HashEntry& e = map.hashEntries[x];
-			if (e.ptr != EntryAvailable) {
-				if (CheckBlockVisibility(e.pos)) {
-					bScan = true;
-					val = 1;
-				}
-			}
-		}
+		if (entry.ptr == EntryAvailable || CheckBlockVisibility(entry.pos))
+			return false;
 
-		__syncthreads();
-		if (bScan) {
-			int offset = ComputeOffset<1024>(val, noVisibleBlocks);
-			if (offset != -1 && offset < map.visibleEntries.size
-					&& x < map.hashEntries.size)
-				map.visibleEntries[offset] = map.hashEntries[x];
+		for (int i = 0; i < DeviceMap::BlockSize3; ++i) {
+			Voxel voxel = map.GetVoxel(entry.ptr, i);
+			if (voxel.getWeight() > 0 && fabs(voxel.getSdf()) < 1.0f)
+				return false;
 		}
+		return true;
 	}
 
 	__device__ inline void integrateColor() {
@@ -163,7 +151,7 @@ struct Fusion {
 			if (isnan(dp) || dp > maxDepth || dp < minDepth)
 				continue;
 
-			float thresh = DeviceMap::TruncateDist;
+			float thresh = map.truncateDist;
 			float sdf = dp - pos.z;
 
 			if (sdf >= -thresh) {
@@ -175,17 +163,18 @@ struct Fusion {
 
 				float w = nl * normalised(make_float4(pos));
 				float3 val = make_float3(rgb.ptr(uv.y)[uv.x]);
-				Voxel & prev = map.voxelBlocks[entry.ptr + locId];
-				if(prev.weight == 0) {
+				Voxel prev = map.GetVoxel(entry.ptr, locId);
+				int weight = prev.getWeight();
+				if(weight == 0) {
 					prev = Voxel(sdf, 1, make_uchar3(val));
 				} else {
 					val = val / 255.f;
-					float3 old = make_float3(prev.color) / 255.f;
+					float3 old = make_float3(prev.getColor()) / 255.f;
 					float3 res = (w * 0.2f * val + (1 - w * 0.2f) * old) * 255.f;
-					prev.sdf = (prev.sdf * prev.weight + w * sdf) / (prev.weight + w);
-					prev.weight = min(255, prev.weight + 1);
-					prev.color = make_uchar3(res);
+					prev = Voxel((prev.getSdf() * weight + w * sdf) / (weight + w),
+							min(Voxel::MaxWeight, weight + 1), make_uchar3(res));
 				}
+				map.SetVoxel(entry.ptr, locId, prev);
 			}
 		}
 	}
@@ -199,26 +188,133 @@ __global__ void FuseColorKernal(Fusion fuse) {
 	fuse.integrateColor();
 }
 
-__global__ void CheckVisibleBlockKernel(Fusion fuse) {
-	fuse.CheckFullVisibility();
+__global__ void CheckCandidateBlocksKernel(Fusion fuse, PtrSz<int3> candidates,
+		uint noCandidates, PtrSz<int3> missing, uint * noMissing) {
+
+	int x = blockIdx.x * blockDim.x + threadIdx.x;
+	if (x >= noCandidates)
+		return;
+
+	HashEntry entry = fuse.map.FindEntry(candidates[x]);
+	if (entry.ptr < 0) {
+		uint i = atomicAdd(noMissing, 1);
+		if (i < missing.size)
+			missing[i] = candidates[x];
+	} else if (fuse.CheckBlockVisibility(entry.pos)) {
+		uint i = atomicAdd(fuse.noVisibleBlocks, 1);
+		if (i < fuse.map.visibleEntries.size)
+			fuse.map.visibleEntries[i] = entry;
+	}
+}
+
+__global__ void RecycleBlocksKernel(Fusion fuse, int begin, int end, uint * noRecycled) {
+
+	int x = begin + blockIdx.x * blockDim.x + threadIdx.x;
+	if (x >= end)
+		return;
+
+	HashEntry entry = fuse.map.hashEntries[x];
+	if (fuse.CheckBlockRecyclable(entry)) {
+		fuse.map.DeleteBlock(entry.pos);
+		atomicAdd(noRecycled, 1);
+	}
+}
+
+__global__ void SwapOutBlocksKernel(DeviceMap map, PtrSz<int3> blockPoses,
+		PtrSz<Voxel> blocks, uint * noBlocks, float3 tview, float distance,
+		int begin, int end) {
+
+	int x = begin + blockIdx.x * blockDim.x + threadIdx.x;
+	if (x >= end)
+		return;
+
+	HashEntry entry = map.hashEntries[x];
+	if (entry.ptr == EntryAvailable)
+		return;
+
+	float3 centre = map.blockPosToWorldPos(entry.pos) + 0.5f * map.blockWidth;
+	if (norm(centre - tview) <= distance)
+		return;
+
+	uint i = atomicAdd(noBlocks, 1);
+	if (i >= blockPoses.size)
+		return;
+
+	blockPoses[i] = entry.pos;
+	for (int j = 0; j < DeviceMap::BlockSize3; ++j)
+		blocks[i * DeviceMap::BlockSize3 + j] = map.GetVoxel(entry.ptr, j);
+	map.DeleteBlock(entry.pos);
+}
+
+__global__ void CreateSwappedBlocksKernel(DeviceMap map, PtrSz<int3> blockPoses, uint noBlocks) {
+
+	int x = blockIdx.x * blockDim.x + threadIdx.x;
+	if (x < noBlocks)
+		map.CreateBlock(blockPoses[x]);
+}
+
+__global__ void SwapInBlocksKernel(DeviceMap map, PtrSz<int3> blockPoses,
+		PtrSz<Voxel> blocks, uint noBlocks, PtrSz<int> missed, uint * noMissed) {
+
+	int x = blockIdx.x;
+	if (x >= noBlocks)
+		return;
+
+	__shared__ int ptr;
+	if (threadIdx.x == 0)
+		ptr = map.FindEntry(blockPoses[x]).ptr;
+	__syncthreads();
+
+	if (ptr < 0) {
+		if (threadIdx.x == 0)
+			missed[atomicAdd(noMissed, 1)] = x;
+		return;
+	}
+
+	for (int j = threadIdx.x; j < DeviceMap::BlockSize3; j += blockDim.x) {
+		Voxel voxel = blocks[x * DeviceMap::BlockSize3 + j];
+		if (voxel.getWeight() > map.GetVoxel(ptr, j).getWeight())
+			map.SetVoxel(ptr, j, voxel);
+	}
+}
+
+__global__ void CopyBlocksKernel(DeviceMap map, PtrSz<int3> blockPoses,
+		PtrSz<Voxel> blocks, uint noBlocks) {
+
+	int x = blockIdx.x;
+	if (x >= noBlocks)
+		return;
+
+	__shared__ int ptr;
+	if (threadIdx.x == 0)
+		ptr = map.FindEntry(blockPoses[x]).ptr;
+	__syncthreads();
+
+	for (int j = threadIdx.x; j < DeviceMap::BlockSize3; j += blockDim.x)
+		blocks[x * DeviceMap::BlockSize3 + j] = ptr < 0 ? Voxel() : map.GetVoxel(ptr, j);
 }
 
-void CheckBlockVisibility(DeviceMap map,
-					     DeviceArray<uint> & noVisibleBlocks,
-						 Matrix3f Rview,
-						 Matrix3f RviewInv,
-						 float3 tview,
-						 int cols,
-						 int rows,
-						 float fx,
-						 float fy,
-						 float cx,
-						 float cy,
-						 float depthMax,
-						 float depthMin,
-						 uint * host_data) {
+uint CheckBlockVisibility(DeviceMap map,
+						  const DeviceArray<int3> & candidates,
+						  uint noCandidates,
+						  DeviceArray<uint> & noVisibleBlocks,
+						  DeviceArray<int3> & missingBlocks,
+						  DeviceArray<uint> & noMissingBlocks,
+						  Matrix3f Rview,
+						  Matrix3f RviewInv,
+						  float3 tview,
+						  int cols,
+						  int rows,
+						  float fx,
+						  float fy,
+						  float cx,
+						  float cy,
+						  float depthMax,
+						  float depthMin,
+						  uint & noMissing) {
 
 	noVisibleBlocks.clear();
+	noMissingBlocks.clear();
 
 	Fusion fuse;
 	fuse.map = map;
@@ -229,29 +325,67 @@ void CheckBlockVisibility(DeviceMap map,
 	fuse.fy = fy;
 	fuse.cx = cx;
 	fuse.cy = cy;
-	fuse.invfx = 1.0 / fx;
-	fuse.invfy = 1.0 / fy;
 	fuse.rows = rows;
 	fuse.cols = cols;
 	fuse.noVisibleBlocks = noVisibleBlocks;
 	fuse.maxDepth = depthMax;
 	fuse.minDepth = depthMin;
 
-	dim3 thread = dim3(1024);
-	dim3 block = dim3(DivUp((int) DeviceMap::NumEntries, thread.x));
+	uint noVisible = 0;
+	noMissing = 0;
+	if (noCandidates > 0) {
+		dim3 thread(1024);
+		dim3 block(DivUp(noCandidates, thread.x));
 
-	CheckVisibleBlockKernel<<<block, thread>>>(fuse);
+		CheckCandidateBlocksKernel<<<block, thread>>>(fuse, candidates,
+				noCandidates, missingBlocks, noMissingBlocks);
 
-	host_data[0] = 0;
-	noVisibleBlocks.download((void*) host_data);
-	if (host_data[0] == 0)
-		return;
+		SafeCall(cudaDeviceSynchronize());
+		SafeCall(cudaGetLastError());
+
+		noVisibleBlocks.download((void*) &noVisible);
+		noMissingBlocks.download((void*) &noMissing);
+	}
+
+	noMissing = std::min(noMissing, (uint) missingBlocks.size);
+	return std::min(noVisible, (uint) map.visibleEntries.size);
+}
+
+void AllocateBlocks(const DeviceArray2D<float> & depth,
+					DeviceMap map,
+					Matrix3f Rview,
+					float3 tview,
+					float fx,
+					float fy,
+					float cx,
+					float cy) {
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.Rview = Rview;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
+	fuse.invfx = 1.0 / fx;
+	fuse.invfy = 1.0 / fy;
+	fuse.depth = depth;
+	fuse.rows = depth.rows;
+	fuse.cols = depth.cols;
+
+	dim3 thread(16, 8);
+	dim3 block(DivUp(depth.cols, thread.x), DivUp(depth.rows, thread.y));
+
+	CreateBlocksKernel<<<block, thread>>>(fuse);
+
+	SafeCall(cudaDeviceSynchronize());
+	SafeCall(cudaGetLastError());
 }
 
 void FuseMapColor(const DeviceArray2D<float> & depth,
 				  const DeviceArray2D<uchar3> & color,
 				  const DeviceArray2D<float4> & nmap,
-				  DeviceArray<uint> & noVisibleBlocks,
 				  Matrix3f Rview,
 				  Matrix3f RviewInv,
 				  float3 tview,
@@ -262,11 +396,10 @@ void FuseMapColor(const DeviceArray2D<float> & depth,
 				  float cy,
 				  float depthMax,
 				  float depthMin,
-				  uint * host_data) {
+				  uint noVisibleBlocks) {
 
-	int cols = depth.cols;
-	int rows = depth.rows;
-	noVisibleBlocks.clear();
+	if (noVisibleBlocks == 0)
+		return;
 
 	Fusion fuse;
 	fuse.map = map;
@@ -282,37 +415,134 @@ void FuseMapColor(const DeviceArray2D<float> & depth,
 	fuse.depth = depth;
 	fuse.rgb = color;
 	fuse.nmap = nmap;
+	fuse.rows = depth.rows;
+	fuse.cols = depth.cols;
+	fuse.noVisibleBlocks = map.noVisibleBlocks;
+	fuse.maxDepth = depthMax;
+	fuse.minDepth = depthMin;
+
+	dim3 thread(8, 8);
+	dim3 block(noVisibleBlocks);
+
+	FuseColorKernal<<<block, thread>>>(fuse);
+
+	SafeCall(cudaDeviceSynchronize());
+	SafeCall(cudaGetLastError());
+}
+
+uint RecycleBlocks(DeviceMap map,
+				   DeviceArray<uint> & noRecycledBlocks,
+				   Matrix3f RviewInv,
+				   float3 tview,
+				   int cols,
+				   int rows,
+				   float fx,
+				   float fy,
+				   float cx,
+				   float cy,
+				   float depthMax,
+				   float depthMin,
+				   int begin,
+				   int end) {
+
+	noRecycledBlocks.clear();
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.RviewInv = RviewInv;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
 	fuse.rows = rows;
 	fuse.cols = cols;
-	fuse.noVisibleBlocks = noVisibleBlocks;
-	fuse.maxDepth = DeviceMap::DepthMax;
-	fuse.minDepth = DeviceMap::DepthMin;
+	fuse.maxDepth = depthMax;
+	fuse.minDepth = depthMin;
 
-	dim3 thread(16, 8);
-	dim3 block(DivUp(cols, thread.x), DivUp(rows, thread.y));
+	dim3 thread(1024);
+	dim3 block(DivUp(end - begin, thread.x));
 
-	CreateBlocksKernel<<<block, thread>>>(fuse);
+	RecycleBlocksKernel<<<block, thread>>>(fuse, begin, end, noRecycledBlocks);
 
 	SafeCall(cudaDeviceSynchronize());
 	SafeCall(cudaGetLastError());
 
-	thread = dim3(1024);
-	block = dim3(DivUp((int) DeviceMap::NumEntries, thread.x));
+	uint noRecycled = 0;
+	noRecycledBlocks.download((void*) &noRecycled);
+	return noRecycled;
+}
+
+uint SwapOutBlocks(DeviceMap map,
+				   DeviceArray<int3> & blockPoses,
+				   DeviceArray<Voxel> & blocks,
+				   DeviceArray<uint> & noBlocks,
+				   float3 tview,
+				   float distance,
+				   int begin,
+				   int end) {
 
-	CheckVisibleBlockKernel<<<block, thread>>>(fuse);
+	noBlocks.clear();
+
+	dim3 thread(1024);
+	dim3 block(DivUp(end - begin, thread.x));
+
+	SwapOutBlocksKernel<<<block, thread>>>(map, blockPoses, blocks, noBlocks,
+			tview, distance, begin, end);
 
 	SafeCall(cudaDeviceSynchronize());
 	SafeCall(cudaGetLastError());
 
-	host_data[0] = 0;
-	noVisibleBlocks.download((void*) host_data);
-	if (host_data[0] == 0)
-		return;
+	uint noSwapped = 0;
+	noBlocks.download((void*) &noSwapped);
+	return std::min(noSwapped, (uint) blockPoses.size);
+}
 
-	thread = dim3(8, 8);
-	block = dim3(host_data[0]);
+// A block loses its bucket to a concurrent insert now and then, so the
+// creation is repeated a few times before the voxels are copied in.
+uint SwapInBlocks(DeviceMap map,
+				  DeviceArray<int3> & blockPoses,
+				  DeviceArray<Voxel> & blocks,
+				  DeviceArray<int> & missedBlocks,
+				  DeviceArray<uint> & noMissedBlocks,
+				  uint noBlocks) {
 
-	FuseColorKernal<<<block, thread>>>(fuse);
+	if (noBlocks == 0)
+		return 0;
+
+	dim3 thread(1024);
+	dim3 block(DivUp(noBlocks, thread.x));
+
+	// Blocks losing the race for a bucket are not created, so creation is
+	// repeated as long as it gets more blocks in. Merging a block again
+	// changes nothing, as only heavier voxels are taken.
+	uint noMissed = noBlocks;
+	uint noLeft = 0;
+	do {
+		noLeft = noMissed;
+		CreateSwappedBlocksKernel<<<block, thread>>>(map, blockPoses, noBlocks);
+
+		noMissedBlocks.clear();
+		SwapInBlocksKernel<<<noBlocks, 128>>>(map, blockPoses, blocks, noBlocks, missedBlocks, noMissedBlocks);
+
+		SafeCall(cudaDeviceSynchronize());
+		SafeCall(cudaGetLastError());
+
+		noMissedBlocks.download((void*) &noMissed);
+	} while (noMissed > 0 && noMissed < noLeft);
+
+	return noMissed;
+}
+
+void CopyBlocks(DeviceMap map,
+				const DeviceArray<int3> & blockPoses,
+				DeviceArray<Voxel> & blocks,
+				uint noBlocks) {
+
+	if (noBlocks == 0)
+		return;
+
+	CopyBlocksKernel<<<noBlocks, 128>>>(map, blockPoses, blocks, noBlocks);
 
 	SafeCall(cudaDeviceSynchronize());
 	SafeCall(cudaGetLastError());
@@ -323,44 +553,64 @@ __global__ void ResetHashKernel(DeviceMap map) {
 	int x = blockIdx.x * blockDim.x + threadIdx.x;
 	if(x < map.hashEntries.size) {
 		map.hashEntries[x].release();
+	}
+
+	if(x < map.visibleEntries.size) {
 		map.visibleEntries[x].release();
 	}
 
-	if (x < DeviceMap::NumBuckets) {
+	if (x < map.bucketMutex.size) {
 		map.bucketMutex[x] = EntryAvailable;
 	}
 }
 
-__global__ void ResetSdfBlockKernel(DeviceMap map) {
+__global__ void ResetSdfBlockKernel(DeviceMap map, int begin, int heapTop) {
 
-	int x = blockIdx.x * blockDim.x + threadIdx.x;
-	if(x < DeviceMap::NumSdfBlocks) {
-		map.heapMem[x] = DeviceMap::NumSdfBlocks - x - 1;
-	}
+	int x = blockIdx.x * blockDim.x + threadIdx.x + begin;
+	if(x >= map.heapMem.size)
+		return;
 
-	int blockIdx = x * DeviceMap::BlockSize3;
-	for(int i = 0; i < DeviceMap::BlockSize3; ++i, ++blockIdx) {
-		map.voxelBlocks[blockIdx].release();
-	}
+	map.heapMem[heapTop + 1 + x - begin] = map.heapMem.size - x + begin - 1;
 
-	if(x == 0) {
-		map.heapCounter[0] = DeviceMap::NumSdfBlocks - 1;
-		map.entryPtr[0] = 1;
+	for(int i = 0; i < DeviceMap::BlockSize3; ++i) {
+		map.SetVoxel(x * DeviceMap::BlockSize3, i, Voxel());
 	}
 }
 
 void ResetMap(DeviceMap map) {
 
 	dim3 thread(1024);
-	dim3 block(DivUp((int) DeviceMap::NumEntries, thread.x));
+	dim3 block(DivUp((int) map.hashEntries.size, thread.x));
 
 	ResetHashKernel<<<block, thread>>>(map);
 
-	block = dim3(DivUp((int) DeviceMap::NumSdfBlocks, thread.x));
-	ResetSdfBlockKernel<<<block, thread>>>(map);
+	block = dim3(DivUp((int) map.heapMem.size, thread.x));
+	ResetSdfBlockKernel<<<block, thread>>>(map, 0, -1);
 
 	SafeCall(cudaDeviceSynchronize());
 	SafeCall(cudaGetLastError());
+
+	int heapTop = map.heapMem.size - 1;
+	int entryPtr = 1;
+	SafeCall(cudaMemcpy(map.heapCounter, &heapTop, sizeof(int), cudaMemcpyHostToDevice));
+	SafeCall(cudaMemcpy(map.entryPtr, &entryPtr, sizeof(int), cudaMemcpyHostToDevice));
+}
+
+void ExtendMap(DeviceMap map, int noBlocks, int heapTop) {
+
+	int noNewBlocks = map.heapMem.size - noBlocks;
+	if (noNewBlocks <= 0)
+		return;
+
+	dim3 thread(1024);
+	dim3 block(DivUp(noNewBlocks, thread.x));
+	ResetSdfBlockKernel<<<block, thread>>>(map, noBlocks, heapTop);
+
+	SafeCall(cudaDeviceSynchronize());
+	SafeCall(cudaGetLastError());
+
+	heapTop += noNewBlocks;
+	SafeCall(cudaMemcpy(map.heapCounter, &heapTop, sizeof(int), cudaMemcpyHostToDevice));
 }
 
 __global__ void ResetKeyPointsKernel(KeyMap map) {
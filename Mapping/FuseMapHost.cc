@@ -0,0 +1,597 @@
+#include "RenderScene.h"
+#include "ThreadPool.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+struct Fusion {
+
+	DeviceMap map;
+	float invfx, invfy;
+	float fx, fy, cx, cy;
+	float minDepth, maxDepth;
+	int cols, rows;
+	Matrix3f Rview;
+	Matrix3f RviewInv;
+	float3 tview;
+
+	uint* noVisibleBlocks;
+
+	PtrStep<float4> nmap;
+	PtrStep<float> depth;
+	PtrStep<uchar3> rgb;
+
+	inline float2 project(float3& pt3d) const {
+		float2 pt2d;
+		pt2d.x = fx * pt3d.x / pt3d.z + cx;
+		pt2d.y = fy * pt3d.y / pt3d.z + cy;
+		return pt2d;
+	}
+
+	inline float3 unproject(int& x, int& y, float& z) const {
+		float3 pt3d;
+		pt3d.z = z;
+		pt3d.x = z * (x - cx) * invfx;
+		pt3d.y = z * (y - cy) * invfy;
+		return Rview * pt3d + tview;
+	}
+
+	inline bool CheckVertexVisibility(float3 pt3d) const {
+		pt3d = RviewInv * (pt3d - tview);
+		if (pt3d.z < 1e-3f)
+			return false;
+		float2 pt2d = project(pt3d);
+
+		return pt2d.x >= 0 && pt2d.y >= 0 &&
+			   pt2d.x < cols && pt2d.y < rows &&
+			   pt3d.z >= minDepth && pt3d.z <= maxDepth;
+	}
+
+	inline bool CheckBlockVisibility(const int3& pos) const {
+
+		float scale = map.blockWidth;
+		float3 corner = pos * scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.z += scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.y += scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.x += scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.z -= scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.y -= scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.x -= scale;
+		corner.y += scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		corner.x += scale;
+		corner.y -= scale;
+		corner.z += scale;
+		if (CheckVertexVisibility(corner))
+			return true;
+		return false;
+	}
+
+	// Walks the truncation band of every pixel in row y and allocates the
+	// blocks it passes through. Consecutive samples usually fall into the
+	// same block, so repeated requests along a ray are skipped.
+	inline void CreateBlocks(int y) {
+
+		for (int x = 0; x < cols; ++x) {
+
+			float z = depth.ptr(y)[x];
+			if (std::isnan(z) || z < DeviceMap::DepthMin ||
+				z > DeviceMap::DepthMax)
+				continue;
+
+			float thresh = map.truncateDist / 2;
+			float z_near = std::min(DeviceMap::DepthMax, z - thresh);
+			float z_far = std::min(DeviceMap::DepthMax, z + thresh);
+			if (z_near >= z_far)
+				continue;
+
+			float3 pt_near = unproject(x, y, z_near) * map.voxelSizeInv;
+			float3 pt_far = unproject(x, y, z_far) * map.voxelSizeInv;
+			float3 dir = pt_far - pt_near;
+
+			float length = norm(dir);
+			int nSteps = (int) ceil(2.0 * length);
+			dir = dir / (float) (nSteps - 1);
+
+			int3 last = make_int3(0x7fffffff);
+			for (int i = 0; i < nSteps; ++i) {
+				int3 blockPos = map.voxelPosToBlockPos(make_int3(pt_near));
+				if (!(blockPos == last)) {
+					map.CreateBlock(blockPos);
+					last = blockPos;
+				}
+				pt_near += dir;
+			}
+		}
+	}
+
+	// A block is recyclable once it is out of view and none of its voxels
+	// lies within the truncation band, i.e. it holds no surface.
+	inline bool CheckBlockRecyclable(const HashEntry & entry) const {
+
+		if (entry.ptr == EntryAvailable || CheckBlockVisibility(entry.pos))
+			return false;
+
+		for (uint i = 0; i < DeviceMap::BlockSize3; ++i) {
+			Voxel voxel = map.GetVoxel(entry.ptr, i);
+			if (voxel.getWeight() > 0 && fabs(voxel.getSdf()) < 1.0f)
+				return false;
+		}
+		return true;
+	}
+
+	inline void integrateVoxel(int ptr, int idx, const float3 & pos, int u, int v, float sdf) const {
+
+		float thresh = map.truncateDist;
+		sdf = fmin(1.0f, sdf / thresh);
+		float4 nl = nmap.ptr(v)[u];
+		if (std::isnan(nl.x))
+			return;
+
+		float w = nl * normalised(make_float4(pos));
+		float3 val = make_float3(rgb.ptr(v)[u]);
+		Voxel prev = map.GetVoxel(ptr, idx);
+		int weight = prev.getWeight();
+		if(weight == 0) {
+			prev = Voxel(sdf, 1, make_uchar3(val));
+		} else {
+			val = val / 255.f;
+			float3 old = make_float3(prev.getColor()) / 255.f;
+			float3 res = (w * 0.2f * val + (1 - w * 0.2f) * old) * 255.f;
+			prev = Voxel((prev.getSdf() * weight + w * sdf) / (weight + w),
+					std::min((int) Voxel::MaxWeight, weight + 1), make_uchar3(res));
+		}
+		map.SetVoxel(ptr, idx, prev);
+	}
+
+	// Integrates the row of eight voxels from idx on, scalar-wise.
+	inline void integrateRow(int ptr, int idx, const int3 & voxelPos) const {
+
+		for (int i = 0; i < 8; ++i) {
+			float3 pos = map.voxelPosToWorldPos(voxelPos + make_int3(i, 0, 0));
+			pos = RviewInv * (pos - tview);
+			int2 uv = make_int2(project(pos));
+			if (uv.x < 0 || uv.y < 0 || uv.x >= cols || uv.y >= rows)
+				continue;
+
+			float dp = depth.ptr(uv.y)[uv.x];
+			if (std::isnan(dp) || dp > maxDepth || dp < minDepth)
+				continue;
+
+			float sdf = dp - pos.z;
+			if (sdf >= -map.truncateDist)
+				integrateVoxel(ptr, idx + i, pos, uv.x, uv.y, sdf);
+		}
+	}
+
+#ifdef __AVX2__
+	static inline __m256 Dot(const float3 & r, __m256 x, __m256 y, __m256 z) {
+		__m256 res = _mm256_mul_ps(_mm256_set1_ps(r.x), x);
+		res = _mm256_add_ps(res, _mm256_mul_ps(_mm256_set1_ps(r.y), y));
+		return _mm256_add_ps(res, _mm256_mul_ps(_mm256_set1_ps(r.z), z));
+	}
+
+	// Same as integrateRow, but projects all eight voxels and fetches their
+	// depth in one go. Only voxels inside the truncation band are updated.
+	inline void integrateRowAVX(int ptr, int idx, const int3 & voxelPos) const {
+
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256 voxelSize = _mm256_set1_ps(map.voxelSize);
+
+		__m256 px = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(
+				_mm256_set1_epi32(voxelPos.x), lane)), voxelSize);
+		px = _mm256_sub_ps(px, _mm256_set1_ps(tview.x));
+		__m256 py = _mm256_set1_ps(voxelPos.y * map.voxelSize - tview.y);
+		__m256 pz = _mm256_set1_ps(voxelPos.z * map.voxelSize - tview.z);
+
+		__m256 cx3 = Dot(RviewInv.rowx, px, py, pz);
+		__m256 cy3 = Dot(RviewInv.rowy, px, py, pz);
+		__m256 cz3 = Dot(RviewInv.rowz, px, py, pz);
+
+		__m256i u = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(
+				_mm256_mul_ps(_mm256_set1_ps(fx), cx3), cz3), _mm256_set1_ps(cx)));
+		__m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(
+				_mm256_mul_ps(_mm256_set1_ps(fy), cy3), cz3), _mm256_set1_ps(cy)));
+
+		__m256i inside = _mm256_and_si256(
+				_mm256_and_si256(_mm256_cmpgt_epi32(u, _mm256_set1_epi32(-1)),
+						         _mm256_cmpgt_epi32(v, _mm256_set1_epi32(-1))),
+				_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(cols), u),
+						         _mm256_cmpgt_epi32(_mm256_set1_epi32(rows), v)));
+		if (_mm256_testz_si256(inside, inside))
+			return;
+
+		int stride = depth.step / sizeof(float);
+		__m256i index = _mm256_add_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(stride)), u);
+		__m256 dp = _mm256_mask_i32gather_ps(_mm256_set1_ps(std::nanf("0x7fffffff")),
+				depth.data, index, _mm256_castsi256_ps(inside), sizeof(float));
+
+		__m256 sdf = _mm256_sub_ps(dp, cz3);
+		__m256 valid = _mm256_and_ps(
+				_mm256_and_ps(_mm256_cmp_ps(dp, _mm256_set1_ps(maxDepth), _CMP_LE_OQ),
+						      _mm256_cmp_ps(dp, _mm256_set1_ps(minDepth), _CMP_GE_OQ)),
+				_mm256_cmp_ps(sdf, _mm256_set1_ps(-map.truncateDist), _CMP_GE_OQ));
+
+		int mask = _mm256_movemask_ps(valid);
+		if (mask == 0)
+			return;
+
+		alignas(32) float xs[8], ys[8], zs[8], ds[8];
+		alignas(32) int us[8], vs[8];
+		_mm256_store_ps(xs, cx3);
+		_mm256_store_ps(ys, cy3);
+		_mm256_store_ps(zs, cz3);
+		_mm256_store_ps(ds, sdf);
+		_mm256_store_si256((__m256i*) us, u);
+		_mm256_store_si256((__m256i*) vs, v);
+
+		while (mask) {
+			int i = __builtin_ctz(mask);
+			mask &= mask - 1;
+			integrateVoxel(ptr, idx + i, make_float3(xs[i], ys[i], zs[i]), us[i], vs[i], ds[i]);
+		}
+	}
+#endif
+
+	inline void integrateColor(int blockId) const {
+
+		const HashEntry & entry = map.visibleEntries[blockId];
+		if (entry.ptr == EntryAvailable)
+			return;
+
+		int3 block_pos = map.blockPosToVoxelPos(entry.pos);
+		for (int z = 0; z < 8; ++z) {
+			for (int y = 0; y < 8; ++y) {
+				int3 localPos = make_int3(0, y, z);
+				int idx = map.localPosToLocalIdx(localPos);
+#ifdef __AVX2__
+				integrateRowAVX(entry.ptr, idx, block_pos + localPos);
+#else
+				integrateRow(entry.ptr, idx, block_pos + localPos);
+#endif
+			}
+		}
+	}
+};
+
+uint CheckBlockVisibility(DeviceMap map,
+						  const DeviceArray<int3> & candidates,
+						  uint noCandidates,
+						  DeviceArray<uint> & noVisibleBlocks,
+						  DeviceArray<int3> & missingBlocks,
+						  DeviceArray<uint> & noMissingBlocks,
+						  Matrix3f Rview,
+						  Matrix3f RviewInv,
+						  float3 tview,
+						  int cols,
+						  int rows,
+						  float fx,
+						  float fy,
+						  float cx,
+						  float cy,
+						  float depthMax,
+						  float depthMin,
+						  uint & noMissing) {
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.Rview = Rview;
+	fuse.RviewInv = RviewInv;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
+	fuse.rows = rows;
+	fuse.cols = cols;
+	fuse.maxDepth = depthMax;
+	fuse.minDepth = depthMin;
+
+	const int chunk = 1024;
+	int noChunks = DivUp((int) noCandidates, chunk);
+	std::vector<std::vector<HashEntry>> visible(noChunks);
+	std::vector<std::vector<int3>> missing(noChunks);
+	ThreadPool::Global().ParallelFor(0, noChunks, [&](int i) {
+		int end = std::min((i + 1) * chunk, (int) noCandidates);
+		for (int x = i * chunk; x < end; ++x) {
+			HashEntry entry = map.FindEntry(candidates[x]);
+			if (entry.ptr < 0)
+				missing[i].push_back(candidates[x]);
+			else if (fuse.CheckBlockVisibility(entry.pos))
+				visible[i].push_back(entry);
+		}
+	});
+
+	uint total = 0;
+	noMissing = 0;
+	for (int i = 0; i < noChunks; ++i) {
+		size_t n = std::min(visible[i].size(), map.visibleEntries.size - total);
+		std::copy(visible[i].begin(), visible[i].begin() + n, &map.visibleEntries[total]);
+		total += n;
+		n = std::min(missing[i].size(), missingBlocks.size - noMissing);
+		std::copy(missing[i].begin(), missing[i].begin() + n, &missingBlocks[noMissing]);
+		noMissing += n;
+	}
+
+	noVisibleBlocks[0] = total;
+	return total;
+}
+
+uint RecycleBlocks(DeviceMap map,
+				   DeviceArray<uint> & noRecycledBlocks,
+				   Matrix3f RviewInv,
+				   float3 tview,
+				   int cols,
+				   int rows,
+				   float fx,
+				   float fy,
+				   float cx,
+				   float cy,
+				   float depthMax,
+				   float depthMin,
+				   int begin,
+				   int end) {
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.RviewInv = RviewInv;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
+	fuse.rows = rows;
+	fuse.cols = cols;
+	fuse.maxDepth = depthMax;
+	fuse.minDepth = depthMin;
+
+	const int chunk = 16384;
+	int noChunks = DivUp(end - begin, chunk);
+	std::vector<std::vector<int3>> garbage(noChunks);
+	ThreadPool::Global().ParallelFor(0, noChunks, [&](int i) {
+		int last = std::min(begin + (i + 1) * chunk, end);
+		for (int x = begin + i * chunk; x < last; ++x)
+			if (fuse.CheckBlockRecyclable(map.hashEntries[x]))
+				garbage[i].push_back(map.hashEntries[x].pos);
+	});
+
+	// Deleting moves later entries back along their probe sequence,
+	// so blocks are removed one by one after the scan.
+	uint noRecycled = 0;
+	for (const std::vector<int3> & list : garbage) {
+		for (const int3 & pos : list) {
+			map.DeleteBlock(pos);
+			noRecycled++;
+		}
+	}
+
+	return noRecycled;
+}
+
+uint SwapOutBlocks(DeviceMap map,
+				   DeviceArray<int3> & blockPoses,
+				   DeviceArray<Voxel> & blocks,
+				   DeviceArray<uint> & noBlocks,
+				   float3 tview,
+				   float distance,
+				   int begin,
+				   int end) {
+
+	const int chunk = 16384;
+	int noChunks = DivUp(end - begin, chunk);
+	std::vector<std::vector<int3>> far(noChunks);
+	ThreadPool::Global().ParallelFor(0, noChunks, [&](int i) {
+		int last = std::min(begin + (i + 1) * chunk, end);
+		for (int x = begin + i * chunk; x < last; ++x) {
+			const HashEntry & entry = map.hashEntries[x];
+			if (entry.ptr == EntryAvailable)
+				continue;
+
+			float3 centre = map.blockPosToWorldPos(entry.pos) + 0.5f * map.blockWidth;
+			if (norm(centre - tview) > distance)
+				far[i].push_back(entry.pos);
+		}
+	});
+
+	uint noSwapped = 0;
+	for (const std::vector<int3> & list : far) {
+		for (const int3 & pos : list) {
+			if (noSwapped == blockPoses.size)
+				break;
+
+			HashEntry entry = map.FindEntry(pos);
+			blockPoses[noSwapped] = pos;
+			for (uint j = 0; j < DeviceMap::BlockSize3; ++j)
+				blocks[noSwapped * DeviceMap::BlockSize3 + j] = map.GetVoxel(entry.ptr, j);
+			map.DeleteBlock(pos);
+			noSwapped++;
+		}
+	}
+
+	return noSwapped;
+}
+
+uint SwapInBlocks(DeviceMap map,
+				  DeviceArray<int3> & blockPoses,
+				  DeviceArray<Voxel> & blocks,
+				  DeviceArray<int> & missedBlocks,
+				  DeviceArray<uint> & noMissedBlocks,
+				  uint noBlocks) {
+
+	// A block may come back more than once if it was fused again while
+	// an older copy was on disk, so the blocks are merged one by one.
+	uint noMissed = 0;
+	for (uint i = 0; i < noBlocks; ++i) {
+		map.CreateBlock(blockPoses[i]);
+		int ptr = map.FindEntry(blockPoses[i]).ptr;
+		if (ptr < 0) {
+			missedBlocks[noMissed++] = i;
+			continue;
+		}
+
+		for (uint j = 0; j < DeviceMap::BlockSize3; ++j) {
+			const Voxel & voxel = blocks[i * DeviceMap::BlockSize3 + j];
+			if (voxel.getWeight() > map.GetVoxel(ptr, j).getWeight())
+				map.SetVoxel(ptr, j, voxel);
+		}
+	}
+
+	return noMissed;
+}
+
+void CopyBlocks(DeviceMap map,
+				const DeviceArray<int3> & blockPoses,
+				DeviceArray<Voxel> & blocks,
+				uint noBlocks) {
+
+	const int3 * poses = blockPoses;
+	Voxel * dst = blocks;
+	ThreadPool::Global().ParallelFor(0, (int) noBlocks, [&](int i) {
+		int ptr = map.FindEntry(poses[i]).ptr;
+		for (uint j = 0; j < DeviceMap::BlockSize3; ++j)
+			dst[(size_t) i * DeviceMap::BlockSize3 + j] = ptr < 0 ? Voxel() : map.GetVoxel(ptr, j);
+	}, 16);
+}
+
+void AllocateBlocks(const DeviceArray2D<float> & depth,
+					DeviceMap map,
+					Matrix3f Rview,
+					float3 tview,
+					float fx,
+					float fy,
+					float cx,
+					float cy) {
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.Rview = Rview;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
+	fuse.invfx = 1.0 / fx;
+	fuse.invfy = 1.0 / fy;
+	fuse.depth = depth;
+	fuse.rows = depth.rows;
+	fuse.cols = depth.cols;
+
+	ThreadPool & pool = ThreadPool::Global();
+	pool.ParallelFor(0, fuse.rows, [&](int y) {
+		fuse.CreateBlocks(y);
+	}, 4);
+}
+
+void FuseMapColor(const DeviceArray2D<float> & depth,
+				  const DeviceArray2D<uchar3> & color,
+				  const DeviceArray2D<float4> & nmap,
+				  Matrix3f Rview,
+				  Matrix3f RviewInv,
+				  float3 tview,
+				  DeviceMap map,
+				  float fx,
+				  float fy,
+				  float cx,
+				  float cy,
+				  float depthMax,
+				  float depthMin,
+				  uint noVisibleBlocks) {
+
+	if (noVisibleBlocks == 0)
+		return;
+
+	Fusion fuse;
+	fuse.map = map;
+	fuse.Rview = Rview;
+	fuse.RviewInv = RviewInv;
+	fuse.tview = tview;
+	fuse.fx = fx;
+	fuse.fy = fy;
+	fuse.cx = cx;
+	fuse.cy = cy;
+	fuse.invfx = 1.0 / fx;
+	fuse.invfy = 1.0 / fy;
+	fuse.depth = depth;
+	fuse.rgb = color;
+	fuse.nmap = nmap;
+	fuse.rows = depth.rows;
+	fuse.cols = depth.cols;
+	fuse.maxDepth = depthMax;
+	fuse.minDepth = depthMin;
+
+	ThreadPool::Global().ParallelFor(0, (int) noVisibleBlocks, [&](int i) {
+		fuse.integrateColor(i);
+	}, 16);
+}
+
+static void ResetBlocks(DeviceMap map, int begin, int heapTop) {
+
+	ThreadPool & pool = ThreadPool::Global();
+	pool.ParallelFor(begin, (int) map.heapMem.size, [&](int x) {
+		map.heapMem[heapTop + 1 + x - begin] = map.heapMem.size - x + begin - 1;
+		for (uint i = 0; i < DeviceMap::BlockSize3; ++i)
+			map.SetVoxel(x * DeviceMap::BlockSize3, i, Voxel());
+	}, 256);
+
+	map.heapCounter[0] = heapTop + map.heapMem.size - begin;
+}
+
+void ResetMap(DeviceMap map) {
+
+	ThreadPool & pool = ThreadPool::Global();
+	pool.ParallelFor(0, (int) map.hashEntries.size, [&](int x) {
+		map.hashEntries[x].release();
+		if (x < (int) map.visibleEntries.size)
+			map.visibleEntries[x].release();
+		if (x < (int) map.bucketMutex.size)
+			map.bucketMutex[x] = EntryAvailable;
+	}, 4096);
+
+	ResetBlocks(map, 0, -1);
+	map.entryPtr[0] = 1;
+}
+
+void ExtendMap(DeviceMap map, int noBlocks, int heapTop) {
+
+	if (noBlocks < (int) map.heapMem.size)
+		ResetBlocks(map, noBlocks, heapTop);
+}
+
+void ResetKeyPoints(KeyMap map) {
+
+	for (int x = 0; x < KeyMap::maxEntries; ++x)
+		map.ResetKeys(x);
+}
+
+void CollectKeyPoints(KeyMap map, DeviceArray<SURF> & keys, DeviceArray<uint> & noKeys) {
+
+	PtrSz<SURF> dst = keys;
+	uint & count = ((uint*) noKeys)[0];
+	for (int x = 0; x < (int) map.Keys.size; ++x) {
+		if (map.Keys[x].valid && count < dst.size)
+			memcpy(&dst[count++], &map.Keys[x], sizeof(SURF));
+	}
+}
+
+void InsertKeyPoints(KeyMap map, DeviceArray<SURF> & keys,
+		DeviceArray<int> & keyIndex, size_t size) {
+
+	PtrSz<SURF> src = keys;
+	PtrSz<int> index = keyIndex;
+	for (size_t x = 0; x < size; ++x)
+		map.InsertKey(&src[x], index[x]);
+}
@@ -0,0 +1,343 @@
+#include "MapFile.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char Magic[8] = "FSMAP";
+static const int Version = 2;
+static const long long PageBytes = 4096;
+static const uint RawBytes = sizeof(Voxel) * DeviceMap::BlockSize3;
+static const uint RunBytes = sizeof(unsigned short) + sizeof(Voxel);
+
+struct MapFileHeader {
+	char magic[8];
+	int version;
+	int voxelBytes;
+	int blockSize;
+	int compressed;
+	MapConfig config;
+	long long noBlocks;
+	long long blocksOffset;
+	long long noKeys;
+	long long keysOffset;
+	long long indexOffset;
+};
+
+// The sdf is compared by its bits. Only the overload for Voxel is
+// declared in MapFile.h.
+bool SameVoxel(const FloatVoxel & a, const FloatVoxel & b) {
+
+	uint sdfA, sdfB;
+	memcpy(&sdfA, &a.sdf, sizeof(float));
+	memcpy(&sdfB, &b.sdf, sizeof(float));
+	return sdfA == sdfB && a.weight == b.weight && a.color.x == b.color.x &&
+			a.color.y == b.color.y && a.color.z == b.color.z;
+}
+
+bool SameVoxel(const CompactVoxel & a, const CompactVoxel & b) {
+	return a.sdfWeight == b.sdfWeight && a.rgb == b.rgb;
+}
+
+// Runs of equal voxels as a count and the voxel. Untouched space inside
+// a block is all default voxels, so most blocks shrink a lot. Voxels are
+// copied as bytes, the way raw blocks are written and read.
+static uint Encode(const Voxel * voxels, std::vector<char> & buffer) {
+
+	uint bytes = 0;
+	for (int i = 0; i < (int) DeviceMap::BlockSize3;) {
+		int j = i + 1;
+		while (j < (int) DeviceMap::BlockSize3 && SameVoxel(voxels[i], voxels[j]))
+			j++;
+
+		if (bytes + RunBytes >= RawBytes)
+			return RawBytes;
+
+		unsigned short count = j - i;
+		memcpy(&buffer[bytes], &count, sizeof(count));
+		memcpy(&buffer[bytes + sizeof(count)], (const char *) &voxels[i], sizeof(Voxel));
+		bytes += RunBytes;
+		i = j;
+	}
+
+	return bytes;
+}
+
+static bool Decode(const std::vector<char> & buffer, uint bytes, Voxel * voxels) {
+
+	uint n = 0;
+	for (uint i = 0; i + RunBytes <= bytes; i += RunBytes) {
+		unsigned short count;
+		memcpy(&count, &buffer[i], sizeof(count));
+		if (n + count > DeviceMap::BlockSize3)
+			return false;
+
+		for (int j = 0; j < count; ++j)
+			memcpy((char *) &voxels[n++], &buffer[i + sizeof(count)], sizeof(Voxel));
+	}
+
+	return n == DeviceMap::BlockSize3;
+}
+
+MapWriter::MapWriter(const std::string & path, const MapConfig & config, bool compress) :
+		path(path), compress(compress), failed(false), config(config), buffer(RawBytes) {
+
+	// Room for the header, which is written once the index is known.
+	std::vector<char> header(PageBytes, 0);
+	file = fopen((path + ".tmp").c_str(), "wb");
+	failed = !file || fwrite(header.data(), 1, PageBytes, file) != PageBytes;
+}
+
+MapWriter::~MapWriter() {
+
+	if (file) {
+		fclose(file);
+		remove((path + ".tmp").c_str());
+	}
+}
+
+bool MapWriter::IsOpen() const {
+	return file != nullptr;
+}
+
+void MapWriter::WriteBlock(const int3 & pos, const Voxel * voxels) {
+
+	if (failed)
+		return;
+
+	MapFileBlock block;
+	block.pos = pos;
+	block.offset = ftello(file);
+	block.bytes = compress ? Encode(voxels, buffer) : RawBytes;
+	const void * data = block.bytes < RawBytes ? (const void *) buffer.data() : voxels;
+	failed = fwrite(data, 1, block.bytes, file) != block.bytes;
+	index.push_back(block);
+}
+
+bool MapWriter::Finish(const std::vector<SURF> & keys) {
+
+	if (failed)
+		return false;
+
+	MapFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = Version;
+	header.voxelBytes = sizeof(Voxel);
+	header.blockSize = DeviceMap::BlockSize;
+	header.compressed = compress;
+	header.config = config;
+	header.noBlocks = index.size();
+	header.blocksOffset = PageBytes;
+	header.noKeys = keys.size();
+
+	header.keysOffset = ftello(file);
+	failed = fwrite(keys.data(), sizeof(SURF), keys.size(), file) != keys.size();
+	header.indexOffset = ftello(file);
+	failed = failed || fwrite(index.data(), sizeof(MapFileBlock), index.size(), file) != index.size();
+	failed = failed || fseeko(file, 0, SEEK_SET) != 0;
+	failed = failed || fwrite(&header, sizeof(header), 1, file) != 1;
+	failed = fclose(file) != 0 || failed;
+	file = nullptr;
+
+	std::string temp = path + ".tmp";
+	failed = failed || rename(temp.c_str(), path.c_str()) != 0;
+	if (failed)
+		remove(temp.c_str());
+	return !failed;
+}
+
+MapReader::MapReader(const std::string & path) :
+		compressed(true), blocksOffset(0), noKeys(0), keysOffset(0), buffer(RawBytes) {
+
+	file = fopen(path.c_str(), "rb");
+	if (!file)
+		return;
+
+	// The parts of the file follow each other the way Finish writes them,
+	// so a truncated or garbled file fails here rather than when loading.
+	MapFileHeader header;
+	long long fileBytes = 0;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+			!memcmp(header.magic, Magic, sizeof(Magic)) &&
+			header.version == Version &&
+			header.voxelBytes == sizeof(Voxel) &&
+			header.blockSize == DeviceMap::BlockSize &&
+			fseeko(file, 0, SEEK_END) == 0 && (fileBytes = ftello(file)) > 0;
+
+	valid = valid && header.noBlocks >= 0 && header.noKeys >= 0 &&
+			header.blocksOffset >= (long long) sizeof(header) &&
+			header.keysOffset >= header.blocksOffset &&
+			header.indexOffset == header.keysOffset + header.noKeys * (long long) sizeof(SURF) &&
+			fileBytes == header.indexOffset + header.noBlocks * (long long) sizeof(MapFileBlock);
+
+	if (valid) {
+		index.resize(header.noBlocks);
+		valid = fseeko(file, header.indexOffset, SEEK_SET) == 0 &&
+				fread(index.data(), sizeof(MapFileBlock), index.size(), file) == index.size();
+	}
+
+	// Blocks lie between the header and the keys, and raw files hold them
+	// back to back, the layout MapArena maps.
+	for (size_t i = 0; i < index.size() && valid; ++i) {
+		const MapFileBlock & block = index[i];
+		valid = block.bytes <= RawBytes && block.offset >= header.blocksOffset &&
+				block.offset + block.bytes <= header.keysOffset;
+		valid = valid && (header.compressed || (block.bytes == RawBytes &&
+				block.offset == header.blocksOffset + (long long) i * RawBytes));
+	}
+
+	if (!valid) {
+		fclose(file);
+		file = nullptr;
+		index.clear();
+		return;
+	}
+
+	config = header.config;
+	compressed = header.compressed;
+	blocksOffset = header.blocksOffset;
+	noKeys = header.noKeys;
+	keysOffset = header.keysOffset;
+}
+
+MapReader::~MapReader() {
+
+	if (file)
+		fclose(file);
+}
+
+bool MapReader::IsOpen() const {
+	return file != nullptr;
+}
+
+const MapConfig & MapReader::Config() const {
+	return config;
+}
+
+const std::vector<MapFileBlock> & MapReader::Blocks() const {
+	return index;
+}
+
+bool MapReader::Contiguous() const {
+	return !compressed;
+}
+
+long long MapReader::BlocksOffset() const {
+	return blocksOffset;
+}
+
+// Blocks are read in the order they were written, so a reader going
+// through the index only seeks between the cells it skips.
+bool MapReader::ReadBlock(const MapFileBlock & block, Voxel * voxels) {
+
+	if (!file || block.bytes > RawBytes || fseeko(file, block.offset, SEEK_SET) != 0)
+		return false;
+
+	if (block.bytes == RawBytes)
+		return fread(voxels, 1, RawBytes, file) == RawBytes;
+
+	return fread(buffer.data(), 1, block.bytes, file) == block.bytes &&
+			Decode(buffer, block.bytes, voxels);
+}
+
+bool MapReader::ReadKeys(std::vector<SURF> & keys) {
+
+	keys.resize(noKeys);
+	return file && fseeko(file, keysOffset, SEEK_SET) == 0 &&
+			fread(keys.data(), sizeof(SURF), keys.size(), file) == keys.size();
+}
+
+MapArena::MapArena(const std::string & path, long long offset, uint noBlocks, uint capacity) :
+		base(nullptr), bytes((size_t) std::max(noBlocks, capacity) * RawBytes),
+		noBlocks(noBlocks), capacity(std::max(noBlocks, capacity)), requested(noBlocks, false) {
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	// Pages past the end of the file would fault when touched, and the
+	// blocks can only be mapped if they start on a page.
+	struct stat st;
+	size_t fileBytes = (size_t) noBlocks * RawBytes;
+	if (fstat(fd, &st) == 0 && st.st_size >= offset + (long long) fileBytes && offset % sysconf(_SC_PAGESIZE) == 0) {
+		base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED)
+			base = nullptr;
+		else if (mmap(base, fileBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+			munmap(base, bytes);
+			base = nullptr;
+		}
+	}
+	close(fd);
+
+	// Blocks are looked up by hash, so reading ahead of a fault mostly
+	// brings in blocks nobody asked for; WillNeed reads ahead instead.
+	if (base)
+		madvise(base, fileBytes, MADV_RANDOM);
+}
+
+MapArena::~MapArena() {
+
+	if (base)
+		munmap(base, bytes);
+}
+
+bool MapArena::IsOpen() const {
+	return base != nullptr;
+}
+
+Voxel * MapArena::Blocks() const {
+	return (Voxel *) base;
+}
+
+uint MapArena::NumBlocks() const {
+	return noBlocks;
+}
+
+uint MapArena::Capacity() const {
+	return capacity;
+}
+
+// Blocks of a grid cell lie next to each other in the file, so the
+// blocks coming into view are asked for in a few runs.
+void MapArena::WillNeed(const HashEntry * entries, uint noEntries) {
+
+	if (!base)
+		return;
+
+	pending.clear();
+	for (uint i = 0; i < noEntries; ++i) {
+		uint block = entries[i].ptr / DeviceMap::BlockSize3;
+		if (entries[i].ptr >= 0 && block < noBlocks && !requested[block]) {
+			requested[block] = true;
+			pending.push_back(block);
+		}
+	}
+
+	std::sort(pending.begin(), pending.end());
+	for (size_t i = 0, j = 0; i < pending.size(); i = j) {
+		for (j = i + 1; j < pending.size() && pending[j] == pending[j - 1] + 1; ++j)
+			;
+
+		size_t begin = (size_t) pending[i] * RawBytes;
+		size_t end = (size_t) (pending[j - 1] + 1) * RawBytes;
+		begin -= begin % sysconf(_SC_PAGESIZE);
+		madvise((char *) base + begin, end - begin, MADV_WILLNEED);
+	}
+}
+
+// Only whole pages can be swapped for anonymous ones, the blocks sharing
+// a page with the rest of the file are read when they are cleared.
+void MapArena::Discard(uint begin, uint end) {
+
+	size_t pageBytes = sysconf(_SC_PAGESIZE);
+	size_t first = ((size_t) begin * RawBytes + pageBytes - 1) / pageBytes * pageBytes;
+	size_t last = (size_t) std::min(end, noBlocks) * RawBytes / pageBytes * pageBytes;
+	if (base && first < last)
+		mmap((char *) base + first, last - first, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+}
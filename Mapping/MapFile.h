@@ -0,0 +1,128 @@
+#ifndef MAPFILE_H__
+#define MAPFILE_H__
+
+#include "DeviceMap.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+// Where a block lies in a map file, bytes is less than a raw block if
+// it is stored run length encoded.
+struct MapFileBlock {
+	int3 pos;
+	uint bytes;
+	long long offset;
+};
+
+// Whether two voxels are stored the same, which is how runs are found.
+// Unobserved voxels are all the same although their sdf is NaN.
+bool SameVoxel(const Voxel & a, const Voxel & b);
+
+// A map file holds only the allocated blocks, each as its position and
+// voxels, followed by the key points and an index of the blocks. Writers
+// add blocks a grid cell at a time so that a region is read from a few
+// places in the file, and readers load the index to pick blocks from it.
+// Uncompressed blocks follow each other from a page boundary, so they
+// can be mapped as a block pool. The file is written under a temporary
+// name and renamed when finished, so a map being saved over stays whole.
+class MapWriter {
+
+public:
+
+	MapWriter(const std::string & path, const MapConfig & config, bool compress);
+
+	~MapWriter();
+
+	bool IsOpen() const;
+
+	void WriteBlock(const int3 & pos, const Voxel * voxels);
+
+	// Writes the keys and the index, returns false if anything failed.
+	bool Finish(const std::vector<SURF> & keys);
+
+protected:
+
+	FILE * file;
+	std::string path;
+	bool compress;
+	bool failed;
+	MapConfig config;
+	std::vector<char> buffer;
+	std::vector<MapFileBlock> index;
+};
+
+class MapReader {
+
+public:
+
+	MapReader(const std::string & path);
+
+	~MapReader();
+
+	bool IsOpen() const;
+
+	const MapConfig & Config() const;
+
+	const std::vector<MapFileBlock> & Blocks() const;
+
+	// Whether the blocks are stored raw one after another from
+	// BlocksOffset, in the order of the index.
+	bool Contiguous() const;
+
+	long long BlocksOffset() const;
+
+	bool ReadBlock(const MapFileBlock & block, Voxel * voxels);
+
+	bool ReadKeys(std::vector<SURF> & keys);
+
+protected:
+
+	FILE * file;
+	MapConfig config;
+	bool compressed;
+	long long blocksOffset;
+	long long noKeys;
+	long long keysOffset;
+	std::vector<char> buffer;
+	std::vector<MapFileBlock> index;
+};
+
+// The blocks of a contiguous map file mapped copy on write: a block is
+// read from disk the first time it is touched, and changes never reach
+// the file. Used as the block pool on the host backend, so address space
+// is kept past the file for the pool to grow into without moving.
+class MapArena {
+
+public:
+
+	MapArena(const std::string & path, long long offset, uint noBlocks, uint capacity);
+
+	~MapArena();
+
+	bool IsOpen() const;
+
+	Voxel * Blocks() const;
+
+	uint NumBlocks() const;
+
+	uint Capacity() const;
+
+	// Has the blocks of the entries read ahead, each only the first time.
+	void WillNeed(const HashEntry * entries, uint noEntries);
+
+	// Detaches the blocks [begin, end) from the file, so they can be
+	// cleared without being read first.
+	void Discard(uint begin, uint end);
+
+protected:
+
+	void * base;
+	size_t bytes;
+	uint noBlocks;
+	uint capacity;
+	std::vector<bool> requested;
+	std::vector<uint> pending;
+};
+
+#endif
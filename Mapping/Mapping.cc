@@ -2,9 +2,19 @@
 #include "Constant.h"
 #include "Reduction.h"
 #include "RenderScene.h"
-
-Mapping::Mapping() :
-		meshUpdated(false), hasNewKFFlag(false) {
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <algorithm>
+
+Mapping::Mapping(int noBlocks, int maxBlocks, const MapConfig & config) :
+		meshUpdated(false), hasNewKFFlag(false), noTrianglesHost(0), noVerticesHost(0),
+		config(config), store(nullptr),
+		streamDistance(0), temporalRaycast(false), hasLastCast(false), blockChunk(noBlocks), maxNoBlocks(std::max(noBlocks, maxBlocks)) {
+#ifdef HOST_BACKEND
+	rehashThread = nullptr;
+	arena = nullptr;
+#endif
 	Create();
 }
 
@@ -13,18 +23,32 @@ void Mapping::Create() {
 	heapCounter.create(1);
 	hashCounter.create(1);
 	noVisibleEntries.create(1);
-	heap.create(DeviceMap::NumSdfBlocks);
-	sdfBlock.create(DeviceMap::NumVoxels);
-	bucketMutex.create(DeviceMap::NumBuckets);
-	hashEntries.create(DeviceMap::NumEntries);
-	visibleEntries.create(DeviceMap::NumEntries);
+	noRecycledBlocks.create(1);
+	allocLog.create(1 << 16);
+	noAllocs.create(1);
+	noMissingBlocks.create(1);
+
+#ifdef HOST_BACKEND
+	// Open addressing, GrowMap keeps the table at most half full.
+	int noEntries = 4 * blockChunk;
+#else
+	// Chained buckets can not be rebuilt in place, so size them for the
+	// largest map: 1M buckets and 500k excess entries per 700k blocks.
+	int noEntries = maxNoBlocks / 7 * 15;
+#endif
+	CreateMap(blockChunk, noEntries, noEntries / 3 * 2);
 
 	nBlocks.create(1);
 	noTriangles.create(1);
 	modelVertex.create(DeviceMap::MaxVertices);
 	modelNormal.create(DeviceMap::MaxVertices);
 	modelColor.create(DeviceMap::MaxVertices);
-	blockPoses.create(DeviceMap::NumEntries);
+	modelIndex.create(DeviceMap::MaxIndices);
+	meshVertex.create(3 << 18);
+	meshNormal.create(3 << 18);
+	meshColor.create(3 << 18);
+	meshBlockIds.create(1 << 18);
+	meshEdges.create(3 << 18);
 
 	edgeTable.create(256);
 	vertexTable.create(256);
@@ -50,6 +74,150 @@ void Mapping::Create() {
 	Reset();
 }
 
+// Only allocates, the caller resets or uploads the contents.
+void Mapping::CreateMap(int noBlocks, int noEntries, int noBuckets) {
+
+#ifdef HOST_BACKEND
+	CancelRehash();
+	delete arena;
+	arena = nullptr;
+#endif
+	heap.create(noBlocks);
+	sdfBlock.create((size_t) noBlocks * DeviceMap::BlockSize3);
+	bucketMutex.create(noBuckets);
+	hashEntries.create(noEntries);
+	visibleEntries.create(noBlocks);
+	blockPoses.create(noBlocks);
+	gridValid = false;
+	hasLastCast = false;
+}
+
+int Mapping::NumBlocks() const {
+	return heap.size;
+}
+
+int Mapping::NumEntries() const {
+	return hashEntries.size;
+}
+
+int Mapping::NumBuckets() const {
+	return bucketMutex.size;
+}
+
+// Adds a chunk of blocks once the free ones run low. The pool is resized
+// in place, so blocks keep their index and the hash table stays valid.
+// On the host the hash table is rebuilt twice as large on a background
+// thread whenever the pool passes a quarter of it, and swapped in at a
+// later frame; the pool waits for the swap if it would pass half of it.
+void Mapping::GrowMap() {
+
+#ifdef HOST_BACKEND
+	if (rehashThread && rehashDone)
+		FinishRehash();
+#endif
+
+	int heapTop = 0;
+	heapCounter.download(&heapTop);
+	int noBlocks = NumBlocks();
+	if (heapTop + 1 < blockChunk / 4 && noBlocks < maxNoBlocks) {
+		int size = std::min(noBlocks + blockChunk, maxNoBlocks);
+#ifdef HOST_BACKEND
+		if (rehashThread || 2 * size > NumEntries())
+			return;
+#endif
+		heap.resize(size);
+#ifdef HOST_BACKEND
+		// A mapped map file keeps room for the largest pool past its blocks.
+		if (arena)
+			sdfBlock = DeviceArray<Voxel>(arena->Blocks(), (size_t) size * DeviceMap::BlockSize3);
+		else
+#endif
+		sdfBlock.resize((size_t) size * DeviceMap::BlockSize3);
+		visibleEntries.create(size);
+		blockPoses.create(size);
+		ExtendMap(*this, noBlocks, heapTop);
+		std::cout << "Map grown to " << size << " blocks" << std::endl;
+	}
+
+#ifdef HOST_BACKEND
+	if (!rehashThread && NumBlocks() > NumEntries() / 4)
+		BeginRehash(2 * NumEntries());
+#endif
+}
+
+#ifdef HOST_BACKEND
+// Blocks are neither deleted nor moved while the copy runs, and at most
+// as many as are free can be created, so the log of new blocks can not
+// overflow and the copy only misses what the log holds.
+void Mapping::BeginRehash(int noEntries) {
+
+	int heapTop = 0;
+	heapCounter.download(&heapTop);
+	newHashEntries.create(noEntries);
+	insertLog.create(heapTop + 1);
+	noLoggedInserts.create(1);
+	noLoggedInserts.clear();
+	rehashDone = false;
+	rehashCancelled = false;
+
+	DeviceMap src = *this;
+	DeviceMap dst = src;
+	dst.hashEntries = newHashEntries;
+	rehashThread = new std::thread([this, src, dst]() mutable {
+		for (int i = 0; i < (int) dst.hashEntries.size; ++i)
+			dst.hashEntries[i] = HashEntry();
+
+		for (int i = 0; i < (int) src.hashEntries.size && !rehashCancelled; ++i) {
+			const HashEntry & e = src.hashEntries[i];
+			int ptr = __atomic_load_n(&e.ptr, __ATOMIC_ACQUIRE);
+			if (ptr >= 0)
+				dst.InsertEntry(HashEntry(e.pos, ptr, 0));
+		}
+		rehashDone = true;
+	});
+}
+
+void Mapping::FinishRehash() {
+
+	rehashThread->join();
+	delete rehashThread;
+	rehashThread = nullptr;
+
+	DeviceMap src = *this;
+	DeviceMap dst = src;
+	dst.hashEntries = newHashEntries;
+	int noLogged = std::min(src.noLoggedInserts[0], (int) src.insertLog.size);
+	for (int i = 0; i < noLogged; ++i) {
+		HashEntry e = src.FindEntry(src.insertLog[i]);
+		if (e.ptr >= 0)
+			dst.InsertEntry(e);
+	}
+
+	hashEntries = newHashEntries;
+	newHashEntries.release();
+	insertLog.release();
+	noLoggedInserts.release();
+	sweepPos = 0;
+	streamPos = 0;
+	noRecycledBlocksHost = 0;
+	std::cout << "Hash table rebuilt with " << NumEntries() << " entries" << std::endl;
+}
+
+void Mapping::CancelRehash() {
+
+	if (!rehashThread)
+		return;
+
+	rehashCancelled = true;
+	rehashThread->join();
+	delete rehashThread;
+	rehashThread = nullptr;
+	newHashEntries.release();
+	insertLog.release();
+	noLoggedInserts.release();
+}
+#endif
+
 void Mapping::ForwardWarp(const Frame * last, Frame * next) {
 	ForwardWarping(last->vmap[0], last->nmap[0], next->vmap[0], next->nmap[0],
 			last->GpuRotation(), next->GpuInvRotation(), last->GpuTranslation(),
@@ -57,20 +225,266 @@ void Mapping::ForwardWarp(const Frame * last, Frame * next) {
 			Frame::cy(0));
 }
 
+// Sweeps a slice of the hash table per call and returns blocks that are
+// out of view and hold no surface to the heap, so noisy allocations do
+// not pile up. Reports the total once a full sweep has finished.
+void Mapping::CollectGarbage(const Frame * f) {
+
+#ifdef HOST_BACKEND
+	// Deleting moves entries the rebuild may not have copied yet.
+	if (rehashThread)
+		return;
+#endif
+
+	const int noSlices = 32;
+	int end = std::min(sweepPos + DivUp(NumEntries(), noSlices), NumEntries());
+
+	noRecycledBlocksHost += RecycleBlocks(*this, noRecycledBlocks,
+			f->GpuInvRotation(), f->GpuTranslation(), Frame::cols(0),
+			Frame::rows(0), Frame::fx(0), Frame::fy(0), Frame::cx(0),
+			Frame::cy(0), DeviceMap::DepthMax, DeviceMap::DepthMin, sweepPos,
+			end);
+
+	sweepPos = end;
+	if (sweepPos == NumEntries()) {
+		int heapTop = 0;
+		heapCounter.download(&heapTop);
+		if (DeviceMap::verbose)
+			std::cout << "Recycled " << noRecycledBlocksHost << " blocks, "
+					<< NumBlocks() - heapTop - 1 << " in use" << std::endl;
+		sweepPos = 0;
+		noRecycledBlocksHost = 0;
+	}
+}
+
+// Blocks stay on the device while their centre is within distance of the
+// camera; farther ones are kept in host memory, and past cacheBytes on
+// disk under path. Distance should be well over DeviceMap::DepthMax.
+void Mapping::EnableStreaming(float distance, size_t cacheBytes, const std::string & path) {
+
+	const int maxSwapBlocks = 4096;
+	delete store;
+	store = new BlockStore(path, cacheBytes);
+	streamDistance = distance;
+	swapPoses.create(maxSwapBlocks);
+	swapBlocks.create((size_t) maxSwapBlocks * DeviceMap::BlockSize3);
+	noSwapBlocks.create(1);
+	swapMissed.create(maxSwapBlocks);
+}
+
+// Moves blocks farther than streamDistance from the camera to the store,
+// sweeping a slice of the hash table per call like CollectGarbage. Stored
+// chunks are fetched back once their centre is a chunk diagonal closer
+// than that, so they are on the device before the camera can see them
+// and do not bounce between the two. The time spent here is what the
+// tracking thread stalls for; it is reported once a full sweep finished.
+void Mapping::StreamBlocks(const Frame * f) {
+
+	if (!store)
+		return;
+
+#ifdef HOST_BACKEND
+	// Deleting moves entries the rebuild may not have copied yet.
+	if (rehashThread)
+		return;
+#endif
+
+	auto t1 = std::chrono::steady_clock::now();
+
+	const int noSlices = 32;
+	int end = std::min(streamPos + DivUp(NumEntries(), noSlices), NumEntries());
+	float3 tview = f->GpuTranslation();
+	uint noOut = SwapOutBlocks(*this, swapPoses, swapBlocks, noSwapBlocks,
+			tview, streamDistance, streamPos, end);
+
+	if (noOut > 0) {
+		swapPosesHost.resize(noOut);
+		swapBlocksHost.resize((size_t) noOut * DeviceMap::BlockSize3);
+		swapPoses.download(swapPosesHost.data(), noOut);
+		swapBlocks.download(swapBlocksHost.data(), swapBlocksHost.size());
+		for (uint i = 0; i < noOut; ++i)
+			store->Insert(swapPosesHost[i], &swapBlocksHost[(size_t) i * DeviceMap::BlockSize3]);
+		noSwappedOut += noOut;
+	}
+
+	// Leaves some free blocks for fusion to allocate from.
+	int heapTop = 0;
+	heapCounter.download(&heapTop);
+	int noFree = std::min(heapTop + 1 - blockChunk / 8, (int) swapPoses.size);
+	if (noFree > 0) {
+		float blockWidth = config.voxelSize * DeviceMap::BlockSize;
+		float radius = streamDistance / blockWidth - sqrtf(3.0f) * BlockGrid::CellSize;
+		int3 pos = make_int3(floorf(tview.x / blockWidth), floorf(tview.y / blockWidth),
+				floorf(tview.z / blockWidth));
+
+		uint noIn = store->Fetch(pos, radius, noFree, swapPosesHost, swapBlocksHost);
+		if (noIn > 0) {
+			swapPoses.upload(swapPosesHost.data(), noIn);
+			swapBlocks.upload(swapBlocksHost.data(), swapBlocksHost.size());
+			uint noMissed = SwapInBlocks(*this, swapPoses, swapBlocks, swapMissed, noSwapBlocks, noIn);
+
+			// Blocks with no room left stay in the store for a later try.
+			swapMissedHost.resize(noMissed);
+			swapMissed.download(swapMissedHost.data(), noMissed);
+			for (int i : swapMissedHost)
+				store->Insert(swapPosesHost[i], &swapBlocksHost[(size_t) i * DeviceMap::BlockSize3]);
+			noSwapMissed += noMissed;
+			noSwappedIn += noIn - noMissed;
+		}
+	}
+
+	auto t2 = std::chrono::steady_clock::now();
+	double stall = std::chrono::duration<double, std::milli>(t2 - t1).count();
+	streamStall += stall;
+	maxStreamStall = std::max(maxStreamStall, stall);
+	noStreamCalls++;
+
+	streamPos = end;
+	if (streamPos == NumEntries()) {
+		if (DeviceMap::verbose)
+			std::cout << "Streamed " << noSwappedOut << " blocks out, " << noSwappedIn
+					<< " in, " << noSwapMissed << " put back; stalled "
+					<< streamStall / noStreamCalls << " ms per frame, "
+					<< maxStreamStall << " ms at most; "
+					<< store->CachedBytes() / (1024 * 1024) << " MB in memory, "
+					<< store->NumChunksOnDisk() << " chunks on disk" << std::endl;
+		streamPos = 0;
+		noSwappedOut = noSwappedIn = noSwapMissed = 0;
+		noStreamCalls = 0;
+		streamStall = maxStreamStall = 0;
+	}
+}
+
 void Mapping::UpdateVisibility(const Frame * f, uint & no) {
 
-	CheckBlockVisibility(*this, noVisibleEntries, f->GpuRotation(), f->GpuInvRotation(),
-			f->GpuTranslation(), Frame::cols(0), Frame::rows(0), Frame::fx(0),
-			Frame::fy(0), Frame::cx(0), Frame::cy(0), DeviceMap::DepthMax,
-			DeviceMap::DepthMin, &no);
+	UpdateVisibility(frameView, f->GpuRotation(), f->GpuInvRotation(),
+			f->GpuTranslation(), Frame::cols(0), Frame::rows(0),
+			DeviceMap::DepthMin, DeviceMap::DepthMax, Frame::fx(0),
+			Frame::fy(0), Frame::cx(0), Frame::cy(0), no);
 }
 
 void Mapping::UpdateVisibility(Matrix3f Rview, Matrix3f RviewInv, float3 tview,
 		float depthMin, float depthMax, float fx, float fy, float cx, float cy,
 		uint & no) {
 
-	CheckBlockVisibility(*this, noVisibleEntries, Rview, RviewInv, tview, 640,
-			480, fx, fy, cx, cy, depthMax, depthMin, &no);
+	UpdateVisibility(freeView, Rview, RviewInv, tview, 640, 480, depthMin,
+			depthMax, fx, fy, cx, cy, no);
+}
+
+// Only the blocks of grid cells in view can be visible, so those are
+// tested instead of the whole hash table. A view keeps them from the last
+// update, adds the blocks of cells coming into view and the blocks
+// allocated since, and drops those of cells out of view. Blocks that are
+// no longer in the map are dropped from the grid as well.
+void Mapping::UpdateVisibility(VisibleSet & view, Matrix3f Rview,
+		Matrix3f RviewInv, float3 tview, int cols, int rows, float depthMin,
+		float depthMax, float fx, float fy, float cx, float cy, uint & no) {
+
+	CollectNewBlocks();
+	if (!gridValid)
+		RebuildGrid();
+
+	std::unordered_set<long long> isNew;
+	candidatesHost.clear();
+	for (const int3 & pos : view.newBlocks)
+		if (isNew.insert(BlockGrid::Key(pos)).second)
+			candidatesHost.push_back(pos);
+	view.newBlocks.clear();
+
+	for (const int3 & pos : view.blocks)
+		if (!isNew.count(BlockGrid::Key(pos)))
+			candidatesHost.push_back(pos);
+
+	std::vector<int3> entering;
+	grid.CollectEnteringBlocks(Rview, RviewInv, tview, cols, rows, fx, fy,
+			cx, cy, depthMin, depthMax, config.voxelSize * DeviceMap::BlockSize,
+			view.cells, entering);
+	for (const int3 & pos : entering)
+		if (!isNew.count(BlockGrid::Key(pos)))
+			candidatesHost.push_back(pos);
+
+	if (candidates.size < candidatesHost.size()) {
+		candidates.create(candidatesHost.size() * 3 / 2);
+		missingBlocks.create(candidatesHost.size() * 3 / 2);
+	}
+
+	uint noMissing = 0;
+	candidates.upload(candidatesHost.data(), candidatesHost.size());
+	no = CheckBlockVisibility(*this, candidates, candidatesHost.size(),
+			noVisibleEntries, missingBlocks, noMissingBlocks, Rview, RviewInv,
+			tview, cols, rows, fx, fy, cx, cy, depthMax, depthMin, noMissing);
+
+	std::unordered_set<long long> missing;
+	if (noMissing > 0) {
+		std::vector<int3> blocks(noMissing);
+		missingBlocks.download(blocks.data(), noMissing);
+		for (const int3 & pos : blocks) {
+			grid.Erase(pos);
+			missing.insert(BlockGrid::Key(pos));
+		}
+	}
+
+	view.blocks.clear();
+	for (const int3 & pos : candidatesHost)
+		if (view.cells.count(BlockGrid::Key(BlockGrid::CellPos(pos))) &&
+			!missing.count(BlockGrid::Key(pos)))
+			view.blocks.push_back(pos);
+
+#ifdef HOST_BACKEND
+	if (arena)
+		arena->WillNeed(visibleEntries, no);
+#endif
+}
+
+// Adds the blocks allocated since the last call to the grid and to every
+// view. A view that has not been updated for long starts over instead.
+void Mapping::CollectNewBlocks() {
+
+	int noNew = 0;
+	noAllocs.download(&noNew);
+	if (noNew == 0)
+		return;
+
+	noAllocs.clear();
+	if (noNew > (int) allocLog.size) {
+		gridValid = false;
+		return;
+	}
+
+	std::vector<int3> blocks(noNew);
+	allocLog.download(blocks.data(), noNew);
+	for (const int3 & pos : blocks)
+		grid.Insert(pos);
+
+	for (VisibleSet * view : { &frameView, &freeView }) {
+		if (view->newBlocks.size() + noNew > allocLog.size) {
+			view->blocks.clear();
+			view->newBlocks.clear();
+			view->cells.clear();
+		} else
+			view->newBlocks.insert(view->newBlocks.end(), blocks.begin(), blocks.end());
+	}
+}
+
+// Needed whenever blocks may have been created without being logged, as
+// for a new or loaded map or once the log overflowed.
+void Mapping::RebuildGrid() {
+
+	std::vector<HashEntry> entries;
+	hashEntries.download(entries);
+	grid.Clear();
+	for (const HashEntry & entry : entries)
+		if (entry.ptr >= 0)
+			grid.Insert(entry.pos);
+
+	for (VisibleSet * view : { &frameView, &freeView }) {
+		view->blocks.clear();
+		view->newBlocks.clear();
+		view->cells.clear();
+	}
+
+	noAllocs.clear();
+	gridValid = true;
 }
 
 void Mapping::FuseColor(const Frame * f, uint & no) {
@@ -83,29 +497,109 @@ void Mapping::FuseColor(const DeviceArray2D<float> & depth,
 		Matrix3f Rview, Matrix3f RviewInv,
 		float3 tview, uint & no) {
 
-	FuseMapColor(depth, color, normal, noVisibleEntries, Rview, RviewInv, tview, *this,
+	AllocateBlocks(depth, *this, Rview, tview, Frame::fx(0), Frame::fy(0),
+			Frame::cx(0), Frame::cy(0));
+
+	UpdateVisibility(frameView, Rview, RviewInv, tview, depth.cols, depth.rows,
+			DeviceMap::DepthMin, DeviceMap::DepthMax, Frame::fx(0),
+			Frame::fy(0), Frame::cx(0), Frame::cy(0), no);
+
+	FuseMapColor(depth, color, normal, Rview, RviewInv, tview, *this,
 			Frame::fx(0), Frame::fy(0), Frame::cx(0), Frame::cy(0),
-			DeviceMap::DepthMax, DeviceMap::DepthMin, &no);
+			DeviceMap::DepthMax, DeviceMap::DepthMin, no);
+	MarkFused(no);
+}
 
+void Mapping::SetTemporalRaycast(bool enable) {
+	temporalRaycast = enable;
+	hasLastCast = false;
 }
 
-void Mapping::RayTrace(uint noVisibleBlocks, Frame * f) {
-	RayTrace(noVisibleBlocks, f->GpuRotation(), f->GpuInvRotation(), f->GpuTranslation(),
-			f->vmap[0], f->nmap[0], DeviceMap::DepthMin, DeviceMap::DepthMax,
-			Frame::fx(0), Frame::fy(0), Frame::cx(0), Frame::cy(0));
+// With temporal raycasting the last raycast of the tracked camera is
+// warped into the new view, so most rays start just before the surface
+// instead of at the near end of the visible blocks. Only full resolution
+// casts are seeded or kept as seeds.
+void Mapping::RayTrace(uint noVisibleBlocks, Frame * f, int level) {
+
+	DeviceArray2D<float4> & vmap = f->vmap[level];
+	DeviceArray2D<float4> & nmap = f->nmap[level];
+	Intrinsics K = Intrinsics(Frame::fx(0), Frame::fy(0), Frame::cx(0), Frame::cy(0))(level);
+	if (level > 0) {
+		CastRays(noVisibleBlocks, f->GpuRotation(), f->GpuInvRotation(),
+				f->GpuTranslation(), vmap, nmap, DeviceMap::DepthMin, DeviceMap::DepthMax,
+				K.fx, K.fy, K.cx, K.cy, false);
+		return;
+	}
+
+	bool seeded = temporalRaycast && hasLastCast;
+	if (seeded) {
+		if (zStart.cols != vmap.cols || zStart.rows != vmap.rows) {
+			warpedVMap.create(vmap.cols, vmap.rows);
+			warpedNMap.create(vmap.cols, vmap.rows);
+			zStart.create(vmap.cols, vmap.rows);
+		}
+
+		ForwardWarping(lastVMap, lastNMap, warpedVMap, warpedNMap, lastCastRot,
+				f->GpuInvRotation(), lastCastTrans, f->GpuTranslation(),
+				K.fx, K.fy, K.cx, K.cy);
+		PredictRayStarts(warpedVMap, zStart, 0.5f * config.truncateDist,
+				config.truncateDist);
+	}
+
+	hasLastCast = CastRays(noVisibleBlocks, f->GpuRotation(), f->GpuInvRotation(),
+			f->GpuTranslation(), vmap, nmap, DeviceMap::DepthMin, DeviceMap::DepthMax,
+			K.fx, K.fy, K.cx, K.cy, seeded);
+
+	if (temporalRaycast && hasLastCast) {
+		vmap.copyTo(lastVMap);
+		nmap.copyTo(lastNMap);
+		lastCastRot = f->GpuRotation();
+		lastCastTrans = f->GpuTranslation();
+	}
 }
 
 void Mapping::RayTrace(uint noVisibleBlocks, Matrix3f Rview, Matrix3f RviewInv,
 		float3 tview, DeviceArray2D<float4> & vmap,	DeviceArray2D<float4> & nmap,
 		float depthMin, float depthMax, float fx, float fy, float cx, float cy) {
 
-	if (CreateRenderingBlocks(visibleEntries, zRangeMin, zRangeMax, depthMax, depthMin,
+	CastRays(noVisibleBlocks, Rview, RviewInv, tview, vmap, nmap, depthMin,
+			depthMax, fx, fy, cx, cy, false);
+}
+
+// Returns whether any block was in view, vmap and nmap are left as they
+// were otherwise.
+bool Mapping::CastRays(uint noVisibleBlocks, Matrix3f Rview, Matrix3f RviewInv,
+		float3 tview, DeviceArray2D<float4> & vmap, DeviceArray2D<float4> & nmap,
+		float depthMin, float depthMax, float fx, float fy, float cx, float cy,
+		bool seeded) {
+
+	// The raycaster skips blocks the grid does not hold, so it has to
+	// know about every block allocated so far.
+	CollectNewBlocks();
+	if (!gridValid)
+		RebuildGrid();
+	grid.Upload();
+
+	// One cell of the depth range images per 8x8 pixels of the cast.
+	int cols = DivUp(vmap.cols, 8);
+	int rows = DivUp(vmap.rows, 8);
+	if (zRangeMin.cols != cols || zRangeMin.rows != rows) {
+		zRangeMin.create(cols, rows);
+		zRangeMax.create(cols, rows);
+	}
+
+	if (!CreateRenderingBlocks(visibleEntries, zRangeMin, zRangeMax, depthMax, depthMin,
 			renderingBlockList, noRenderingBlocks, RviewInv, tview,
-			noVisibleBlocks, fx, fy, cx, cy)) {
+			noVisibleBlocks, fx, fy, cx, cy, config.voxelSize))
+		return false;
 
+	if (seeded)
+		Raycast(*this, vmap, nmap, zRangeMin, zRangeMax, zStart, Rview, RviewInv,
+				tview, 1.0 / fx, 1.0 / fy, cx, cy);
+	else
 		Raycast(*this, vmap, nmap, zRangeMin, zRangeMax, Rview, RviewInv, tview,
 				1.0 / fx, 1.0 / fy, cx, cy);
-	}
+	return true;
 }
 
 std::vector<KeyFrame *> Mapping::LocalMap() const {
@@ -128,17 +622,230 @@ std::vector<KeyFrame *> Mapping::GlobalMap() const {
 	return tmp;
 }
 
+// Cube edges of a block as numbered by MeshBlocks: three leave each of
+// the voxels from the block's corner to the next block's.
+static const int BlockEdges = DeviceMap::BlockSize + 1;
+static const int NoBlockEdges = 3 * BlockEdges * BlockEdges * BlockEdges;
+
+// Whether the cube edge leaving voxel (x, y, z) of a block along axis
+// lies on a face the block shares with a neighbour.
+static bool OnBlockFace(int x, int y, int z, int axis) {
+	const int last = BlockEdges - 1;
+	return (axis != 0 && (x == 0 || x == last)) ||
+		   (axis != 1 && (y == 0 || y == last)) ||
+		   (axis != 2 && (z == 0 || z == last));
+}
+
+static long long EdgeKey(const int3 & voxelPos, int axis) {
+	return ((long long) (voxelPos.x & 0xfffff) << 42) |
+		   ((long long) (voxelPos.y & 0xfffff) << 22) |
+		   ((long long) (voxelPos.z & 0xfffff) << 2) | axis;
+}
+
+// Marches only the blocks whose voxels may have changed since the last
+// call: the blocks fused since, the ones allocated, recycled or streamed
+// in or out, and the blocks next to those, as the triangles of a block
+// read the voxels of its neighbours. Every other block keeps its
+// triangles from before, and the model is laid out block by block.
 void Mapping::CreateModel() {
 
-	MeshScene(nBlocks, noTriangles, *this, edgeTable, vertexTable,
-			triangleTable, modelNormal, modelVertex, modelColor, blockPoses);
+	uint noBlocks = CollectBlocks(*this, blockPoses, nBlocks);
+	std::vector<int3> blocks(noBlocks);
+	blockPoses.download(blocks.data(), noBlocks);
+
+	std::vector<int3> changed;
+	changed.swap(fusedBlocks);
+	fusedKeys.clear();
+
+	std::unordered_set<long long> present;
+	for (const int3 & pos : blocks) {
+		long long key = BlockGrid::Key(pos);
+		present.insert(key);
+		if (!meshCache.count(key))
+			changed.push_back(pos);
+	}
+
+	for (auto iter = meshCache.begin(); iter != meshCache.end();) {
+		if (!present.count(iter->first)) {
+			changed.push_back(iter->second.pos);
+			iter = meshCache.erase(iter);
+		} else
+			++iter;
+	}
+
+	if (changed.empty())
+		return;
+
+	std::unordered_set<long long> queued;
+	std::vector<int3> remesh;
+	for (const int3 & pos : changed) {
+		for (int z = -1; z <= 1; ++z) {
+			for (int y = -1; y <= 1; ++y) {
+				for (int x = -1; x <= 1; ++x) {
+					int3 block = pos + make_int3(x, y, z);
+					long long key = BlockGrid::Key(block);
+					if (present.count(key) && queued.insert(key).second)
+						remesh.push_back(block);
+				}
+			}
+		}
+	}
+
+	// Blocks are marched in batches, so running out of room for the
+	// triangles only costs marching one batch again.
+	const uint batchSize = 1 << 14;
+	std::vector<float3> vertices, normals;
+	std::vector<uchar3> colors;
+	std::vector<int> ids, edges;
+	std::vector<int> slot(NoBlockEdges, -1);
+	for (uint begin = 0; begin < remesh.size(); begin += batchSize) {
+		uint noBatch = std::min((uint) remesh.size() - begin, batchSize);
+		blockPoses.upload(&remesh[begin], noBatch);
+		uint n = 0;
+		while (true) {
+			n = MeshBlocks(*this, blockPoses, noBatch, nBlocks, noTriangles,
+					edgeTable, vertexTable, triangleTable, meshNormal, meshVertex,
+					meshColor, meshBlockIds, meshEdges);
+			if (n <= meshBlockIds.size || meshBlockIds.size == DeviceMap::MaxTriangles)
+				break;
+
+			size_t size = std::min(std::max((size_t) n, 2 * meshBlockIds.size),
+					(size_t) DeviceMap::MaxTriangles);
+			meshVertex.create(3 * size);
+			meshNormal.create(3 * size);
+			meshColor.create(3 * size);
+			meshBlockIds.create(size);
+			meshEdges.create(3 * size);
+		}
+
+		n = std::min(n, (uint) meshBlockIds.size);
+		vertices.resize(3 * n);
+		normals.resize(3 * n);
+		colors.resize(3 * n);
+		ids.resize(n);
+		edges.resize(3 * n);
+		meshVertex.download(vertices.data(), 3 * n);
+		meshNormal.download(normals.data(), 3 * n);
+		meshColor.download(colors.data(), 3 * n);
+		meshBlockIds.download(ids.data(), n);
+		meshEdges.download(edges.data(), 3 * n);
+
+		// Triangles come back in no particular order, so they are sorted
+		// by block before the vertices of each block are shared out.
+		std::vector<uint> first(noBatch + 1, 0);
+		for (uint i = 0; i < n; ++i)
+			first[ids[i] + 1]++;
+		for (uint i = 0; i < noBatch; ++i)
+			first[i + 1] += first[i];
+
+		std::vector<uint> order(n);
+		std::vector<uint> next(first.begin(), first.end() - 1);
+		for (uint i = 0; i < n; ++i)
+			order[next[ids[i]]++] = i;
+
+		for (uint i = 0; i < noBatch; ++i) {
+			BlockMesh & mesh = meshCache[BlockGrid::Key(remesh[begin + i])];
+			mesh.pos = remesh[begin + i];
+			mesh.vertices.clear();
+			mesh.normals.clear();
+			mesh.colors.clear();
+			mesh.edges.clear();
+			mesh.indices.clear();
+			for (uint j = first[i]; j < first[i + 1]; ++j) {
+				for (uint k = 3 * order[j]; k < 3 * order[j] + 3; ++k) {
+					int & index = slot[edges[k]];
+					if (index < 0) {
+						index = mesh.vertices.size();
+						mesh.vertices.push_back(vertices[k]);
+						mesh.normals.push_back(normals[k]);
+						mesh.colors.push_back(colors[k]);
+						mesh.edges.push_back(edges[k]);
+					}
+					mesh.indices.push_back(index);
+				}
+			}
+
+			for (int edge : mesh.edges)
+				slot[edge] = -1;
+		}
+	}
+
+	// Neighbouring blocks both hold the vertices on the faces between
+	// them, which are matched up by the voxel edge they lie on.
+	std::unordered_map<long long, uint> faceVertices;
+	std::vector<uint> indices, remap;
+	std::vector<long long> dropped;
+	vertices.clear();
+	normals.clear();
+	colors.clear();
+	for (const auto & entry : meshCache) {
+		const BlockMesh & mesh = entry.second;
+		if (vertices.size() + mesh.vertices.size() > modelVertex.size ||
+			indices.size() + mesh.indices.size() > modelIndex.size) {
+			dropped.push_back(entry.first);
+			continue;
+		}
+
+		int3 base = mesh.pos * DeviceMap::BlockSize;
+		remap.resize(mesh.vertices.size());
+		for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+			int edge = mesh.edges[i];
+			int axis = edge % 3;
+			int x = edge / 3 % BlockEdges;
+			int y = edge / 3 / BlockEdges % BlockEdges;
+			int z = edge / 3 / BlockEdges / BlockEdges;
+			if (OnBlockFace(x, y, z, axis)) {
+				long long key = EdgeKey(base + make_int3(x, y, z), axis);
+				auto res = faceVertices.insert(std::make_pair(key, (uint) vertices.size()));
+				if (!res.second) {
+					remap[i] = res.first->second;
+					continue;
+				}
+			}
+
+			remap[i] = vertices.size();
+			vertices.push_back(mesh.vertices[i]);
+			normals.push_back(mesh.normals[i]);
+			colors.push_back(mesh.colors[i]);
+		}
+
+		for (uint index : mesh.indices)
+			indices.push_back(remap[index]);
+	}
+
+	// Blocks that did not fit are taken out of the cache, so the next
+	// model marches them again in case recycling has made room.
+	if (!dropped.empty()) {
+		std::cout << "Model full, left out " << dropped.size() << " blocks" << std::endl;
+		for (long long key : dropped)
+			meshCache.erase(key);
+	}
 
-	noTriangles.download(&noTrianglesHost);
+	modelVertex.upload(vertices.data(), vertices.size());
+	modelNormal.upload(normals.data(), normals.size());
+	modelColor.upload(colors.data(), colors.size());
+	modelIndex.upload(indices.data(), indices.size());
+	noVerticesHost = vertices.size();
+	noTrianglesHost = indices.size() / 3;
 	if (noTrianglesHost > 0) {
 		meshUpdated = true;
 	}
 }
 
+// Remembers the blocks fusion touched for the next CreateModel. Nothing
+// is kept before the first model, which marches every block anyway.
+void Mapping::MarkFused(uint noVisibleBlocks) {
+
+	if (meshCache.empty() || noVisibleBlocks == 0)
+		return;
+
+	std::vector<HashEntry> entries(noVisibleBlocks);
+	visibleEntries.download(entries.data(), noVisibleBlocks);
+	for (const HashEntry & entry : entries)
+		if (fusedKeys.insert(BlockGrid::Key(entry.pos)).second)
+			fusedBlocks.push_back(entry.pos);
+}
+
 void Mapping::UpdateMapKeys() {
 	noKeys.clear();
 	CollectKeyPoints(*this, tmpKeys, noKeys);
@@ -150,67 +857,205 @@ void Mapping::UpdateMapKeys() {
 	}
 }
 
-void Mapping::CreateRAM() {
+// Blocks are written a grid cell at a time, so loading a region reads
+// the file in a few runs. Blocks streamed out to the store follow those
+// of the map, a chunk at a time, and stay in the store.
+bool Mapping::SaveMap(const std::string & path, bool compress) {
+
+	MapWriter file(path, config, compress);
+	if (!file.IsOpen())
+		return false;
+
+	uint noBlocks = CollectBlocks(*this, blockPoses, nBlocks);
+	std::vector<int3> blocks(noBlocks);
+	blockPoses.download(blocks.data(), noBlocks);
+	std::sort(blocks.begin(), blocks.end(), [](const int3 & a, const int3 & b) {
+		long long cellA = BlockGrid::Key(BlockGrid::CellPos(a));
+		long long cellB = BlockGrid::Key(BlockGrid::CellPos(b));
+		return cellA < cellB || (cellA == cellB && BlockGrid::Key(a) < BlockGrid::Key(b));
+	});
+
+	const int batchSize = 4096;
+	DeviceArray<int3> poses(batchSize);
+	DeviceArray<Voxel> voxels((size_t) batchSize * DeviceMap::BlockSize3);
+	std::vector<Voxel> voxelsHost(voxels.size);
+	for (uint i = 0; i < noBlocks; i += batchSize) {
+		uint n = std::min(noBlocks - i, (uint) batchSize);
+		poses.upload(&blocks[i], n);
+		CopyBlocks(*this, poses, voxels, n);
+		voxels.download(voxelsHost.data(), (size_t) n * DeviceMap::BlockSize3);
+		for (uint j = 0; j < n; ++j)
+			file.WriteBlock(blocks[i + j], &voxelsHost[(size_t) j * DeviceMap::BlockSize3]);
+	}
 
-	heapCounterRAM = new int[1];
-	hashCounterRAM = new int[1];
-	noVisibleEntriesRAM = new uint[1];
-	heapRAM = new int[DeviceMap::NumSdfBlocks];
-	bucketMutexRAM = new int[DeviceMap::NumBuckets];
-	sdfBlockRAM = new Voxel[DeviceMap::NumVoxels];
-	hashEntriesRAM = new HashEntry[DeviceMap::NumEntries];
-	visibleEntriesRAM = new HashEntry[DeviceMap::NumEntries];
+	if (store) {
+		std::unordered_set<long long> saved;
+		for (const int3 & pos : blocks)
+			saved.insert(BlockGrid::Key(pos));
+		store->ForEach([&](const int3 & pos, const Voxel * voxels) {
+			if (saved.insert(BlockGrid::Key(pos)).second)
+				file.WriteBlock(pos, voxels);
+		});
+	}
 
-	mutexKeysRAM = new int[KeyMap::MaxKeys];
-	mapKeysRAM = new SURF[KeyMap::maxEntries];
+	UpdateMapKeys();
+	std::vector<SURF> keys(hostKeys.begin(), hostKeys.begin() + noKeysHost);
+	return file.Finish(keys);
 }
 
-void Mapping::DownloadToRAM() {
+// Unless the file is mapped in place, the blocks are copied into the map,
+// which is grown first if they would not leave room to fuse. A file that
+// fails to open leaves the map as it was; one whose blocks fail to read
+// leaves it empty.
+bool Mapping::LoadMap(const std::string & path, float3 centre, float radius) {
+
+	MapReader file(path);
+	std::vector<SURF> keys;
+	if (!file.IsOpen() || !file.ReadKeys(keys))
+		return false;
+
+	float blockWidth = file.Config().voxelSize * DeviceMap::BlockSize;
+	std::vector<MapFileBlock> blocks;
+	for (const MapFileBlock & block : file.Blocks()) {
+		float3 pos = (make_float3(block.pos) + 0.5f) * blockWidth;
+		if (radius <= 0 || norm(pos - centre) <= radius)
+			blocks.push_back(block);
+	}
+
+	if (radius > 0)
+		keys.erase(std::remove_if(keys.begin(), keys.end(), [&](const SURF & key) {
+			return norm(key.pos - centre) > radius;
+		}), keys.end());
+
+	MapConfig lastConfig = config;
+	config = file.Config();
+	bool mapped = false;
+#if defined(HOST_BACKEND) && !defined(SPLIT_VOXEL_BLOCKS)
+	// Blocks are saved voxel by voxel, which is the layout of the pool
+	// unless the sdfs are kept apart.
+	if (file.Contiguous())
+		mapped = MapBlocks(path, file, blocks);
+#endif
+
+	uint noLost = 0;
+	bool valid = true;
+	if (!mapped) {
+		if ((int) blocks.size() + blockChunk / 4 > NumBlocks()) {
+			int size = std::min((int) blocks.size() + blockChunk, maxNoBlocks);
+			int noEntries = NumEntries();
+			int noBuckets = NumBuckets();
+#ifdef HOST_BACKEND
+			while (2 * size > noEntries)
+				noEntries *= 2;
+			noBuckets = noEntries / 3 * 2;
+#endif
+			CreateMap(size, noEntries, noBuckets);
+		}
 
-	CreateRAM();
+		Reset();
+
+		const int batchSize = 4096;
+		DeviceArray<int3> poses(batchSize);
+		DeviceArray<Voxel> voxels((size_t) batchSize * DeviceMap::BlockSize3);
+		DeviceArray<int> missed(batchSize);
+		DeviceArray<uint> noMissed(1);
+		std::vector<int3> posesHost(batchSize);
+		std::vector<Voxel> voxelsHost(voxels.size);
+		for (size_t i = 0; i < blocks.size() && valid; i += batchSize) {
+			uint n = std::min(blocks.size() - i, (size_t) batchSize);
+			for (uint j = 0; j < n && valid; ++j) {
+				posesHost[j] = blocks[i + j].pos;
+				valid = file.ReadBlock(blocks[i + j], &voxelsHost[(size_t) j * DeviceMap::BlockSize3]);
+			}
+
+			if (valid) {
+				poses.upload(posesHost.data(), n);
+				voxels.upload(voxelsHost.data(), (size_t) n * DeviceMap::BlockSize3);
+				noLost += SwapInBlocks(*this, poses, voxels, missed, noMissed, n);
+			}
+		}
+	}
+
+	// A map cut off at the block that failed is not kept.
+	if (!valid) {
+		Reset();
+		config = lastConfig;
+		return false;
+	}
 
-	heapCounter.download(heapCounterRAM);
-	hashCounter.download(hashCounterRAM);
-	noVisibleEntries.download(noVisibleEntriesRAM);
-	heap.download(heapRAM);
-	bucketMutex.download(bucketMutexRAM);
-	sdfBlock.download(sdfBlockRAM);
-	hashEntries.download(hashEntriesRAM);
-	visibleEntries.download(visibleEntriesRAM);
+	for (size_t i = 0; i < keys.size(); i += surfKeys.size) {
+		size_t n = std::min(keys.size() - i, surfKeys.size);
+		std::vector<int> keyIndex(n, -1);
+		surfKeys.upload(&keys[i], n);
+		mapKeyIndex.upload(keyIndex.data(), n);
+		InsertKeyPoints(*this, surfKeys, mapKeyIndex, n);
+	}
 
-	mutexKeys.download(mutexKeysRAM);
-	mapKeys.download(mapKeysRAM);
+	std::cout << "Loaded " << blocks.size() - noLost << " of "
+			<< file.Blocks().size() << " blocks and " << keys.size()
+			<< " key points" << std::endl;
+	return true;
 }
 
-void Mapping::UploadFromRAM() {
+#ifdef HOST_BACKEND
+// Takes the blocks of the file in place as the block pool, so loading
+// only builds the hash table and voxels are read from disk as they are
+// touched. Blocks outside the region are freed without being read, and
+// a chunk of fresh blocks past the file is handed out before them.
+bool Mapping::MapBlocks(const std::string & path, const MapReader & file,
+		const std::vector<MapFileBlock> & blocks) {
+
+	int noFileBlocks = file.Blocks().size();
+	int noBlocks = noFileBlocks + blockChunk;
+	MapArena * blockFile = new MapArena(path, file.BlocksOffset(), noFileBlocks, std::max(noBlocks, maxNoBlocks));
+	if (noFileBlocks == 0 || !blockFile->IsOpen()) {
+		delete blockFile;
+		return false;
+	}
 
-	heapCounter.upload(heapCounterRAM);
-	hashCounter.upload(hashCounterRAM);
-	noVisibleEntries.upload(noVisibleEntriesRAM);
-	heap.upload(heapRAM);
-	bucketMutex.upload(bucketMutexRAM);
-	sdfBlock.upload(sdfBlockRAM);
-	hashEntries.upload(hashEntriesRAM);
-	visibleEntries.upload(visibleEntriesRAM);
+	Reset();
+	int noEntries = NumEntries();
+	while (2 * noBlocks > noEntries)
+		noEntries *= 2;
+	CreateMap(noBlocks, noEntries, noEntries / 3 * 2);
+	sdfBlock = DeviceArray<Voxel>(blockFile->Blocks(), (size_t) noBlocks * DeviceMap::BlockSize3);
+	arena = blockFile;
+
+	// Resets the entries but not the voxels.
+	DeviceMap map = *this;
+	map.heapMem.size = 0;
+	ResetMap(map);
+	std::vector<bool> used(noFileBlocks, false);
+	for (const MapFileBlock & block : blocks) {
+		int ptr = (block.offset - file.BlocksOffset()) / sizeof(Voxel);
+		used[ptr / DeviceMap::BlockSize3] = true;
+		map.InsertEntry(HashEntry(block.pos, ptr, 0));
+	}
 
-	mutexKeys.upload(mutexKeysRAM);
-	mapKeys.upload(mapKeysRAM);
-}
+	std::vector<int> freeBlocks;
+	for (int i = 0; i < noFileBlocks; ++i) {
+		int j = i;
+		while (j < noFileBlocks && !used[j])
+			freeBlocks.push_back(j++);
+		arena->Discard(i, j);
+		i = j;
+	}
 
-void Mapping::ReleaseRAM() {
+	for (int i = noBlocks - 1; i >= noFileBlocks; --i)
+		freeBlocks.push_back(i);
 
-	delete [] heapCounterRAM;
-	delete [] hashCounterRAM;
-	delete [] noVisibleEntriesRAM;
-	delete [] heapRAM;
-	delete [] bucketMutexRAM;
-	delete [] sdfBlockRAM;
-	delete [] hashEntriesRAM;
-	delete [] visibleEntriesRAM;
+	int * heapMem = heap;
+	ThreadPool::Global().ParallelFor(0, (int) freeBlocks.size(), [&](int i) {
+		heapMem[i] = freeBlocks[i];
+		for (uint j = 0; j < DeviceMap::BlockSize3; ++j)
+			map.SetVoxel(freeBlocks[i] * DeviceMap::BlockSize3, j, Voxel());
+	}, 256);
 
-	delete [] mutexKeysRAM;
-	delete [] mapKeysRAM;
+	int heapTop = freeBlocks.size() - 1;
+	heapCounter.upload(&heapTop, 1);
+	return true;
 }
+#endif
 
 bool Mapping::HasNewKF() {
 
@@ -291,8 +1136,30 @@ void Mapping::FuseKeyPoints(const Frame * f) {
 
 void Mapping::Reset() {
 
+#ifdef HOST_BACKEND
+	CancelRehash();
+	// Resetting a mapped map file would copy every page of it.
+	if (arena)
+		CreateMap(NumBlocks(), NumEntries(), NumBuckets());
+#endif
 	ResetMap(*this);
 	ResetKeyPoints(*this);
+	gridValid = false;
+	hasLastCast = false;
+
+	sweepPos = 0;
+	noRecycledBlocksHost = 0;
+
+	if (store)
+		store->Clear();
+	streamPos = 0;
+	noSwappedOut = noSwappedIn = noSwapMissed = 0;
+	noStreamCalls = 0;
+	streamStall = maxStreamStall = 0;
+
+	meshCache.clear();
+	fusedKeys.clear();
+	fusedBlocks.clear();
 
 	mapKeys.clear();
 	keyFrames.clear();
@@ -312,6 +1179,7 @@ Mapping::operator DeviceMap() const {
 
 	DeviceMap map;
 
+	map.SetConfig(config);
 	map.heapMem = heap;
 	map.heapCounter = heapCounter;
 	map.noVisibleBlocks = noVisibleEntries;
@@ -320,6 +1188,13 @@ Mapping::operator DeviceMap() const {
 	map.visibleEntries = visibleEntries;
 	map.voxelBlocks = sdfBlock;
 	map.entryPtr = hashCounter;
+	map.allocLog = allocLog;
+	map.noAllocs = noAllocs;
+	map.gridCells = grid.DeviceCells();
+#ifdef HOST_BACKEND
+	map.insertLog = insertLog;
+	map.noLoggedInserts = noLoggedInserts;
+#endif
 
 	return map;
 }
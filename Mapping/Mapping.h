@@ -5,22 +5,49 @@
 #include "Tracking.h"
 #include "KeyFrame.h"
 #include "DeviceMap.h"
+#include "BlockGrid.h"
+#include "BlockStore.h"
+#include "MapFile.h"
 
 #include <vector>
+#include <thread>
+#include <unordered_map>
 #include <opencv.hpp>
 
 class KeyMap;
 class System;
 class Tracker;
 
+// Triangles marched from one voxel block. Its triangles share their
+// vertices, and edges holds the cube edge of the block each vertex lies
+// on, numbered as by MeshBlocks.
+struct BlockMesh {
+	int3 pos;
+	std::vector<float3> vertices;
+	std::vector<float3> normals;
+	std::vector<uchar3> colors;
+	std::vector<int> edges;
+	std::vector<uint> indices;
+};
+
 class Mapping {
 
 public:
 
-	Mapping();
+	Mapping(int noBlocks, int maxBlocks, const MapConfig & config);
 
 	void Create();
 
+	void CreateMap(int noBlocks, int noEntries, int noBuckets);
+
+	void GrowMap();
+
+	int NumBlocks() const;
+
+	int NumEntries() const;
+
+	int NumBuckets() const;
+
 	void Reset();
 
 	void Release();
@@ -29,13 +56,12 @@ public:
 
 	void UpdateMapKeys();
 
-	void CreateRAM();
+	// Saves the allocated blocks and the key points to a map file.
+	bool SaveMap(const std::string & path, bool compress);
 
-	void DownloadToRAM();
-
-	void UploadFromRAM();
-
-	void ReleaseRAM();
+	// Replaces the map by the blocks of a map file whose centre is within
+	// radius metres of centre, or by all of them if radius is not positive.
+	bool LoadMap(const std::string & path, float3 centre, float radius);
 
 	bool HasNewKF();
 
@@ -47,10 +73,19 @@ public:
 
 	void FuseColor(const Frame * f, uint & no);
 
-	void RayTrace(uint noVisibleBlocks, Frame * f);
+	// Renders the model into vmap[level] and nmap[level] of f.
+	void RayTrace(uint noVisibleBlocks, Frame * f, int level = 0);
 
 	void ForwardWarp(const Frame * last, Frame * next);
 
+	void CollectGarbage(const Frame * f);
+
+	void EnableStreaming(float distance, size_t cacheBytes, const std::string & path);
+
+	void StreamBlocks(const Frame * f);
+
+	void SetTemporalRaycast(bool enable);
+
 	void UpdateVisibility(Matrix3f Rview, Matrix3f RviewInv, float3 tview,
 			float depthMin, float depthMax, float fx, float fy, float cx,
 			float cy, uint & no);
@@ -79,30 +114,22 @@ public:
 	std::atomic<bool> hasNewKFFlag;
 	bool lost;
 
+	MapConfig config;
+
 	uint noKeysHost;
 	uint noTrianglesHost;
+	uint noVerticesHost;
 	uint noBlocksInFrustum;
+	uint noRecycledBlocksHost;
 	DeviceArray<float3> modelVertex;
 	DeviceArray<float3> modelNormal;
 	DeviceArray<uchar3> modelColor;
+	DeviceArray<uint> modelIndex;
 	std::vector<SURF> hostKeys;
 
 	std::vector<const KeyFrame *> localMap;
 	std::set<const KeyFrame *> keyFrames;
 
-	// Host Memory Spaces
-	int * heapRAM;
-	int * heapCounterRAM;
-	int * hashCounterRAM;
-	int * bucketMutexRAM;
-	Voxel * sdfBlockRAM;
-	uint * noVisibleEntriesRAM;
-	HashEntry * hashEntriesRAM;
-	HashEntry * visibleEntriesRAM;
-
-	int * mutexKeysRAM;
-	SURF * mapKeysRAM;
-
 protected:
 
 	// General map structure
@@ -115,6 +142,88 @@ protected:
 	DeviceArray<HashEntry> hashEntries;
 	DeviceArray<HashEntry> visibleEntries;
 
+	void UpdateVisibility(VisibleSet & view, Matrix3f Rview, Matrix3f RviewInv,
+			float3 tview, int cols, int rows, float depthMin, float depthMax,
+			float fx, float fy, float cx, float cy, uint & no);
+
+	void CollectNewBlocks();
+
+	void RebuildGrid();
+
+	bool CastRays(uint noVisibleBlocks, Matrix3f Rview, Matrix3f RviewInv,
+			float3 tview, DeviceArray2D<float4> & vmap,
+			DeviceArray2D<float4> & nmap, float depthMin, float depthMax,
+			float fx, float fy, float cx, float cy, bool seeded);
+
+	// Incremental visibility, frameView follows the tracked camera and
+	// freeView any other one
+	BlockGrid grid;
+	bool gridValid;
+	VisibleSet frameView;
+	VisibleSet freeView;
+	DeviceArray<int3> allocLog;
+	DeviceArray<int> noAllocs;
+	DeviceArray<int3> candidates;
+	DeviceArray<int3> missingBlocks;
+	DeviceArray<uint> noMissingBlocks;
+	std::vector<int3> candidatesHost;
+
+	// Recycling of empty blocks
+	int sweepPos;
+	DeviceArray<uint> noRecycledBlocks;
+
+	// Streaming of far blocks to host memory and disk
+	BlockStore * store;
+	float streamDistance;
+	int streamPos;
+	DeviceArray<int3> swapPoses;
+	DeviceArray<Voxel> swapBlocks;
+	DeviceArray<uint> noSwapBlocks;
+	DeviceArray<int> swapMissed;
+	std::vector<int3> swapPosesHost;
+	std::vector<Voxel> swapBlocksHost;
+	std::vector<int> swapMissedHost;
+	uint noSwappedOut;
+	uint noSwappedIn;
+	uint noSwapMissed;
+	int noStreamCalls;
+	double streamStall;
+	double maxStreamStall;
+
+	// Growing of the block pool and hash table
+	int blockChunk;
+	int maxNoBlocks;
+
+#ifdef HOST_BACKEND
+	void BeginRehash(int noEntries);
+	void FinishRehash();
+	void CancelRehash();
+
+	bool MapBlocks(const std::string & path, const MapReader & file,
+			const std::vector<MapFileBlock> & blocks);
+
+	std::thread * rehashThread;
+	std::atomic<bool> rehashDone;
+	std::atomic<bool> rehashCancelled;
+	DeviceArray<HashEntry> newHashEntries;
+	DeviceArray<int3> insertLog;
+	DeviceArray<int> noLoggedInserts;
+
+	// Map file the block pool is mapped from after loading, if any
+	MapArena * arena;
+#endif
+
+	// Rays of the tracked camera seeded from its last raycast
+	bool temporalRaycast;
+	bool hasLastCast;
+	Matrix3f lastCastRot;
+	float3 lastCastTrans;
+	DeviceArray2D<float4> lastVMap;
+	DeviceArray2D<float4> lastNMap;
+	DeviceArray2D<float4> warpedVMap;
+	DeviceArray2D<float4> warpedNMap;
+	DeviceArray2D<float> zStart;
+
 	// Used for rendering
 	DeviceArray<uint> noRenderingBlocks;
 	DeviceArray<RenderingBlock> renderingBlockList;
@@ -131,6 +240,19 @@ protected:
 	DeviceArray<int> vertexTable;
 	DeviceArray2D<int> triangleTable;
 
+	// Incremental meshing, the triangles of every block from the last
+	// pass and the blocks fused since
+	void MarkFused(uint noVisibleBlocks);
+
+	DeviceArray<float3> meshVertex;
+	DeviceArray<float3> meshNormal;
+	DeviceArray<uchar3> meshColor;
+	DeviceArray<int> meshBlockIds;
+	DeviceArray<int> meshEdges;
+	std::unordered_map<long long, BlockMesh> meshCache;
+	std::unordered_set<long long> fusedKeys;
+	std::vector<int3> fusedBlocks;
+
 	// Key Points and Re-localisation
 	DeviceArray<uint> noKeys;
 	DeviceArray<int> mutexKeys;
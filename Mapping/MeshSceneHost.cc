@@ -0,0 +1,280 @@
+#include "Constant.h"
+#include "RenderScene.h"
+#include "ThreadPool.h"
+
+#include <memory>
+
+struct MeshEngine {
+
+	DeviceMap map;
+
+	const int (*triangleTable)[16];
+	const int * edgeTable;
+	const int * noVertexTable;
+
+	// Collects the positions of allocated blocks in slots [begin, end).
+	inline void checkBlocks(int begin, int end, std::vector<int3> & blocks) const {
+
+		for (int x = begin; x < end; ++x) {
+			if (map.hashEntries[x].ptr >= 0)
+				blocks.push_back(map.hashEntries[x].pos);
+		}
+	}
+
+	// Voxels the cubes of one block read: the block itself, one voxel
+	// below it for the gradients and two above it for the far corners
+	// of the last cubes and their gradients.
+	static constexpr int TileSize = DeviceMap::BlockSize + 3;
+	static constexpr int TileSize3 = TileSize * TileSize * TileSize;
+
+	// Voxels that are a corner of some cube of the block. Each owns the
+	// three cube edges leaving it along +x, +y and +z.
+	static constexpr int EdgeSize = DeviceMap::BlockSize + 1;
+	static constexpr int EdgeSize3 = EdgeSize * EdgeSize * EdgeSize;
+
+	// A block read out of the map once, and the vertices on its cube
+	// edges, each worked out the first time a triangle needs it.
+	struct Tile {
+		float sdf[TileSize3];
+		uchar3 color[TileSize3];
+		bool usable[EdgeSize3];
+		bool resolved[3 * EdgeSize3];
+		float3 vertex[3 * EdgeSize3];
+		float3 normal[3 * EdgeSize3];
+		uchar3 vertexColor[3 * EdgeSize3];
+	};
+
+	inline int tileIdx(int x, int y, int z) const {
+		return ((z + 1) * TileSize + y + 1) * TileSize + x + 1;
+	}
+
+	inline int edgeIdx(int x, int y, int z, int axis) const {
+		return ((z * EdgeSize + y) * EdgeSize + x) * 3 + axis;
+	}
+
+	inline float3 gradient(const Tile & tile, int x, int y, int z) const {
+		return make_float3(tile.sdf[tileIdx(x + 1, y, z)] - tile.sdf[tileIdx(x - 1, y, z)],
+						   tile.sdf[tileIdx(x, y + 1, z)] - tile.sdf[tileIdx(x, y - 1, z)],
+						   tile.sdf[tileIdx(x, y, z + 1)] - tile.sdf[tileIdx(x, y, z - 1)]);
+	}
+
+	inline void loadTile(const int3 & block, Tile & tile) {
+
+		const int b = DeviceMap::BlockSize;
+		int ptr[27];
+		for (int i = 0; i < 27; ++i)
+			ptr[i] = map.FindEntry(block + make_int3(i % 3 - 1, i / 3 % 3 - 1, i / 9 - 1)).ptr;
+
+		for (int z = -1; z < TileSize - 1; ++z) {
+			int bz = z < 0 ? -1 : z < b ? 0 : 1;
+			for (int y = -1; y < TileSize - 1; ++y) {
+				int by = y < 0 ? -1 : y < b ? 0 : 1;
+				for (int x = -1; x < TileSize - 1; ++x) {
+					int bx = x < 0 ? -1 : x < b ? 0 : 1;
+					int k = ((bz + 1) * 3 + by + 1) * 3 + bx + 1;
+					int idx = tileIdx(x, y, z);
+					if (ptr[k] == EntryAvailable) {
+						tile.sdf[idx] = std::nanf("0x7fffffff");
+						tile.color[idx] = make_uchar3(0);
+						continue;
+					}
+
+					int3 localPos = make_int3(x - bx * b, y - by * b, z - bz * b);
+					map.GetVoxel(ptr[k], map.localPosToLocalIdx(localPos)).getValue(tile.sdf[idx], tile.color[idx]);
+				}
+			}
+		}
+
+		// A cube is meshed only if none of its corners is empty or
+		// unobserved and the gradients at all of them can be taken.
+		for (int z = 0; z < EdgeSize; ++z)
+			for (int y = 0; y < EdgeSize; ++y)
+				for (int x = 0; x < EdgeSize; ++x) {
+					float sdf = tile.sdf[tileIdx(x, y, z)];
+					float3 n = gradient(tile, x, y, z);
+					tile.usable[(z * EdgeSize + y) * EdgeSize + x] = sdf != 1.0 &&
+							!std::isnan(sdf) && !std::isnan(n.x) && !std::isnan(n.y) && !std::isnan(n.z);
+				}
+
+		std::fill(tile.resolved, tile.resolved + 3 * EdgeSize3, false);
+	}
+
+	inline float interp(float & v1, float & v2) {
+		if(fabs(0 - v1) < 1e-6)
+			return 0;
+		if(fabs(0 - v2) < 1e-6)
+			return 1;
+		if(fabs(v1 - v2) < 1e-6)
+			return 0;
+		return (0 - v1) / (v2 - v1);
+	}
+
+	// Vertex on the edge leaving voxel (x, y, z) of the tile along axis.
+	// Edges are always taken from their lower end, so the cubes sharing
+	// an edge all get the same vertex.
+	inline int edgeVertex(Tile & tile, const int3 & pos, int x, int y, int z, int axis) {
+
+		int e = edgeIdx(x, y, z, axis);
+		if (tile.resolved[e])
+			return e;
+
+		int3 d = make_int3(axis == 0, axis == 1, axis == 2);
+		int a = tileIdx(x, y, z);
+		int b = tileIdx(x + d.x, y + d.y, z + d.z);
+		float val = interp(tile.sdf[a], tile.sdf[b]);
+		float3 na = gradient(tile, x, y, z);
+		float3 nb = gradient(tile, x + d.x, y + d.y, z + d.z);
+		tile.vertex[e] = (pos + make_int3(x, y, z) + make_float3(d) * val) * map.voxelSize;
+		tile.normal[e] = normalised(na + val * (nb - na));
+		tile.vertexColor[e] = tile.color[a] + val * (tile.color[b] - tile.color[a]);
+		tile.resolved[e] = true;
+		return e;
+	}
+
+	// Marches every voxel of one block and appends the triangles to the
+	// caller's buffers, three vertices per triangle as on the device.
+	inline void MarchingCube(const int3 & block, Tile & tile, std::vector<float3> & vertices,
+			std::vector<float3> & normals, std::vector<uchar3> & color, std::vector<int> & edges) {
+
+		static const int corners[8][3] = {
+			{ 0, 0, 0 }, { 1, 0, 0 }, { 1, 1, 0 }, { 0, 1, 0 },
+			{ 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 }
+		};
+
+		// Corner each edge of the cube leaves from and its axis.
+		static const int edgeOwner[12][4] = {
+			{ 0, 0, 0, 0 }, { 1, 0, 0, 1 }, { 0, 1, 0, 0 }, { 0, 0, 0, 1 },
+			{ 0, 0, 1, 0 }, { 1, 0, 1, 1 }, { 0, 1, 1, 0 }, { 0, 0, 1, 1 },
+			{ 0, 0, 0, 2 }, { 1, 0, 0, 2 }, { 1, 1, 0, 2 }, { 0, 1, 0, 2 }
+		};
+
+		loadTile(block, tile);
+
+		int3 pos = block * DeviceMap::BlockSize;
+		for (uint i = 0; i < DeviceMap::BlockSize3; ++i) {
+			int3 p = map.localIdxToLocalPos(i);
+			int cubeIdx = 0;
+			bool usable = true;
+			for (int j = 0; j < 8; ++j) {
+				int x = p.x + corners[j][0], y = p.y + corners[j][1], z = p.z + corners[j][2];
+				usable = usable && tile.usable[(z * EdgeSize + y) * EdgeSize + x];
+				if (tile.sdf[tileIdx(x, y, z)] < 0)
+					cubeIdx |= 1 << j;
+			}
+
+			if(!usable || edgeTable[cubeIdx] == 0)
+				continue;
+
+			for(int j = 0; j < noVertexTable[cubeIdx]; ++j) {
+				const int * edge = edgeOwner[triangleTable[cubeIdx][j]];
+				int e = edgeVertex(tile, pos, p.x + edge[0], p.y + edge[1], p.z + edge[2], edge[3]);
+				vertices.push_back(tile.vertex[e]);
+				normals.push_back(tile.normal[e]);
+				color.push_back(tile.vertexColor[e]);
+				edges.push_back(e);
+			}
+		}
+	}
+};
+
+uint CollectBlocks(DeviceMap map,
+				   DeviceArray<int3> & blockPoses,
+				   DeviceArray<uint> & noBlocks) {
+
+	MeshEngine engine;
+	engine.map = map;
+
+	const int scanChunk = 1 << 14;
+	int noScans = DivUp((int) map.hashEntries.size, scanChunk);
+	std::vector<std::vector<int3>> occupied(noScans);
+	ThreadPool::Global().ParallelFor(0, noScans, [&](int i) {
+		int end = std::min((i + 1) * scanChunk, (int) map.hashEntries.size);
+		engine.checkBlocks(i * scanChunk, end, occupied[i]);
+	});
+
+	uint noOccupied = 0;
+	for (int i = 0; i < noScans; ++i) {
+		size_t n = std::min(occupied[i].size(), blockPoses.size - noOccupied);
+		std::copy(occupied[i].begin(), occupied[i].begin() + n, (int3*) blockPoses + noOccupied);
+		noOccupied += n;
+	}
+
+	((uint*) noBlocks)[0] = noOccupied;
+	return noOccupied;
+}
+
+uint MeshBlocks(DeviceMap map,
+				const DeviceArray<int3> & blockPoses,
+				uint noBlocks,
+				DeviceArray<uint> & noOccupiedBlocks,
+				DeviceArray<uint> & noTotalTriangles,
+				const DeviceArray<int> & edgeTable,
+				const DeviceArray<int> & vertexTable,
+				const DeviceArray2D<int> & triangleTable,
+				DeviceArray<float3> & normal,
+				DeviceArray<float3> & vertex,
+				DeviceArray<uchar3> & color,
+				DeviceArray<int> & blockIds,
+				DeviceArray<int> & vertexEdges) {
+
+	((uint*) noOccupiedBlocks)[0] = noBlocks;
+	((uint*) noTotalTriangles)[0] = 0;
+	if (noBlocks == 0)
+		return 0;
+
+	MeshEngine engine;
+	engine.map = map;
+	engine.triangleTable = triangleTableHost;
+	engine.edgeTable = edgeTableHost;
+	engine.noVertexTable = vertexTableHost;
+
+	// Each chunk of blocks is meshed into its own buffers, then the
+	// buffers are laid out back to back in block order.
+	const int meshChunk = 64;
+	int noMeshes = DivUp((int) noBlocks, meshChunk);
+	std::vector<std::vector<float3>> vertices(noMeshes), normals(noMeshes);
+	std::vector<std::vector<uchar3>> colors(noMeshes);
+	std::vector<std::vector<int>> ids(noMeshes), edges(noMeshes);
+	const int3 * blocks = blockPoses;
+
+	ThreadPool & pool = ThreadPool::Global();
+	pool.ParallelFor(0, noMeshes, [&](int i) {
+		std::unique_ptr<MeshEngine::Tile> tile(new MeshEngine::Tile);
+		int end = std::min((i + 1) * meshChunk, (int) noBlocks);
+		for (int j = i * meshChunk; j < end; ++j) {
+			size_t first = vertices[i].size();
+			engine.MarchingCube(blocks[j], *tile, vertices[i], normals[i], colors[i], edges[i]);
+			ids[i].insert(ids[i].end(), (vertices[i].size() - first) / 3, j);
+		}
+	});
+
+	std::vector<size_t> offset(noMeshes + 1, 0);
+	for (int i = 0; i < noMeshes; ++i)
+		offset[i + 1] = offset[i] + vertices[i].size();
+
+	// As on the device, triangles past the end of the buffers are
+	// counted but not written.
+	size_t noVertices = std::min(offset[noMeshes], std::min(vertex.size, normal.size));
+	noVertices = std::min(std::min(noVertices, color.size), vertexEdges.size);
+	noVertices = std::min(noVertices, 3 * blockIds.size) / 3 * 3;
+
+	float3 * pVertex = vertex;
+	float3 * pNormal = normal;
+	uchar3 * pColor = color;
+	int * pIds = blockIds;
+	int * pEdges = vertexEdges;
+	pool.ParallelFor(0, noMeshes, [&](int i) {
+		if (offset[i] >= noVertices)
+			return;
+		size_t n = std::min(offset[i + 1], noVertices) - offset[i];
+		std::copy(vertices[i].begin(), vertices[i].begin() + n, pVertex + offset[i]);
+		std::copy(normals[i].begin(), normals[i].begin() + n, pNormal + offset[i]);
+		std::copy(colors[i].begin(), colors[i].begin() + n, pColor + offset[i]);
+		std::copy(ids[i].begin(), ids[i].begin() + n / 3, pIds + offset[i] / 3);
+		std::copy(edges[i].begin(), edges[i].begin() + n, pEdges + offset[i]);
+	});
+
+	uint noTriangles = offset[noMeshes] / 3;
+	((uint*) noTotalTriangles)[0] = noTriangles;
+	return noTriangles;
+}
@@ -14,6 +14,7 @@ struct Projection {
 	float3 tcurr;
 	float depthMax, depthMin;
 	float fx, fy, cx, cy;
+	float voxelSize;
 
 	uint * noRenderingBlocks;
 	uint noVisibleBlocks;
@@ -62,7 +63,7 @@ struct Projection {
 			tmp.x += (corner & 1) ? 1 : 0;
 			tmp.y += (corner & 2) ? 1 : 0;
 			tmp.z += (corner & 4) ? 1 : 0;
-			float3 pt3d = tmp * DeviceMap::BlockSize * DeviceMap::VoxelSize;
+			float3 pt3d = tmp * DeviceMap::BlockSize * voxelSize;
 			pt3d = RcurrInv * (pt3d - tcurr);
 			if (pt3d.z < 2e-1)
 				continue;
@@ -209,7 +210,8 @@ bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
 						  float fx,
 						  float fy,
 						  float cx,
-						  float cy) {
+						  float cy,
+						  float voxelSize) {
 
 	if(noVisibleBlocks == 0)
 		return false;
@@ -232,6 +234,7 @@ bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
 	proj.zRangeY = zRangeY;
 	proj.depthMax = depthMax;
 	proj.depthMin = depthMin;
+	proj.voxelSize = voxelSize;
 	proj.noRenderingBlocks = noRenderingBlocks;
 	proj.noVisibleBlocks = noVisibleBlocks;
 	proj.renderingBlockList = renderingBlockList;
@@ -242,13 +245,8 @@ bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
 	block.y = DivUp(rows, thread.y);
 
 	zRangeY.clear();
-	float zRangeMax[60][80];
-	for(int i = 0; i < 80; ++i) {
-		for(int j = 0; j < 60; ++j) {
-			zRangeMax[j][i] = 100.f;
-		}
-	}
-	zRangeX.upload(zRangeMax);
+	std::vector<float> zRangeMax(cols * rows, 100.f);
+	zRangeX.upload(zRangeMax.data(), cols * sizeof(float));
 
 	thread = dim3(1024);
 	block = dim3(DivUp((int) noVisibleBlocks, block.x));
@@ -283,45 +281,50 @@ struct Rendering {
 	mutable PtrStep<float4> nmap;
 	PtrStep<float> zRangeX;
 	PtrStep<float> zRangeY;
+	PtrStep<float> zStart;
+	bool seeded;
 	float invfx, invfy, cx, cy;
 	Matrix3f Rview, RviewInv;
 	float3 tview;
 
 	__device__ __inline__ float readSdf(const float3 & pt3d, HashEntry & cache, bool & valid) {
-		Voxel voxel = map.FindVoxel(pt3d, cache, valid);
-		if (voxel.weight == 0)
+		float sdf = map.FindSdf(pt3d, cache, valid);
+		if (isnan(sdf))
 			valid = false;
-		return voxel.sdf;
+		return sdf;
 	}
 
-	__device__ __inline__ float readSdfInterped(const float3 & pt, HashEntry & cache, bool & valid) {
+	__device__ __inline__ float readSdfInterped(const float3 & pt, BlockCache & cache, bool & valid) {
 
 		float3 xyz = pt - floor(pt);
 		float sdf[2], result[4];
-		sdf[0] = map.FindVoxel(pt, cache, valid).sdf;
-		sdf[1] = map.FindVoxel(pt + make_float3(1, 0, 0), cache, valid).sdf;
+		sdf[0] = map.FindSdf(pt, cache, valid);
+		sdf[1] = map.FindSdf(pt + make_float3(1, 0, 0), cache, valid);
 		result[0] = (1.0f - xyz.x) * sdf[0] + xyz.x * sdf[1];
 
-		sdf[0] = map.FindVoxel(pt + make_float3(0, 1, 0), cache, valid).sdf;
-		sdf[1] = map.FindVoxel(pt + make_float3(1, 1, 0), cache, valid).sdf;
+		sdf[0] = map.FindSdf(pt + make_float3(0, 1, 0), cache, valid);
+		sdf[1] = map.FindSdf(pt + make_float3(1, 1, 0), cache, valid);
 		result[1] = (1.0f - xyz.x) * sdf[0] + xyz.x * sdf[1];
 		result[2] = (1.0f - xyz.y) * result[0] + xyz.y * result[1];
 
-		sdf[0] = map.FindVoxel(pt + make_float3(0, 0, 1), cache, valid).sdf;
-		sdf[1] = map.FindVoxel(pt + make_float3(1, 0, 1), cache, valid).sdf;
+		sdf[0] = map.FindSdf(pt + make_float3(0, 0, 1), cache, valid);
+		sdf[1] = map.FindSdf(pt + make_float3(1, 0, 1), cache, valid);
 		result[0] = (1.0f - xyz.x) * sdf[0] + xyz.x * sdf[1];
 
-		sdf[0] = map.FindVoxel(pt + make_float3(0, 1, 1), cache, valid).sdf;
-		sdf[1] = map.FindVoxel(pt + make_float3(1, 1, 1), cache, valid).sdf;
+		sdf[0] = map.FindSdf(pt + make_float3(0, 1, 1), cache, valid);
+		sdf[1] = map.FindSdf(pt + make_float3(1, 1, 1), cache, valid);
 		result[1] = (1.0f - xyz.x) * sdf[0] + xyz.x * sdf[1];
 		result[3] = (1.0f - xyz.y) * result[0] + xyz.y * result[1];
 		return (1.0f - xyz.z) * result[2] + xyz.z * result[3];
 	}
 
-	__device__ __inline__ bool readNormal(const float3 & pt, HashEntry & cache, float3 & n) {
+	// Central differences read voxels from pt - 1 to pt + 2 on each axis,
+	// so the window of cache is moved to start one voxel below pt.
+	__device__ __inline__ bool readNormal(const float3 & pt, BlockCache & cache, float3 & n) {
 
 		bool valid;
 		float sdf[6];
+		map.MoveCache(make_int3(pt - make_float3(1, 1, 1)), cache);
 		sdf[0] = readSdfInterped(pt + make_float3(1, 0, 0), cache, valid);
 		if(isnan(sdf[0]) || sdf[0] == 1.0f || !valid)
 			return false;
@@ -351,6 +354,68 @@ struct Rendering {
 		return true;
 	}
 
+	// Marches result along dir until the sdf turns negative. A seeded ray
+	// gives up unless its first sample is in the positive band of the sdf.
+	__device__ __inline__ bool march(float3 & result, const float3 & dir,
+			float dist_s, float dist_e, bool seeded, HashEntry & b, BlockCache & window) {
+
+		float sdf = 1.0f;
+		bool valid_sdf = false;
+		bool first = seeded;
+		float step;
+		HashEntry cell(make_int3(0x7fffffff), EntryAvailable, 0);
+		while (dist_s < dist_e) {
+			if (!(map.voxelPosToBlockPos(make_int3(result)) == b.pos)) {
+				step = map.FindEmptySpan(result, dir, dist_e - dist_s, cell);
+				if (step > 0) {
+					if (first)
+						return false;
+					result += step * dir;
+					dist_s += step;
+					continue;
+				}
+			}
+
+			sdf = readSdf(result, b, valid_sdf);
+			if (first && !(valid_sdf && sdf > 0.0f && sdf < 1.0f))
+				return false;
+			first = false;
+
+			if(!valid_sdf) {
+				step = DeviceMap::BlockSize;
+			}
+			else {
+				if (sdf <= 0.1f && sdf >= -0.5f) {
+					sdf = readSdfInterped(result, window, valid_sdf);
+				}
+
+				if (sdf <= 0.0f)
+					break;
+
+				if (!isnan(sdf))
+					step = max(sdf * map.stepScale, 1.0f);
+				else
+					step = DeviceMap::BlockSize;
+			}
+
+			result += step * dir;
+			dist_s += step;
+		}
+
+		if(sdf <= 0.0f) {
+			step = sdf * map.stepScale;
+			result += step * dir;
+
+			sdf = readSdfInterped(result, window, valid_sdf);
+
+			step = sdf * map.stepScale;
+			result += step * dir;
+			return true;
+		}
+
+		return false;
+	}
+
 	__device__ __inline__ void operator()() {
 
 		int x = blockDim.x * blockIdx.x + threadIdx.x;
@@ -371,67 +436,45 @@ struct Rendering {
 		if(zRange.y < 1e-3 || zRange.x < 1e-3 || isnan(zRange.x) || isnan(zRange.y))
 			return;
 
-		float sdf = 1.0f;
-
 		float3 pt3d;
 		pt3d.z = zRange.x;
 		pt3d.x = pt3d.z * ((float) x - cx) * invfx;
 		pt3d.y = pt3d.z * ((float) y - cy) * invfy;
-		float dist_s = norm(pt3d) * DeviceMap::voxelSizeInv;
-		float3 block_s = (Rview * pt3d + tview) * DeviceMap::voxelSizeInv;
+		float dist_s = norm(pt3d) * map.voxelSizeInv;
+		float3 block_s = (Rview * pt3d + tview) * map.voxelSizeInv;
 
 		pt3d.z = zRange.y;
 		pt3d.x = pt3d.z * ((float) x - cx) * invfx;
 		pt3d.y = pt3d.z * ((float) y - cy) * invfy;
-		float dist_e = norm(pt3d) * DeviceMap::voxelSizeInv;
-		float3 block_e = (Rview * pt3d + tview) * DeviceMap::voxelSizeInv;
+		float dist_e = norm(pt3d) * map.voxelSizeInv;
+		float3 block_e = (Rview * pt3d + tview) * map.voxelSizeInv;
 
 		float3 dir = normalised(block_e - block_s);
-		float3 result = block_s;
+		float3 result;
 
-		bool valid_sdf = false;
 		bool found_pt = false;
-		float step;
-		HashEntry b;
-		while (dist_s < dist_e) {
-			sdf = readSdf(result, b, valid_sdf);
-			if(!valid_sdf) {
-				step = DeviceMap::BlockSize;
-			}
-			else {
-				if (sdf <= 0.1f && sdf >= -0.5f) {
-					sdf = readSdfInterped(result, b, valid_sdf);
-				}
-
-				if (sdf <= 0.0f)
-					break;
-
-				if (!isnan(sdf))
-					step = max(sdf * DeviceMap::stepScale, 1.0f);
-				else
-					step = DeviceMap::BlockSize;
+		HashEntry b(make_int3(0x7fffffff), EntryAvailable, 0);
+		BlockCache window;
+		if (seeded) {
+			pt3d.z = zStart.ptr(y)[x];
+			if (pt3d.z > zRange.x && pt3d.z < zRange.y) {
+				pt3d.x = pt3d.z * ((float) x - cx) * invfx;
+				pt3d.y = pt3d.z * ((float) y - cy) * invfy;
+				result = (Rview * pt3d + tview) * map.voxelSizeInv;
+				found_pt = march(result, dir, norm(pt3d) * map.voxelSizeInv, dist_e, true, b, window);
 			}
-
-			result += step * dir;
-			dist_s += step;
 		}
 
-		if(sdf <= 0.0f) {
-			step = sdf * DeviceMap::stepScale;
-			result += step * dir;
-
-			sdf = readSdfInterped(result, b, valid_sdf);
-
-			step = sdf * DeviceMap::stepScale;
-			result += step * dir;
-			found_pt = true;
+		if (!found_pt) {
+			result = block_s;
+			found_pt = march(result, dir, dist_s, dist_e, false, b, window);
 		}
 
 		if(found_pt) {
 			float3 normal;
-			if(readNormal(result, b, normal)) {
+			if(readNormal(result, window, normal)) {
 
-				result = RviewInv * (result * DeviceMap::VoxelSize - tview);
+				result = RviewInv * (result * map.voxelSize - tview);
 
 				vmap.ptr(y)[x] = make_float4(result, 1.0);
 				nmap.ptr(y)[x] = make_float4(normal, 1.0);
@@ -444,18 +487,19 @@ __global__ void __launch_bounds__(32, 16) RayCastKernel(Rendering cast) {
 	cast();
 }
 
-void Raycast(DeviceMap map,
-			 DeviceArray2D<float4> & vmap,
-			 DeviceArray2D<float4> & nmap,
-			 DeviceArray2D<float> & zRangeX,
-			 DeviceArray2D<float> & zRangeY,
-			 Matrix3f Rview,
-			 Matrix3f RviewInv,
-			 float3 tview,
-			 float invfx,
-			 float invfy,
-			 float cx,
-			 float cy) {
+static void CastRays(DeviceMap map,
+					 DeviceArray2D<float4> & vmap,
+					 DeviceArray2D<float4> & nmap,
+					 DeviceArray2D<float> & zRangeX,
+					 DeviceArray2D<float> & zRangeY,
+					 const DeviceArray2D<float> * zStart,
+					 Matrix3f Rview,
+					 Matrix3f RviewInv,
+					 float3 tview,
+					 float invfx,
+					 float invfy,
+					 float cx,
+					 float cy) {
 
 	int cols = vmap.cols;
 	int rows = vmap.rows;
@@ -469,6 +513,9 @@ void Raycast(DeviceMap map,
 	cast.nmap = nmap;
 	cast.zRangeX = zRangeX;
 	cast.zRangeY = zRangeY;
+	cast.seeded = zStart != nullptr;
+	if (zStart)
+		cast.zStart = *zStart;
 	cast.invfx = invfx;
 	cast.invfy = invfy;
 	cast.cx = cx;
@@ -487,3 +534,78 @@ void Raycast(DeviceMap map,
 	SafeCall(cudaGetLastError());
 	SafeCall(cudaDeviceSynchronize());
 }
+
+void Raycast(DeviceMap map,
+			 DeviceArray2D<float4> & vmap,
+			 DeviceArray2D<float4> & nmap,
+			 DeviceArray2D<float> & zRangeX,
+			 DeviceArray2D<float> & zRangeY,
+			 Matrix3f Rview,
+			 Matrix3f RviewInv,
+			 float3 tview,
+			 float invfx,
+			 float invfy,
+			 float cx,
+			 float cy) {
+
+	CastRays(map, vmap, nmap, zRangeX, zRangeY, nullptr, Rview, RviewInv,
+			tview, invfx, invfy, cx, cy);
+}
+
+void Raycast(DeviceMap map,
+			 DeviceArray2D<float4> & vmap,
+			 DeviceArray2D<float4> & nmap,
+			 DeviceArray2D<float> & zRangeX,
+			 DeviceArray2D<float> & zRangeY,
+			 const DeviceArray2D<float> & zStart,
+			 Matrix3f Rview,
+			 Matrix3f RviewInv,
+			 float3 tview,
+			 float invfx,
+			 float invfy,
+			 float cx,
+			 float cy) {
+
+	CastRays(map, vmap, nmap, zRangeX, zRangeY, &zStart, Rview, RviewInv,
+			tview, invfx, invfy, cx, cy);
+}
+
+// Each ray starts margin in front of the nearest point warped into the
+// 3x3 pixels around it, which also covers pixels no point landed on. Where
+// those points are more than maxSpread apart the start is left at 0.
+__global__ void PredictRayStartsKernel(PtrStepSz<float4> vmap,
+		PtrStep<float> zStart, float margin, float maxSpread) {
+
+	int x = blockDim.x * blockIdx.x + threadIdx.x;
+	int y = blockDim.y * blockIdx.y + threadIdx.y;
+	if (x >= vmap.cols || y >= vmap.rows)
+		return;
+
+	float zMin = 1e10f, zMax = 0;
+	for (int v = max(y - 1, 0); v <= min(y + 1, vmap.rows - 1); ++v) {
+		for (int u = max(x - 1, 0); u <= min(x + 1, vmap.cols - 1); ++u) {
+			float z = vmap.ptr(v)[u].z;
+			if (z > 0) {
+				zMin = fminf(zMin, z);
+				zMax = fmaxf(zMax, z);
+			}
+		}
+	}
+
+	float z = 0;
+	if (zMax > 0 && zMax - zMin <= maxSpread)
+		z = zMin - margin;
+	zStart.ptr(y)[x] = z;
+}
+
+void PredictRayStarts(const DeviceArray2D<float4> & vmap,
+		DeviceArray2D<float> & zStart, float margin, float maxSpread) {
+
+	dim3 thread(32, 8);
+	dim3 block(DivUp(vmap.cols, thread.x), DivUp(vmap.rows, thread.y));
+
+	PredictRayStartsKernel<<<block, thread>>>(vmap, zStart, margin, maxSpread);
+
+	SafeCall(cudaGetLastError());
+	SafeCall(cudaDeviceSynchronize());
+}
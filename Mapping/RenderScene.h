@@ -2,6 +2,8 @@
 
 void ResetMap(DeviceMap map);
 
+void ExtendMap(DeviceMap map, int noBlocks, int heapTop);
+
 void ResetKeyPoints(KeyMap map);
 
 void InsertKeyPoints(KeyMap map, DeviceArray<SURF> & keys,
@@ -17,6 +19,19 @@ void Raycast(DeviceMap map, DeviceArray2D<float4> & vmap,
 		Matrix3f Rview, Matrix3f RviewInv,
 		float3 tview, float invfx, float invfy, float cx, float cy);
 
+// As above, but a ray with a start depth in zStart begins there and is
+// cast from zRangeX only if no surface lies just behind that start.
+void Raycast(DeviceMap map, DeviceArray2D<float4> & vmap,
+		DeviceArray2D<float4> & nmap,
+		DeviceArray2D<float> & zRangeX,
+		DeviceArray2D<float> & zRangeY,
+		const DeviceArray2D<float> & zStart,
+		Matrix3f Rview, Matrix3f RviewInv,
+		float3 tview, float invfx, float invfy, float cx, float cy);
+
+void PredictRayStarts(const DeviceArray2D<float4> & vmap,
+		DeviceArray2D<float> & zStart, float margin, float maxSpread);
+
 bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
 		DeviceArray2D<float> & zRangeX,
 		DeviceArray2D<float> & zRangeY,
@@ -24,29 +39,64 @@ bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
 		DeviceArray<RenderingBlock> & renderingBlockList,
 		DeviceArray<uint> & noRenderingBlocks,
 		Matrix3f RviewInv, float3 tview,
-		uint noVisibleBlocks, float fx, float fy, float cx, float cy);
+		uint noVisibleBlocks, float fx, float fy, float cx, float cy,
+		float voxelSize);
+
+// Positions of the allocated blocks, as many as blockPoses holds.
+uint CollectBlocks(DeviceMap map, DeviceArray<int3> & blockPoses,
+		DeviceArray<uint> & noBlocks);
 
-uint MeshScene(DeviceArray<uint> & noOccupiedBlocks,
+// Marches the first noBlocks blocks of blockPoses. Triangle i comes from
+// block blockIds[i] of the list, and vertex j lies on the cube edge
+// vertexEdges[j] of that block: edge ((z * 9 + y) * 9 + x) * 3 + axis
+// leaves voxel (x, y, z) of the block along axis. Returns the number of
+// triangles found, which may be more than the buffers hold.
+uint MeshBlocks(DeviceMap map, const DeviceArray<int3> & blockPoses,
+		uint noBlocks, DeviceArray<uint> & noOccupiedBlocks,
 		DeviceArray<uint> & noTotalTriangles,
-		DeviceMap map,
 		const DeviceArray<int> & edgeTable,
 		const DeviceArray<int> & vertexTable,
 		const DeviceArray2D<int> & triangleTable,
 		DeviceArray<float3> & normal,
 		DeviceArray<float3> & vertex,
 		DeviceArray<uchar3> & color,
-		DeviceArray<int3> & blockPoses);
+		DeviceArray<int> & blockIds,
+		DeviceArray<int> & vertexEdges);
 
-void CheckBlockVisibility(DeviceMap map, DeviceArray<uint> & noVisibleBlocks,
+uint CheckBlockVisibility(DeviceMap map, const DeviceArray<int3> & candidates,
+		uint noCandidates, DeviceArray<uint> & noVisibleBlocks,
+		DeviceArray<int3> & missingBlocks, DeviceArray<uint> & noMissingBlocks,
 		Matrix3f Rview, Matrix3f RviewInv, float3 tview, int cols, int rows,
 		float fx, float fy, float cx, float cy, float depthMax, float depthMin,
-		uint * host_data);
+		uint & noMissing);
+
+void AllocateBlocks(const DeviceArray2D<float> & depth, DeviceMap map,
+		Matrix3f Rview, float3 tview, float fx, float fy, float cx, float cy);
 
 void FuseMapColor(const DeviceArray2D<float> & depth,
 		const DeviceArray2D<uchar3> & color,
 		const DeviceArray2D<float4> & nmap,
-		DeviceArray<uint> & noVisibleBlocks,
 		Matrix3f Rview, Matrix3f RviewInv,
 		float3 tview, DeviceMap map,
 		float fx, float fy, float cx, float cy,
-		float depthMax, float depthMin, uint * host_data);
+		float depthMax, float depthMin, uint noVisibleBlocks);
+
+uint RecycleBlocks(DeviceMap map, DeviceArray<uint> & noRecycledBlocks,
+		Matrix3f RviewInv, float3 tview, int cols, int rows,
+		float fx, float fy, float cx, float cy,
+		float depthMax, float depthMin, int begin, int end);
+
+uint SwapOutBlocks(DeviceMap map, DeviceArray<int3> & blockPoses,
+		DeviceArray<Voxel> & blocks, DeviceArray<uint> & noBlocks,
+		float3 tview, float distance, int begin, int end);
+
+// Returns the number of blocks that found no room in the map, and their
+// indices in missedBlocks so the caller can keep their voxels.
+uint SwapInBlocks(DeviceMap map, DeviceArray<int3> & blockPoses,
+		DeviceArray<Voxel> & blocks, DeviceArray<int> & missedBlocks,
+		DeviceArray<uint> & noMissedBlocks, uint noBlocks);
+
+// Copies the voxels of the first noBlocks blocks of blockPoses into
+// blocks, leaving the map as it is. Blocks not in the map come out empty.
+void CopyBlocks(DeviceMap map, const DeviceArray<int3> & blockPoses,
+		DeviceArray<Voxel> & blocks, uint noBlocks);
@@ -0,0 +1,668 @@
+#include "RenderScene.h"
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <cstdio>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define minMaxSubSample 8
+#define rayTileSize 8
+
+struct Projection {
+
+	int cols, rows;
+
+	Matrix3f RcurrInv;
+	float3 tcurr;
+	float depthMax, depthMin;
+	float fx, fy, cx, cy;
+	float voxelSize;
+
+	uint noVisibleBlocks;
+
+	PtrSz<HashEntry> visibleBlocks;
+
+	inline float2 project(const float3 & pt3d) const {
+
+		float2 pt2d;
+		pt2d.x = fx * pt3d.x / pt3d.z + cx;
+		pt2d.y = fy * pt3d.y / pt3d.z + cy;
+		return pt2d;
+	}
+
+	inline bool projectBlock(const int3 & pos, RenderingBlock & block) const {
+
+		block.upperLeft = make_short2(cols, rows);
+		block.lowerRight = make_short2(-1, -1);
+		block.zRange = make_float2(depthMax, depthMin);
+		for (int corner = 0; corner < 8; ++corner) {
+			int3 tmp = pos;
+			tmp.x += (corner & 1) ? 1 : 0;
+			tmp.y += (corner & 2) ? 1 : 0;
+			tmp.z += (corner & 4) ? 1 : 0;
+			float3 pt3d = tmp * DeviceMap::BlockSize * voxelSize;
+			pt3d = RcurrInv * (pt3d - tcurr);
+			if (pt3d.z < 2e-1)
+				continue;
+
+			float2 pt2d = project(pt3d) / minMaxSubSample;
+
+			if (block.upperLeft.x > floor(pt2d.x))
+				block.upperLeft.x = (int) floor(pt2d.x);
+			if (block.lowerRight.x < ceil(pt2d.x))
+				block.lowerRight.x = (int) ceil(pt2d.x);
+			if (block.upperLeft.y > floor(pt2d.y))
+				block.upperLeft.y = (int) floor(pt2d.y);
+			if (block.lowerRight.y < ceil(pt2d.y))
+				block.lowerRight.y = (int) ceil(pt2d.y);
+			if (block.zRange.x > pt3d.z)
+				block.zRange.x = pt3d.z;
+			if (block.zRange.y < pt3d.z)
+				block.zRange.y = pt3d.z;
+		}
+
+		if (block.upperLeft.x < 0)
+			block.upperLeft.x = 0;
+		if (block.upperLeft.y < 0)
+			block.upperLeft.y = 0;
+		if (block.lowerRight.x >= cols)
+			block.lowerRight.x = cols - 1;
+		if (block.lowerRight.y >= rows)
+			block.lowerRight.y = rows - 1;
+		if (block.upperLeft.x > block.lowerRight.x)
+			return false;
+		if (block.upperLeft.y > block.lowerRight.y)
+			return false;
+		if (block.zRange.x < depthMin)
+			block.zRange.x = depthMin;
+		if (block.zRange.y < depthMin)
+			return false;
+
+		return true;
+	}
+
+	// Projects visible blocks [begin, end) and widens the depth bounds of
+	// every cell they cover. Each caller owns its zMin / zMax, so no
+	// atomics are needed; the partial ranges are merged afterwards.
+	inline void fillBlocks(int begin, int end, float * zMin, float * zMax,
+			std::vector<RenderingBlock> & blocks) const {
+
+		for (int i = begin; i < end; ++i) {
+			RenderingBlock b;
+			if (visibleBlocks[i].ptr == EntryAvailable ||
+				!projectBlock(visibleBlocks[i].pos, b))
+				continue;
+
+			for (int y = b.upperLeft.y; y <= b.lowerRight.y; ++y) {
+				for (int x = b.upperLeft.x; x <= b.lowerRight.x; ++x) {
+					int id = y * cols + x;
+					zMin[id] = std::min(zMin[id], b.zRange.x);
+					zMax[id] = std::max(zMax[id], b.zRange.y);
+				}
+			}
+
+			blocks.push_back(b);
+		}
+	}
+};
+
+bool CreateRenderingBlocks(const DeviceArray<HashEntry> & visibleBlocks,
+						  DeviceArray2D<float> & zRangeX,
+						  DeviceArray2D<float> & zRangeY,
+						  const float & depthMax,
+						  const float & depthMin,
+						  DeviceArray<RenderingBlock> & renderingBlockList,
+						  DeviceArray<uint> & noRenderingBlocks,
+						  Matrix3f RviewInv,
+						  float3 tview,
+						  uint noVisibleBlocks,
+						  float fx,
+						  float fy,
+						  float cx,
+						  float cy,
+						  float voxelSize) {
+
+	if(noVisibleBlocks == 0)
+		return false;
+
+	int cols = zRangeX.cols;
+	int rows = zRangeX.rows;
+	noRenderingBlocks.clear();
+
+	Projection proj;
+	proj.fx = fx;
+	proj.fy = fy;
+	proj.cx = cx;
+	proj.cy = cy;
+	proj.visibleBlocks = visibleBlocks;
+	proj.cols = cols;
+	proj.rows = rows;
+	proj.RcurrInv = RviewInv;
+	proj.tcurr = tview;
+	proj.depthMax = depthMax;
+	proj.depthMin = depthMin;
+	proj.voxelSize = voxelSize;
+	proj.noVisibleBlocks = noVisibleBlocks;
+
+	ThreadPool & pool = ThreadPool::Global();
+	int noChunks = std::min(pool.NumThreads(), DivUp((int) noVisibleBlocks, 256));
+	int chunk = DivUp((int) noVisibleBlocks, noChunks);
+
+	std::vector<std::vector<float>> zMin(noChunks, std::vector<float>(cols * rows, 100.f));
+	std::vector<std::vector<float>> zMax(noChunks, std::vector<float>(cols * rows, 0.f));
+	std::vector<std::vector<RenderingBlock>> blocks(noChunks);
+
+	pool.ParallelFor(0, noChunks, [&](int i) {
+		int end = std::min((i + 1) * chunk, (int) noVisibleBlocks);
+		proj.fillBlocks(i * chunk, end, zMin[i].data(), zMax[i].data(), blocks[i]);
+	});
+
+	for (int i = 1; i < noChunks; ++i) {
+		for (int j = 0; j < cols * rows; ++j) {
+			zMin[0][j] = std::min(zMin[0][j], zMin[i][j]);
+			zMax[0][j] = std::max(zMax[0][j], zMax[i][j]);
+		}
+	}
+
+	uint totalBlocks = 0;
+	for (int i = 0; i < noChunks; ++i) {
+		size_t n = std::min(blocks[i].size(), renderingBlockList.size - totalBlocks);
+		std::copy(blocks[i].begin(), blocks[i].begin() + n,
+				(RenderingBlock*) renderingBlockList + totalBlocks);
+		totalBlocks += n;
+	}
+
+	((uint*) noRenderingBlocks)[0] = totalBlocks;
+	if (totalBlocks == 0)
+		return false;
+
+	zRangeX.upload(zMin[0].data(), cols * sizeof(float));
+	zRangeY.upload(zMax[0].data(), cols * sizeof(float));
+	return true;
+}
+
+// One row of an 8x8 tile, marched together. Lanes are individual rays;
+// hash lookups stay scalar, interpolation runs across all lanes at once.
+struct RayPacket {
+
+	alignas(32) float px[8], py[8], pz[8];
+	alignas(32) float sdf[8];
+	float dx[8], dy[8], dz[8];
+	float dist_s[8], dist_e[8];
+	float skip[8];
+	HashEntry cache[8];
+	HashEntry cell[8];
+	BlockCache window[8];
+	int noSamples;
+	int noLookups;
+};
+
+struct RayCount {
+	int noRays;
+	int noSamples;
+	int noLookups;
+};
+
+#ifdef __AVX2__
+static inline __m256 Lerp(__m256 a, __m256 b, __m256 t) {
+	__m256 s = _mm256_sub_ps(_mm256_set1_ps(1.0f), t);
+	return _mm256_add_ps(_mm256_mul_ps(s, a), _mm256_mul_ps(t, b));
+}
+#endif
+
+static inline float Lerp(float a, float b, float t) {
+	return (1.0f - t) * a + t * b;
+}
+
+// Trilinear blend of eight corner samples per lane, corners ordered
+// with x in bit 0, y in bit 1 and z in bit 2.
+static inline void Interpolate(const float (&c)[8][8], const float * fx,
+		const float * fy, const float * fz, float * sdf) {
+
+#ifdef __AVX2__
+	__m256 x = _mm256_load_ps(fx);
+	__m256 y = _mm256_load_ps(fy);
+	__m256 z = _mm256_load_ps(fz);
+	__m256 r0 = Lerp(_mm256_load_ps(c[0]), _mm256_load_ps(c[1]), x);
+	__m256 r1 = Lerp(_mm256_load_ps(c[2]), _mm256_load_ps(c[3]), x);
+	__m256 r2 = Lerp(r0, r1, y);
+	r0 = Lerp(_mm256_load_ps(c[4]), _mm256_load_ps(c[5]), x);
+	r1 = Lerp(_mm256_load_ps(c[6]), _mm256_load_ps(c[7]), x);
+	__m256 r3 = Lerp(r0, r1, y);
+	_mm256_store_ps(sdf, Lerp(r2, r3, z));
+#else
+	for (int i = 0; i < 8; ++i) {
+		float r2 = Lerp(Lerp(c[0][i], c[1][i], fx[i]), Lerp(c[2][i], c[3][i], fx[i]), fy[i]);
+		float r3 = Lerp(Lerp(c[4][i], c[5][i], fx[i]), Lerp(c[6][i], c[7][i], fx[i]), fy[i]);
+		sdf[i] = Lerp(r2, r3, fz[i]);
+	}
+#endif
+}
+
+struct Rendering {
+
+	int cols, rows;
+	DeviceMap map;
+	mutable PtrStep<float4> vmap;
+	mutable PtrStep<float4> nmap;
+	PtrStep<float> zRangeX;
+	PtrStep<float> zRangeY;
+	PtrStep<float> zStart;
+	bool seeded;
+	float invfx, invfy, cx, cy;
+	Matrix3f Rview, RviewInv;
+	float3 tview;
+
+	// FindSdf, counting the hash lookups made on a miss of the cached block.
+	inline float findSdf(const float3 & pt3d, HashEntry & cache, bool & valid, int & noLookups) {
+		noLookups += !(map.voxelPosToBlockPos(make_int3(pt3d)) == cache.pos);
+		return map.FindSdf(pt3d, cache, valid);
+	}
+
+	inline float findSdf(const float3 & pt3d, BlockCache & cache, bool & valid, int & noLookups) {
+		int3 d = map.voxelPosToBlockPos(make_int3(pt3d)) + cache.base * -1;
+		if (d.x < 0 || d.x > 1 || d.y < 0 || d.y > 1 || d.z < 0 || d.z > 1)
+			noLookups++;
+		else
+			noLookups += !(cache.resolved & (1 << ((d.z * 2 + d.y) * 2 + d.x)));
+		return map.FindSdf(pt3d, cache, valid);
+	}
+
+	inline float readSdf(const float3 & pt3d, HashEntry & cache, bool & valid, int & noLookups) {
+		float sdf = findSdf(pt3d, cache, valid, noLookups);
+		if (std::isnan(sdf))
+			valid = false;
+		return sdf;
+	}
+
+	// Interpolated sdf at pt + offset for the lanes in mask. As on the
+	// device, a lane is valid if its last corner lies in an allocated block.
+	inline int readSdfInterped(RayPacket & p, const float3 & offset, int mask, float * sdf) {
+
+		alignas(32) float corner[8][8] = { };
+		alignas(32) float fx[8] = { }, fy[8] = { }, fz[8] = { };
+
+		int valid = 0;
+		for (int m = mask; m; m &= m - 1) {
+			int i = __builtin_ctz(m);
+			float3 pt = make_float3(p.px[i], p.py[i], p.pz[i]) + offset;
+			float3 xyz = pt - floor(pt);
+			fx[i] = xyz.x;
+			fy[i] = xyz.y;
+			fz[i] = xyz.z;
+
+			bool v = false;
+			for (int c = 0; c < 8; ++c) {
+				float3 pc = pt + make_float3(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+				corner[c][i] = findSdf(pc, p.window[i], v, p.noLookups);
+			}
+
+			if (v)
+				valid |= 1 << i;
+		}
+
+		Interpolate(corner, fx, fy, fz, sdf);
+		return valid;
+	}
+
+	inline void advance(RayPacket & p, int i, float step) {
+		p.px[i] += step * p.dx[i];
+		p.py[i] += step * p.dy[i];
+		p.pz[i] += step * p.dz[i];
+	}
+
+	// Marches the rays of row y in lanes, lane i being pixel x0 + i.
+	// Mirrors the per-pixel device kernel step for step, so the predicted
+	// maps match the CUDA path. Seeded rays start at zStart and must first
+	// land in the positive band of the sdf; the lanes that do not, or that
+	// find no surface, are returned to be cast again from zRange.x.
+	inline int castPacket(int x0, int y, int lanes, const float2 & zRange,
+			bool seeded, RayCount & count) {
+
+		RayPacket p;
+		alignas(32) float tmp[8];
+		p.noLookups = 0;
+		p.noSamples = 0;
+
+		int active = 0;
+		for (int m = lanes; m; m &= m - 1) {
+			int i = __builtin_ctz(m);
+			int x = x0 + i;
+			float3 pt3d;
+			pt3d.z = zRange.y;
+			pt3d.x = pt3d.z * ((float) x - cx) * invfx;
+			pt3d.y = pt3d.z * ((float) y - cy) * invfy;
+			p.dist_e[i] = norm(pt3d) * map.voxelSizeInv;
+			float3 block_e = (Rview * pt3d + tview) * map.voxelSizeInv;
+
+			pt3d.z = seeded ? zStart.ptr(y)[x] : zRange.x;
+			pt3d.x = pt3d.z * ((float) x - cx) * invfx;
+			pt3d.y = pt3d.z * ((float) y - cy) * invfy;
+			p.dist_s[i] = norm(pt3d) * map.voxelSizeInv;
+			float3 block_s = (Rview * pt3d + tview) * map.voxelSizeInv;
+
+			float3 dir = normalised(block_e - block_s);
+			p.px[i] = block_s.x;
+			p.py[i] = block_s.y;
+			p.pz[i] = block_s.z;
+			p.dx[i] = dir.x;
+			p.dy[i] = dir.y;
+			p.dz[i] = dir.z;
+			p.sdf[i] = 1.0f;
+			p.cache[i] = HashEntry(make_int3(0x7fffffff), EntryAvailable, 0);
+			p.cell[i] = HashEntry(make_int3(0x7fffffff), EntryAvailable, 0);
+			if (p.dist_s[i] < p.dist_e[i])
+				active |= 1 << i;
+		}
+
+		int first = seeded ? active : 0;
+		int retry = seeded ? lanes & ~active : 0;
+		const float3 zero = make_float3(0, 0, 0);
+		while (active) {
+
+			int valid = 0, interp = 0, empty = 0;
+			for (int m = active; m; m &= m - 1) {
+				int i = __builtin_ctz(m);
+				float3 pt = make_float3(p.px[i], p.py[i], p.pz[i]);
+				if (!(map.voxelPosToBlockPos(make_int3(pt)) == p.cache[i].pos)) {
+					p.skip[i] = map.FindEmptySpan(pt, make_float3(p.dx[i], p.dy[i], p.dz[i]),
+							p.dist_e[i] - p.dist_s[i], p.cell[i]);
+					if (p.skip[i] > 0) {
+						empty |= 1 << i;
+						continue;
+					}
+				}
+
+				bool v;
+				float sdf = readSdf(pt, p.cache[i], v, p.noLookups);
+				p.sdf[i] = sdf;
+				p.noSamples++;
+				if (v) {
+					valid |= 1 << i;
+					if (sdf <= 0.1f && sdf >= -0.5f)
+						interp |= 1 << i;
+				}
+			}
+
+			int wrong = first & (empty | ~valid);
+			for (int m = first & valid; m; m &= m - 1) {
+				int i = __builtin_ctz(m);
+				if (!(p.sdf[i] > 0.0f && p.sdf[i] < 1.0f))
+					wrong |= 1 << i;
+			}
+			first = 0;
+			retry |= wrong;
+			active &= ~wrong;
+			interp &= ~wrong;
+
+			if (interp) {
+				readSdfInterped(p, zero, interp, tmp);
+				for (int m = interp; m; m &= m - 1)
+					p.sdf[__builtin_ctz(m)] = tmp[__builtin_ctz(m)];
+			}
+
+			for (int m = active; m; m &= m - 1) {
+				int i = __builtin_ctz(m);
+				float step = DeviceMap::BlockSize;
+				if (empty & (1 << i))
+					step = p.skip[i];
+				else if (valid & (1 << i)) {
+					if (p.sdf[i] <= 0.0f) {
+						active &= ~(1 << i);
+						continue;
+					}
+					if (!std::isnan(p.sdf[i]))
+						step = std::max(p.sdf[i] * map.stepScale, 1.0f);
+				}
+
+				advance(p, i, step);
+				p.dist_s[i] += step;
+				if (!(p.dist_s[i] < p.dist_e[i]))
+					active &= ~(1 << i);
+			}
+		}
+
+		int found = 0;
+		for (int m = lanes & ~retry; m; m &= m - 1)
+			if (p.sdf[__builtin_ctz(m)] <= 0.0f)
+				found |= 1 << __builtin_ctz(m);
+		if (seeded)
+			retry |= lanes & ~found;
+
+		if (found) {
+			for (int m = found; m; m &= m - 1)
+				advance(p, __builtin_ctz(m), p.sdf[__builtin_ctz(m)] * map.stepScale);
+			readSdfInterped(p, zero, found, tmp);
+			for (int m = found; m; m &= m - 1)
+				advance(p, __builtin_ctz(m), tmp[__builtin_ctz(m)] * map.stepScale);
+			shade(p, x0, y, found);
+		}
+
+		count.noLookups += p.noLookups;
+		count.noSamples += p.noSamples;
+		return retry;
+	}
+
+	// Writes the points of the lanes in found that have a valid normal.
+	inline void shade(RayPacket & p, int x0, int y, int found) {
+
+		const float3 offsets[6] = {
+			make_float3(1, 0, 0), make_float3(-1, 0, 0),
+			make_float3(0, 1, 0), make_float3(0, -1, 0),
+			make_float3(0, 0, 1), make_float3(0, 0, -1)
+		};
+
+		for (int m = found; m; m &= m - 1) {
+			int i = __builtin_ctz(m);
+			float3 pt = make_float3(p.px[i], p.py[i], p.pz[i]);
+			map.MoveCache(make_int3(pt - make_float3(1, 1, 1)), p.window[i]);
+		}
+
+		alignas(32) float sdf[6][8];
+		for (int k = 0; k < 6 && found; ++k) {
+			int valid = readSdfInterped(p, offsets[k], found, sdf[k]);
+			for (int m = found; m; m &= m - 1) {
+				int i = __builtin_ctz(m);
+				if (std::isnan(sdf[k][i]) || sdf[k][i] == 1.0f || !(valid & (1 << i)))
+					found &= ~(1 << i);
+			}
+		}
+
+		for (int m = found; m; m &= m - 1) {
+			int i = __builtin_ctz(m);
+			float3 normal = make_float3(sdf[0][i] - sdf[1][i], sdf[2][i] - sdf[3][i], sdf[4][i] - sdf[5][i]);
+			normal = normalised(RviewInv * normal);
+
+			float3 result = make_float3(p.px[i], p.py[i], p.pz[i]);
+			result = RviewInv * (result * map.voxelSize - tview);
+
+			vmap.ptr(y)[x0 + i] = make_float4(result, 1.0);
+			nmap.ptr(y)[x0 + i] = make_float4(normal, 1.0);
+		}
+	}
+
+	// An 8x8 tile lines up with one cell of the depth range image, so all
+	// of its rays share the same bounds.
+	inline void castTile(int tx, int ty, RayCount & count) {
+
+		int x0 = tx * rayTileSize;
+		int y0 = ty * rayTileSize;
+		int n = std::min(rayTileSize, cols - x0);
+		int yend = std::min(y0 + rayTileSize, rows);
+
+		for (int y = y0; y < yend; ++y) {
+			for (int x = x0; x < x0 + n; ++x) {
+				vmap.ptr(y)[x] = make_float4(__int_as_float(0x7fffffff));
+				nmap.ptr(y)[x] = make_float4(__int_as_float(0x7fffffff));
+			}
+		}
+
+		for (int y = y0; y < yend; ++y) {
+			int2 locId;
+			locId.x = x0 / minMaxSubSample;
+			locId.y = y / minMaxSubSample;
+
+			float2 zRange;
+			zRange.x = zRangeX.ptr(locId.y)[locId.x];
+			zRange.y = zRangeY.ptr(locId.y)[locId.x];
+			if(zRange.y < 1e-3 || zRange.x < 1e-3 || std::isnan(zRange.x) || std::isnan(zRange.y))
+				continue;
+
+			int lanes = (1 << n) - 1;
+			int seeds = 0;
+			if (seeded) {
+				for (int i = 0; i < n; ++i) {
+					float z = zStart.ptr(y)[x0 + i];
+					if (z > zRange.x && z < zRange.y)
+						seeds |= 1 << i;
+				}
+			}
+
+			if (seeds)
+				lanes = (lanes & ~seeds) | castPacket(x0, y, seeds, zRange, true, count);
+			if (lanes)
+				castPacket(x0, y, lanes, zRange, false, count);
+			count.noRays += n;
+		}
+	}
+};
+
+static void CastRays(DeviceMap map,
+					 DeviceArray2D<float4> & vmap,
+					 DeviceArray2D<float4> & nmap,
+					 DeviceArray2D<float> & zRangeX,
+					 DeviceArray2D<float> & zRangeY,
+					 const DeviceArray2D<float> * zStart,
+					 Matrix3f Rview,
+					 Matrix3f RviewInv,
+					 float3 tview,
+					 float invfx,
+					 float invfy,
+					 float cx,
+					 float cy) {
+
+	int cols = vmap.cols;
+	int rows = vmap.rows;
+
+	Rendering cast;
+	cast.cols = cols;
+	cast.rows = rows;
+
+	cast.map = map;
+	cast.vmap = vmap;
+	cast.nmap = nmap;
+	cast.zRangeX = zRangeX;
+	cast.zRangeY = zRangeY;
+	cast.seeded = zStart != nullptr;
+	if (zStart)
+		cast.zStart = *zStart;
+	cast.invfx = invfx;
+	cast.invfy = invfy;
+	cast.cx = cx;
+	cast.cy = cy;
+	cast.Rview = Rview;
+	cast.RviewInv = RviewInv;
+	cast.tview = tview;
+
+	static size_t noCalls = 0, noRays = 0, noSamples = 0, noLookups = 0;
+	static double seconds = 0;
+
+	int tilesX = DivUp(cols, rayTileSize);
+	int tilesY = DivUp(rows, rayTileSize);
+	std::atomic<int> rays(0), samples(0), lookups(0);
+
+	auto start = std::chrono::steady_clock::now();
+
+	ThreadPool & pool = ThreadPool::Global();
+	pool.ParallelFor(0, tilesX * tilesY, [&](int i) {
+		RayCount count = { };
+		cast.castTile(i % tilesX, i / tilesX, count);
+		rays += count.noRays;
+		samples += count.noSamples;
+		lookups += count.noLookups;
+	}, 4);
+
+	seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	noRays += rays;
+	noSamples += samples;
+	noLookups += lookups;
+	if (++noCalls % 100 == 0) {
+		if (DeviceMap::verbose)
+			printf("Raycast : %.2f Mrays/s, %.1f samples and %.1f hash lookups per ray on %d threads\n",
+					noRays / seconds * 1e-6, (double) noSamples / noRays,
+					(double) noLookups / noRays, pool.NumThreads());
+		noRays = 0;
+		noSamples = 0;
+		noLookups = 0;
+		seconds = 0;
+	}
+}
+
+void Raycast(DeviceMap map,
+			 DeviceArray2D<float4> & vmap,
+			 DeviceArray2D<float4> & nmap,
+			 DeviceArray2D<float> & zRangeX,
+			 DeviceArray2D<float> & zRangeY,
+			 Matrix3f Rview,
+			 Matrix3f RviewInv,
+			 float3 tview,
+			 float invfx,
+			 float invfy,
+			 float cx,
+			 float cy) {
+
+	CastRays(map, vmap, nmap, zRangeX, zRangeY, nullptr, Rview, RviewInv,
+			tview, invfx, invfy, cx, cy);
+}
+
+void Raycast(DeviceMap map,
+			 DeviceArray2D<float4> & vmap,
+			 DeviceArray2D<float4> & nmap,
+			 DeviceArray2D<float> & zRangeX,
+			 DeviceArray2D<float> & zRangeY,
+			 const DeviceArray2D<float> & zStart,
+			 Matrix3f Rview,
+			 Matrix3f RviewInv,
+			 float3 tview,
+			 float invfx,
+			 float invfy,
+			 float cx,
+			 float cy) {
+
+	CastRays(map, vmap, nmap, zRangeX, zRangeY, &zStart, Rview, RviewInv,
+			tview, invfx, invfy, cx, cy);
+}
+
+// Each ray starts margin in front of the nearest point warped into the
+// 3x3 pixels around it, which also covers pixels no point landed on. Where
+// those points are more than maxSpread apart the start is left at 0.
+void PredictRayStarts(const DeviceArray2D<float4> & vmap,
+					  DeviceArray2D<float> & zStart,
+					  float margin,
+					  float maxSpread) {
+
+	PtrStepSz<float4> src = vmap;
+	PtrStep<float> dst = zStart;
+	ThreadPool::Global().ParallelFor(0, src.rows, [&](int y) {
+		for (int x = 0; x < src.cols; ++x) {
+			float zMin = 1e10f, zMax = 0;
+			for (int v = std::max(y - 1, 0); v <= std::min(y + 1, src.rows - 1); ++v) {
+				for (int u = std::max(x - 1, 0); u <= std::min(x + 1, src.cols - 1); ++u) {
+					float z = src.ptr(v)[u].z;
+					if (z > 0) {
+						zMin = std::min(zMin, z);
+						zMax = std::max(zMax, z);
+					}
+				}
+			}
+
+			float z = 0;
+			if (zMax > 0 && zMax - zMin <= maxSpread)
+				z = zMin - margin;
+			dst.ptr(y)[x] = z;
+		}
+	}, 8);
+}
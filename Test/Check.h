@@ -0,0 +1,32 @@
+#ifndef CHECK_H__
+#define CHECK_H__
+
+#include <cstdio>
+#include <cstdarg>
+
+// Checks for the test programs: a failed check prints what failed, and
+// the program then exits with 1, which ctest counts as a failure.
+
+static int noFailures = 0;
+
+__attribute__((format(printf, 2, 3)))
+static inline void Check(bool ok, const char * format, ...) {
+
+	if (!ok) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+		printf("\n");
+		noFailures++;
+	}
+}
+
+static inline int CheckResult(const char * name) {
+
+	if (noFailures == 0)
+		printf("%s ok\n", name);
+	return noFailures == 0 ? 0 : 1;
+}
+
+#endif
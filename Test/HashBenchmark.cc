@@ -0,0 +1,76 @@
+#include "DeviceMap.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+// Has threads create the blocks of the same cube of positions at once,
+// each in its own order, so that most requests race for a block another
+// thread is creating, and reports the rate and slot conflicts.
+// Usage: HashBenchmark [threads] [cube side in blocks] [rounds]
+int main(int argc, char ** argv) {
+
+	int noThreads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	int side = argc > 2 ? atoi(argv[2]) : 48;
+	int noRounds = argc > 3 ? atoi(argv[3]) : 5;
+	int noBlocks = side * side * side;
+
+	std::vector<int3> keys;
+	for (int z = 0; z < side; ++z)
+		for (int y = 0; y < side; ++y)
+			for (int x = 0; x < side; ++x)
+				keys.push_back(make_int3(x - side / 2, y - side / 2, z));
+
+	std::vector<std::vector<int3>> orders(noThreads, keys);
+	for (int i = 0; i < noThreads; ++i) {
+		srand(i);
+		std::random_shuffle(orders[i].begin(), orders[i].end(), [](int n) {
+			return rand() % n;
+		});
+	}
+
+	DeviceArray<int> heap(noBlocks);
+	DeviceArray<int> heapCounter(1);
+	DeviceArray<HashEntry> hashEntries(4 * noBlocks);
+
+	DeviceMap map = DeviceMap();
+	map.heapMem = heap;
+	map.heapCounter = heapCounter;
+	map.hashEntries = hashEntries;
+
+	double seconds = 0;
+	unsigned long noConflicts = 0;
+	for (int round = 0; round < noRounds; ++round) {
+		for (int i = 0; i < noBlocks; ++i)
+			map.heapMem[i] = noBlocks - i - 1;
+		for (size_t i = 0; i < map.hashEntries.size; ++i)
+			map.hashEntries[i].release();
+		map.heapCounter[0] = noBlocks - 1;
+		unsigned long conflicts = DeviceMap::noSlotConflicts;
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (int i = 0; i < noThreads; ++i)
+			threads.emplace_back([&, i]() {
+				for (const int3 & pos : orders[i])
+					map.CreateBlock(pos);
+			});
+		for (std::thread & thread : threads)
+			thread.join();
+
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		noConflicts += DeviceMap::noSlotConflicts - conflicts;
+	}
+
+	int noMissing = 0;
+	for (const int3 & pos : keys)
+		noMissing += map.FindEntry(pos).ptr < 0;
+
+	printf("%d threads, %d blocks: %.2f M requests/s, %.1f slot conflicts per block, %d blocks missing, %d left on the heap\n",
+			noThreads, noBlocks, (double) noRounds * noThreads * noBlocks / seconds * 1e-6,
+			(double) noConflicts / noRounds / noBlocks, noMissing, map.heapCounter[0] + 1);
+	return noMissing == 0 && map.heapCounter[0] == -1 ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+#include "Check.h"
+#include "MapFile.h"
+#include "BlockStore.h"
+
+#include <map>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+
+// Checks that every block inserted into a BlockStore comes back from
+// Fetch once and unchanged, when most chunks have been written to disk
+// because the store holds only a few in memory.
+
+static const int NoCells = 6;
+static const int BlocksPerCell = 5;
+
+static Voxel Pattern(const int3 & pos, int i) {
+	float sdf = ((pos.x * 31 + pos.y * 17 + pos.z * 7 + i) % 200) / 100.0f - 1.0f;
+	return Voxel(sdf, 1 + (pos.x + i) % 10, make_uchar3(pos.x & 255, pos.y & 255, i & 255));
+}
+
+static bool SamePattern(const int3 & pos, const Voxel * voxels) {
+
+	bool same = true;
+	for (uint i = 0; i < DeviceMap::BlockSize3; ++i)
+		same = same && SameVoxel(voxels[i], Pattern(pos, i));
+	return same;
+}
+
+int main() {
+
+	char dir[] = "/tmp/BlockStoreXXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("no temporary directory\n");
+		return 1;
+	}
+
+	std::string path = std::string(dir) + "/blocks";
+	size_t blockBytes = sizeof(int3) + sizeof(Voxel) * DeviceMap::BlockSize3;
+	{
+		BlockStore store(path, 4 * BlocksPerCell * blockBytes);
+
+		std::map<long long, int3> inserted;
+		std::vector<Voxel> block(DeviceMap::BlockSize3);
+		for (int z = 0; z < 2; ++z)
+			for (int y = 0; y < NoCells; ++y)
+				for (int x = 0; x < NoCells; ++x)
+					for (int k = 0; k < BlocksPerCell; ++k) {
+						int3 pos = make_int3(x, y, z) * BlockGrid::CellSize + make_int3(k, k % 2, 0);
+						for (uint i = 0; i < DeviceMap::BlockSize3; ++i)
+							block[i] = Pattern(pos, i);
+						store.Insert(pos, block.data());
+						inserted[BlockGrid::Key(pos)] = pos;
+					}
+
+		Check(store.NumChunksOnDisk() > 0, "nothing was evicted to disk");
+
+		// Visiting leaves every block stored for the fetches below.
+		std::map<long long, int> visited;
+		store.ForEach([&](const int3 & pos, const Voxel * voxels) {
+			visited[BlockGrid::Key(pos)]++;
+			Check(SamePattern(pos, voxels), "block %d %d %d visited changed", pos.x, pos.y, pos.z);
+		});
+		for (const auto & entry : inserted)
+			Check(visited[entry.first] == 1, "block %d %d %d not visited exactly once",
+					entry.second.x, entry.second.y, entry.second.z);
+		Check(visited.size() == inserted.size(), "visited a block never inserted");
+
+		// Chunks on disk are read back by the worker and returned by a
+		// later call, so fetching goes on until nothing is left.
+		std::map<long long, int> fetched;
+		std::vector<int3> poses;
+		std::vector<Voxel> blocks;
+		int3 centre = make_int3(NoCells / 2 * BlockGrid::CellSize);
+		auto start = std::chrono::steady_clock::now();
+		while (fetched.size() < inserted.size() &&
+				std::chrono::steady_clock::now() - start < std::chrono::seconds(20)) {
+			uint n = store.Fetch(centre, 4 * NoCells * BlockGrid::CellSize, 1 << 20, poses, blocks);
+			for (uint j = 0; j < n; ++j) {
+				fetched[BlockGrid::Key(poses[j])]++;
+				Check(SamePattern(poses[j], &blocks[j * DeviceMap::BlockSize3]) &&
+						inserted.count(BlockGrid::Key(poses[j])), "block %d %d %d came back changed",
+						poses[j].x, poses[j].y, poses[j].z);
+			}
+			if (n == 0)
+				usleep(1000);
+		}
+
+		for (const auto & entry : inserted)
+			Check(fetched[entry.first] == 1, "block %d %d %d not fetched exactly once",
+					entry.second.x, entry.second.y, entry.second.z);
+
+		Check(store.NumChunksOnDisk() == 0 && store.CachedBytes() == 0,
+				"store not empty after fetching everything");
+	}
+
+	rmdir(path.c_str());
+	rmdir(dir);
+	return CheckResult("block store");
+}
@@ -0,0 +1,50 @@
+#include "Check.h"
+#include "DeviceMap.h"
+
+#include <vector>
+#include <cstdlib>
+
+// Checks that CompactVoxel keeps sdf, weight and colour within the steps
+// of its packing, including negative sdfs, which share the short with the
+// weight, and the split layout of a block.
+
+int main() {
+
+	const float sdfStep = 1.0f / 2047.0f;
+	CompactVoxel empty;
+	Check(empty.getWeight() == 0 && std::isnan(empty.getSdf()), "default voxel not unobserved");
+
+	for (int i = -2100; i <= 2100; ++i) {
+		float sdf = i / 2047.0f + 0.3f * sdfStep;
+		for (int weight = 1; weight <= 20; weight += 19) {
+			CompactVoxel voxel(sdf, weight, make_uchar3(0));
+			float expected = fmaxf(-1.0f, fminf(1.0f, sdf));
+			Check(fabsf(voxel.getSdf() - expected) <= 0.5f * sdfStep, "sdf off by more than half a step at %g", sdf);
+			Check(voxel.getWeight() == (weight < CompactVoxel::MaxWeight ? weight : CompactVoxel::MaxWeight), "weight not kept at %g", sdf);
+		}
+	}
+
+	for (int c = 0; c < 256; ++c) {
+		uchar3 color = make_uchar3(c, 255 - c, c / 2);
+		uchar3 back = CompactVoxel(-0.5f, 3, color).getColor();
+		Check(abs(back.x - color.x) <= 4 && abs(back.y - color.y) <= 2 && abs(back.z - color.z) <= 4,
+				"colour off by more than a step at %d", c);
+	}
+
+	const int n = DeviceMap::BlockSize3;
+	std::vector<CompactVoxel> block(n), voxels(n);
+	for (int i = 0; i < n; ++i) {
+		voxels[i] = CompactVoxel((i - n / 2) / (float) (n / 2), i % 16, make_uchar3(i % 256, i / 2, 255 - i % 256));
+		CompactVoxel::Store(block.data(), n, i, voxels[i]);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		CompactVoxel voxel = CompactVoxel::Load(block.data(), n, i);
+		bool same = voxel.sdfWeight == voxels[i].sdfWeight && voxel.rgb == voxels[i].rgb;
+		Check(same, "split layout does not give voxel %d back", i);
+		if (voxels[i].getWeight() > 0)
+			Check(CompactVoxel::LoadSdf(block.data(), n, i) == voxels[i].getSdf(), "split sdf differs at %d", i);
+	}
+
+	return CheckResult("compact voxel");
+}
@@ -0,0 +1,107 @@
+#include "Check.h"
+#include "DeviceMap.h"
+
+#include <set>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Checks the host hash table: threads creating the same blocks at once
+// must give each block exactly one entry and one pool block, and
+// deleting blocks must keep every other block reachable and return the
+// deleted ones to the heap. Deletes run alone, as they do when recycling.
+
+static const int Side = 16;
+static const int NoBlocks = Side * Side * Side;
+static const int NoThreads = 8;
+
+static void CreateAll(DeviceMap map, const std::vector<int3> & keys, int seed) {
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < NoThreads; ++i)
+		threads.emplace_back([&, i]() {
+			std::vector<int3> order(keys);
+			srand(seed + i);
+			std::random_shuffle(order.begin(), order.end(), [](int n) {
+				return rand() % n;
+			});
+			for (const int3 & pos : order)
+				map.CreateBlock(pos);
+		});
+	for (std::thread & thread : threads)
+		thread.join();
+}
+
+// Every key has an entry, and no two entries share a pool block.
+static bool AllPresent(DeviceMap map, const std::vector<int3> & keys) {
+
+	std::set<int> ptrs;
+	for (const int3 & pos : keys) {
+		int ptr = map.FindEntry(pos).ptr;
+		if (ptr < 0 || ptr % DeviceMap::BlockSize3 != 0 || !ptrs.insert(ptr).second)
+			return false;
+	}
+	return true;
+}
+
+int main() {
+
+	std::vector<int3> keys;
+	for (int z = 0; z < Side; ++z)
+		for (int y = 0; y < Side; ++y)
+			for (int x = 0; x < Side; ++x)
+				keys.push_back(make_int3(x - Side / 2, y - Side / 2, z - Side / 2));
+
+	DeviceArray<int> heap(NoBlocks);
+	DeviceArray<int> heapCounter(1);
+	DeviceArray<HashEntry> hashEntries(2 * NoBlocks);
+	DeviceArray<Voxel> voxelBlocks((size_t) NoBlocks * DeviceMap::BlockSize3);
+
+	DeviceMap map = DeviceMap();
+	map.heapMem = heap;
+	map.heapCounter = heapCounter;
+	map.hashEntries = hashEntries;
+	map.voxelBlocks = voxelBlocks;
+
+	for (int i = 0; i < NoBlocks; ++i)
+		map.heapMem[i] = NoBlocks - i - 1;
+	for (size_t i = 0; i < map.hashEntries.size; ++i)
+		map.hashEntries[i].release();
+	map.heapCounter[0] = NoBlocks - 1;
+
+	CreateAll(map, keys, 0);
+	Check(AllPresent(map, keys), "round %d: created blocks missing or sharing a pool block", 0);
+	Check(map.heapCounter[0] == -1, "round %d: heap not used up by the created blocks", 0);
+
+	for (int round = 1; round <= 4; ++round) {
+		std::vector<int3> kept, deleted;
+		srand(round);
+		for (const int3 & pos : keys)
+			(rand() % 2 ? kept : deleted).push_back(pos);
+
+		std::vector<int> ptrs;
+		for (const int3 & pos : kept)
+			ptrs.push_back(map.FindEntry(pos).ptr);
+
+		for (const int3 & pos : deleted)
+			map.DeleteBlock(pos);
+
+		bool moved = false;
+		for (size_t i = 0; i < kept.size(); ++i)
+			moved = moved || map.FindEntry(kept[i]).ptr != ptrs[i];
+		Check(!moved, "round %d: kept block lost or moved to another pool block", round);
+
+		bool found = false;
+		for (const int3 & pos : deleted)
+			found = found || map.FindEntry(pos).ptr >= 0;
+		Check(!found, "round %d: deleted block still found", round);
+		Check(map.heapCounter[0] + 1 == (int) deleted.size(), "round %d: deleted blocks not back on the heap", round);
+
+		CreateAll(map, keys, 100 * round);
+		Check(AllPresent(map, keys), "round %d: recreated blocks missing or sharing a pool block", round);
+		Check(map.heapCounter[0] == -1, "round %d: heap not used up by the recreated blocks", round);
+	}
+
+	return CheckResult("hash table");
+}
@@ -0,0 +1,122 @@
+#include "Check.h"
+#include "MapFile.h"
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+
+// Checks that a map written with and without compression reads back the
+// same config, blocks and keys, for empty, sparse and fully observed
+// blocks, that an uncompressed file maps as a block pool, and that a
+// damaged file is refused.
+
+static const int NoBlocks = 24;
+
+static bool SameBlock(const Voxel * a, const Voxel * b) {
+
+	bool same = true;
+	for (uint i = 0; i < DeviceMap::BlockSize3; ++i)
+		same = same && SameVoxel(a[i], b[i]);
+	return same;
+}
+
+// Every third block is left unobserved, every third has a few observed
+// voxels and the rest are observed throughout, so they do not shrink.
+static void FillBlock(int b, Voxel * voxels) {
+
+	for (uint i = 0; i < DeviceMap::BlockSize3; ++i) {
+		bool observed = b % 3 == 2 || (b % 3 == 1 && i % 97 == 0);
+		voxels[i] = observed ? Voxel(((b * 13 + i) % 200) / 100.0f - 1.0f,
+				1 + (b + i) % 10, make_uchar3(b, i & 255, i / 2)) : Voxel();
+	}
+}
+
+static void RoundTrip(const std::string & path, bool compress) {
+
+	const char * name = compress ? "compressed" : "raw";
+	MapConfig config = MapConfigs[1];
+	std::vector<Voxel> blocks((size_t) NoBlocks * DeviceMap::BlockSize3);
+	std::vector<int3> poses;
+	std::vector<SURF> keys(7);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		keys[i].valid = i % 2;
+		keys[i].pos = make_float3(i, -0.5f * i, 2);
+		keys[i].normal = make_float4(0, 0, 1, 0);
+		for (int j = 0; j < 64; ++j)
+			keys[i].descriptor[j] = i + j / 64.0f;
+	}
+
+	MapWriter writer(path, config, compress);
+	Check(writer.IsOpen(), "%s: writer not open", name);
+	for (int b = 0; b < NoBlocks; ++b) {
+		poses.push_back(make_int3(b % 4 - 2, b / 4, -b));
+		FillBlock(b, &blocks[b * DeviceMap::BlockSize3]);
+		writer.WriteBlock(poses[b], &blocks[b * DeviceMap::BlockSize3]);
+	}
+	Check(writer.Finish(keys), "%s: writing failed", name);
+
+	MapReader reader(path);
+	Check(reader.IsOpen(), "%s: reader not open", name);
+	Check(reader.Config().voxelSize == config.voxelSize &&
+			reader.Config().truncateDist == config.truncateDist, "%s: config differs", name);
+	Check(reader.Contiguous() == !compress, "%s: wrong layout", name);
+	Check((int) reader.Blocks().size() == NoBlocks, "%s: wrong number of blocks", name);
+
+	std::vector<Voxel> voxels(DeviceMap::BlockSize3);
+	for (int b = 0; b < (int) reader.Blocks().size() && b < NoBlocks; ++b) {
+		const MapFileBlock & block = reader.Blocks()[b];
+		Check(block.pos.x == poses[b].x && block.pos.y == poses[b].y &&
+				block.pos.z == poses[b].z, "%s: block position differs", name);
+		Check(reader.ReadBlock(block, voxels.data()), "%s: block not read", name);
+		Check(SameBlock(voxels.data(), &blocks[b * DeviceMap::BlockSize3]), "%s: block differs", name);
+
+		bool raw = block.bytes == sizeof(Voxel) * DeviceMap::BlockSize3;
+		Check(raw == (!compress || b % 3 == 2), "%s: block stored the wrong way", name);
+	}
+
+	std::vector<SURF> readKeys;
+	bool same = reader.ReadKeys(readKeys) && readKeys.size() == keys.size();
+	for (size_t i = 0; same && i < keys.size(); ++i)
+		same = readKeys[i].valid == keys[i].valid && readKeys[i].pos.x == keys[i].pos.x &&
+				readKeys[i].pos.y == keys[i].pos.y && readKeys[i].normal.z == keys[i].normal.z &&
+				!memcmp(readKeys[i].descriptor, keys[i].descriptor, sizeof(keys[i].descriptor));
+	Check(same, "%s: keys differ", name);
+
+	if (reader.Contiguous()) {
+		MapArena arena(path, reader.BlocksOffset(), NoBlocks, 2 * NoBlocks);
+		Check(arena.IsOpen() && (int) arena.Capacity() == 2 * NoBlocks, "%s: arena not mapped", name);
+		for (int b = 0; arena.IsOpen() && b < NoBlocks; ++b)
+			Check(SameBlock(arena.Blocks() + b * DeviceMap::BlockSize3,
+					&blocks[b * DeviceMap::BlockSize3]), "%s: mapped block differs", name);
+	}
+
+	// A block pointing past the keys or a cut off index fails on opening.
+	FILE * raw = fopen(path.c_str(), "r+b");
+	MapFileBlock last = reader.Blocks().empty() ? MapFileBlock() : reader.Blocks().back();
+	last.offset += sizeof(SURF) * keys.size() + 1;
+	bool corrupted = raw && !reader.Blocks().empty() && fseeko(raw, -(long long) sizeof(MapFileBlock), SEEK_END) == 0 &&
+			fwrite(&last, sizeof(last), 1, raw) == 1;
+	if (raw)
+		fclose(raw);
+	Check(corrupted && !MapReader(path).IsOpen(), "%s: block past the keys not refused", name);
+	Check(truncate(path.c_str(), 2 * 4096) == 0 && !MapReader(path).IsOpen(),
+			"%s: truncated file not refused", name);
+
+	remove(path.c_str());
+}
+
+int main() {
+
+	char dir[] = "/tmp/MapFileXXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("no temporary directory\n");
+		return 1;
+	}
+
+	RoundTrip(std::string(dir) + "/raw.map", false);
+	RoundTrip(std::string(dir) + "/compressed.map", true);
+	rmdir(dir);
+
+	return CheckResult("map file");
+}
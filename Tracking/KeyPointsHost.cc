@@ -0,0 +1,55 @@
+#include "Reduction.h"
+#include "ThreadPool.h"
+
+static inline float clamp(float a) {
+	a = a > -1.f ? a : -1.f;
+	a = a < 1.f ? a : 1.f;
+	return a;
+}
+
+static float AdjacencyScore(const SURF * frameKeys, const SURF * mapKeys, const float * dist, int x, int y) {
+
+	if(x == y)
+		return exp(-dist[x]);
+
+	const SURF * mapKey00 = &mapKeys[x];
+	const SURF * mapKey01 = &mapKeys[y];
+
+	const SURF * frameKey00 = &frameKeys[x];
+	const SURF * frameKey01 = &frameKeys[y];
+
+	float d00 = norm(frameKey00->pos - frameKey01->pos);
+	float d01 = norm(mapKey00->pos - mapKey01->pos);
+	if(d00 <= 1e-2 || d01 <= 1e-2)
+		return 0;
+
+	float4 d10 = make_float4(normalised(frameKey00->pos - frameKey01->pos));
+	float4 d11 = make_float4(normalised(mapKey00->pos - mapKey01->pos));
+
+	float alpha00 = acos(clamp(frameKey00->normal * frameKey01->normal));
+	float beta00 = acos(clamp(d10 * frameKey00->normal));
+	float gamma00 = acos(clamp(d10 * frameKey01->normal));
+	float alpha01 = acos(clamp(mapKey00->normal * mapKey01->normal));
+	float beta01 = acos(clamp(d11 * mapKey00->normal));
+	float gamma01 = acos(clamp(d11 * mapKey01->normal));
+	return exp(-(fabs(d00 - d01) + fabs(alpha00 - alpha01) + fabs(beta00 - beta01) + fabs(gamma00 - gamma01)));
+}
+
+void BuildAdjacencyMatrix(cv::Mat & adjecencyMatrix,
+						  DeviceArray<SURF> & frameKeys,
+						  DeviceArray<SURF> & mapKeys,
+						  DeviceArray<float> & dist) {
+
+	const SURF * frame = frameKeys;
+	const SURF * map = mapKeys;
+	const float * distance = dist;
+	int cols = adjecencyMatrix.cols;
+
+	ThreadPool::Global().ParallelFor(0, adjecencyMatrix.rows, [&](int y) {
+		float * row = adjecencyMatrix.ptr<float>(y);
+		for(int x = 0; x < cols; ++x) {
+			float score = AdjacencyScore(frame, map, distance, x, y);
+			row[x] = std::isnan(score) ? 0 : score;
+		}
+	}, 8);
+}
@@ -444,6 +444,10 @@ __global__ void ForwardWarpingKernel(PtrStepSz<float4> srcVMap,
 
 	float4 srcv = srcVMap.ptr(y)[x];
 	float4 dstv = make_float4(dstInvRot * (srcRot * srcv + srcTrans - dstTrans), srcv.w);
+	// Drops points behind the camera and pixels without a point.
+	if (!(dstv.z > 0))
+		return;
+
 	float u = fx * dstv.x / dstv.z + cx;
 	float v = fy * dstv.y / dstv.z + cy;
 	if(u < 0 || v < 0 || u >= srcVMap.cols || v >= srcVMap.rows)
@@ -0,0 +1,583 @@
+#include "Reduction.h"
+#include "ThreadPool.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static const float sigSpace = 0.5 / (4 * 4);
+static const float sigRange = 0.5 / (0.5 * 0.5);
+
+static const float gaussKernel[25] = {
+		1, 4, 6, 4, 1, 4,
+		16, 24, 16, 4, 6,
+		24, 36, 24, 6, 4,
+		16, 24, 16, 4, 1,
+		4, 6, 4, 1
+};
+
+static const float gauss1D[5] = { 1, 4, 6, 4, 1 };
+
+// The bilateral weight factors into a spatial part and a range part.
+// Raw readings are integers, so the range part only depends on the
+// integer difference of two readings and can be tabulated per scale.
+// Differences past the end of the table have a negligible weight and
+// are clamped onto the last entry, which is zero.
+struct BilateralTable {
+
+	BilateralTable() : depthScaleInv(0) {
+	}
+
+	void Create(float scaleInv) {
+
+		depthScaleInv = scaleInv;
+		for (int y = 0; y < 5; ++y)
+			for (int x = 0; x < 5; ++x)
+				space[y][x] = exp(-((x - 2) * (x - 2) + (y - 2) * (y - 2)) * sigSpace);
+
+		int noEntries = std::min((int) (sqrt(30 / sigRange) / scaleInv) + 1, 65536);
+		range.resize(noEntries + 1);
+		for (int i = 0; i < noEntries; ++i) {
+			float diff = i * scaleInv;
+			range[i] = exp(-diff * diff * sigRange);
+		}
+		range[noEntries] = 0;
+	}
+
+	inline float weight(int dx, int dy, int diff) const {
+		diff = std::min(std::abs(diff), (int) range.size() - 1);
+		return space[dy + 2][dx + 2] * range[diff];
+	}
+
+	float depthScaleInv;
+	float space[5][5];
+	std::vector<float> range;
+};
+
+static void FilterDepthRow(const PtrStepSz<unsigned short> & depth,
+		PtrStep<float> rawDepth, PtrStep<float> filteredDepth,
+		const BilateralTable & table, float depthCutoff, int y) {
+
+	float depthScaleInv = table.depthScaleInv;
+	int ty = std::min(y + 3, depth.rows - 1);
+	int sy = std::max(y - 2, 0);
+
+	const unsigned short * src = depth.ptr(y);
+	float * raw = rawDepth.ptr(y);
+	float * filtered = filteredDepth.ptr(y);
+	for (int x = 0; x < depth.cols; ++x) {
+		float center = src[x] * depthScaleInv;
+		raw[x] = center < depthCutoff ? center : __int_as_float(0x7fffffff);
+	}
+
+	auto pixel = [&](int x) {
+		int c = src[x];
+		int tx = std::min(x + 3, depth.cols - 1);
+		int sx = std::max(x - 2, 0);
+		float sum1 = 0;
+		float sum2 = 0;
+		for (int cy = sy; cy < ty; ++cy) {
+			const unsigned short * row = depth.ptr(cy);
+			for (int cx = sx; cx < tx; ++cx) {
+				float weight = table.weight(cx - x, cy - y, row[cx] - c);
+				sum1 += row[cx] * depthScaleInv * weight;
+				sum2 += weight;
+			}
+		}
+
+		float final = sum1 / sum2;
+		filtered[x] = final < depthCutoff ? final : __int_as_float(0x7fffffff);
+	};
+
+	int x = 0;
+	for (; x < std::min(2, depth.cols); ++x)
+		pixel(x);
+
+#ifdef __AVX2__
+	// Eight pixels at a time wherever the whole 5 wide window is inside.
+	const __m256 scale = _mm256_set1_ps(depthScaleInv);
+	const __m256 cutoff = _mm256_set1_ps(depthCutoff);
+	const __m256 nan = _mm256_set1_ps(__int_as_float(0x7fffffff));
+	const __m256i last = _mm256_set1_epi32(table.range.size() - 1);
+	for (; x + 8 <= depth.cols - 3; x += 8) {
+		__m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src + x)));
+		__m256 sum1 = _mm256_setzero_ps();
+		__m256 sum2 = _mm256_setzero_ps();
+		for (int cy = sy; cy < ty; ++cy) {
+			const unsigned short * row = depth.ptr(cy) + x - 2;
+			const float * space = table.space[cy - y + 2];
+			for (int dx = 0; dx < 5; ++dx) {
+				__m256i val = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (row + dx)));
+				__m256i diff = _mm256_min_epi32(_mm256_abs_epi32(_mm256_sub_epi32(val, c)), last);
+				__m256 weight = _mm256_mul_ps(_mm256_set1_ps(space[dx]), _mm256_i32gather_ps(table.range.data(), diff, 4));
+				sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(val), scale), weight));
+				sum2 = _mm256_add_ps(sum2, weight);
+			}
+		}
+
+		__m256 final = _mm256_div_ps(sum1, sum2);
+		__m256 valid = _mm256_cmp_ps(final, cutoff, _CMP_LT_OQ);
+		_mm256_storeu_ps(filtered + x, _mm256_blendv_ps(nan, final, valid));
+	}
+#endif
+
+	for (; x < depth.cols; ++x)
+		pixel(x);
+}
+
+// rayX and rayY hold (x - cx) / fx and (y - cy) / fy for the level.
+static void ComputeVMapRow(const PtrStepSz<float> & depth,
+		PtrStep<float4> vmap, const float * rayX, float rayY,
+		float depthCutoff, int y) {
+
+	const float * src = depth.ptr(y);
+	float4 * dst = vmap.ptr(y);
+	for (int x = 0; x < depth.cols; ++x) {
+		float4 v;
+		v.z = src[x];
+		if (!std::isnan(v.z) && v.z > 0.1 && v.z < depthCutoff) {
+			v.x = v.z * rayX[x];
+			v.y = v.z * rayY;
+			v.w = 1.0;
+		}
+		else
+			v.x = v.y = v.w = __int_as_float(0x7fffffff);
+		dst[x] = v;
+	}
+}
+
+static void ComputeNMapRow(const PtrStepSz<float4> & vmap,
+		PtrStep<float4> nmap, int y) {
+
+	float4 * dst = nmap.ptr(y);
+	if (y == vmap.rows - 1) {
+		for (int x = 0; x < vmap.cols; ++x)
+			dst[x] = make_float4(__int_as_float(0x7fffffff));
+		return;
+	}
+
+	const float4 * row = vmap.ptr(y);
+	const float4 * down = vmap.ptr(y + 1);
+	for (int x = 0; x < vmap.cols - 1; ++x) {
+		float4 vcentre = row[x];
+		float4 vright = row[x + 1];
+		float4 vdown = down[x];
+		if (!std::isnan(vcentre.x) && !std::isnan(vright.x) && !std::isnan(vdown.x))
+			dst[x] = make_float4(normalised(cross(vright - vcentre, vdown - vcentre)), 1.0f);
+		else
+			dst[x] = make_float4(__int_as_float(0x7fffffff));
+	}
+	dst[vmap.cols - 1] = make_float4(__int_as_float(0x7fffffff));
+}
+
+template<class T> static void PyrDownGaussRow(const PtrStepSz<T> & src,
+		PtrStepSz<T> dst, int y) {
+
+	const int D = 5;
+	int ty = std::min(2 * y - D / 2 + D, src.rows - 1);
+	int sy = std::max(0, 2 * y - D / 2);
+
+	T * out = dst.ptr(y);
+	auto pixel = [&](int x) {
+		int tx = std::min(2 * x - D / 2 + D, src.cols - 1);
+		float sum = 0;
+		int count = 0;
+		for (int cy = sy; cy < ty; ++cy) {
+			const T * row = src.ptr(cy);
+			int k = (ty - cy - 1) * 5 + tx - 1;
+			for (int cx = std::max(0, 2 * x - D / 2); cx < tx; ++cx) {
+				if (!std::isnan((float) row[cx])) {
+					sum += row[cx] * gaussKernel[k - cx];
+					count += gaussKernel[k - cx];
+				}
+			}
+		}
+		out[x] = (T) (sum / (float) count);
+	};
+
+	// Columns whose window is entirely inside the image are filtered
+	// separably: each source column is summed over the window rows once
+	// and the output combines five column sums. Skipped samples add zero.
+	int x = 0;
+	int interiorEnd = std::min(dst.cols, (src.cols - 4) / 2 + 1);
+	for (; x < std::min(1, dst.cols); ++x)
+		pixel(x);
+
+	if (x < interiorEnd) {
+		int begin = 2 * x - 2;
+		int noCols = 2 * interiorEnd + 1 - begin;
+		std::vector<float> colSum(noCols, 0);
+		std::vector<float> colCount(noCols, 0);
+		for (int cy = sy; cy < ty; ++cy) {
+			const T * row = src.ptr(cy) + begin;
+			float weight = gauss1D[ty - cy - 1];
+			for (int i = 0; i < noCols; ++i) {
+				float val = row[i];
+				bool valid = !std::isnan(val);
+				colSum[i] += valid ? val * weight : 0.f;
+				colCount[i] += valid ? weight : 0.f;
+			}
+		}
+
+		for (; x < interiorEnd; ++x) {
+			const float * sums = &colSum[2 * x - 2 - begin];
+			const float * counts = &colCount[2 * x - 2 - begin];
+			float sum = 0;
+			float count = 0;
+			for (int j = 0; j < 5; ++j) {
+				sum += sums[j] * gauss1D[4 - j];
+				count += counts[j] * gauss1D[4 - j];
+			}
+			out[x] = (T) (sum / count);
+		}
+	}
+
+	for (; x < dst.cols; ++x)
+		pixel(x);
+}
+
+static void ImageToIntensityRow(const PtrStepSz<uchar3> & src,
+		PtrStep<unsigned char> dst, int y) {
+
+	const uchar3 * in = src.ptr(y);
+	unsigned char * out = dst.ptr(y);
+	for (int x = 0; x < src.cols; ++x) {
+		uchar3 val = in[x];
+		out[x] = (int) (0.2125 * val.y + 0.7154 * val.x + 0.0721 * val.z);
+	}
+}
+
+// The kernel walks the clipped 3x3 window with a reversed kernel index,
+// so inside the image it is a plain (flipped) Sobel operator, while on
+// the border the weights shift. Border pixels follow the kernel literally.
+static void ComputeDerivativeRow(const PtrStepSz<unsigned char> & image,
+		PtrStep<short> dx, PtrStep<short> dy, int y) {
+
+	static const int sobelX[9] = { 1, 0, -1, 2, 0, -2, 1, 0, -1 };
+	static const int sobelY[9] = { 1, 2, 1, 0, 0, 0, -1, -2, -1 };
+
+	short * outX = dx.ptr(y);
+	short * outY = dy.ptr(y);
+	auto border = [&](int x) {
+		int dxVal = 0;
+		int dyVal = 0;
+		int kernelIndex = 8;
+		for (int j = std::max(y - 1, 0); j <= std::min(y + 1, image.rows - 1); j++) {
+			for (int i = std::max(x - 1, 0); i <= std::min(x + 1, image.cols - 1); i++) {
+				dxVal += image.ptr(j)[i] * sobelX[kernelIndex];
+				dyVal += image.ptr(j)[i] * sobelY[kernelIndex];
+				--kernelIndex;
+			}
+		}
+		outX[x] = dxVal;
+		outY[x] = dyVal;
+	};
+
+	if (y == 0 || y == image.rows - 1) {
+		for (int x = 0; x < image.cols; ++x)
+			border(x);
+		return;
+	}
+
+	const unsigned char * up = image.ptr(y - 1);
+	const unsigned char * row = image.ptr(y);
+	const unsigned char * down = image.ptr(y + 1);
+	border(0);
+	for (int x = 1; x < image.cols - 1; ++x) {
+		outX[x] = (up[x + 1] - up[x - 1]) + 2 * (row[x + 1] - row[x - 1]) + (down[x + 1] - down[x - 1]);
+		outY[x] = (down[x - 1] - up[x - 1]) + 2 * (down[x] - up[x]) + (down[x + 1] - up[x + 1]);
+	}
+	border(image.cols - 1);
+}
+
+void FilterDepth(const DeviceArray2D<unsigned short> & depth,
+		DeviceArray2D<float> & rawDepth, DeviceArray2D<float> & filteredDepth,
+		float depthScale, float depthCutoff) {
+
+	static BilateralTable table;
+	if (table.depthScaleInv != (float) (1.0 / depthScale))
+		table.Create(1.0 / depthScale);
+
+	PtrStepSz<unsigned short> src = depth;
+	PtrStep<float> raw = rawDepth;
+	PtrStep<float> filtered = filteredDepth;
+	ThreadPool::Global().ParallelFor(0, depth.rows, [&](int y) {
+		FilterDepthRow(src, raw, filtered, table, depthCutoff, y);
+	}, 4);
+}
+
+void ComputeVMap(const DeviceArray2D<float> & depth,
+		DeviceArray2D<float4> & vmap, float fx, float fy, float cx, float cy,
+		float depthCutoff) {
+
+	float invfx = 1.0 / fx;
+	float invfy = 1.0 / fy;
+	std::vector<float> rayX(depth.cols);
+	for (int x = 0; x < depth.cols; ++x)
+		rayX[x] = (x - cx) * invfx;
+
+	PtrStepSz<float> src = depth;
+	PtrStep<float4> dst = vmap;
+	ThreadPool::Global().ParallelFor(0, depth.rows, [&](int y) {
+		ComputeVMapRow(src, dst, rayX.data(), (y - cy) * invfy, depthCutoff, y);
+	}, 8);
+}
+
+void ComputeNMap(const DeviceArray2D<float4> & vmap, DeviceArray2D<float4> & nmap) {
+
+	PtrStepSz<float4> src = vmap;
+	PtrStep<float4> dst = nmap;
+	ThreadPool::Global().ParallelFor(0, vmap.rows, [&](int y) {
+		ComputeNMapRow(src, dst, y);
+	}, 8);
+}
+
+void PyrDownGauss(const DeviceArray2D<float> & src, DeviceArray2D<float> & dst) {
+
+	PtrStepSz<float> in = src;
+	PtrStepSz<float> out = dst;
+	ThreadPool::Global().ParallelFor(0, dst.rows, [&](int y) {
+		PyrDownGaussRow(in, out, y);
+	}, 4);
+}
+
+void PyrDownGauss(const DeviceArray2D<unsigned char> & src,
+		DeviceArray2D<unsigned char> & dst) {
+
+	PtrStepSz<unsigned char> in = src;
+	PtrStepSz<unsigned char> out = dst;
+	ThreadPool::Global().ParallelFor(0, dst.rows, [&](int y) {
+		PyrDownGaussRow(in, out, y);
+	}, 4);
+}
+
+void ImageToIntensity(const DeviceArray2D<uchar3> & rgb,
+		DeviceArray2D<unsigned char> & image) {
+
+	PtrStepSz<uchar3> src = rgb;
+	PtrStep<unsigned char> dst = image;
+	ThreadPool::Global().ParallelFor(0, image.rows, [&](int y) {
+		ImageToIntensityRow(src, dst, y);
+	}, 8);
+}
+
+void ComputeDerivativeImage(DeviceArray2D<unsigned char> & image,
+		DeviceArray2D<short> & dx, DeviceArray2D<short> & dy) {
+
+	PtrStepSz<unsigned char> src = image;
+	PtrStep<short> outX = dx;
+	PtrStep<short> outY = dy;
+	ThreadPool::Global().ParallelFor(0, image.rows, [&](int y) {
+		ComputeDerivativeRow(src, outX, outY, y);
+	}, 8);
+}
+
+// Builds every pyramid level in noPyrs + 1 passes instead of one pass per
+// kernel. Pass 0 filters the raw depth and converts the colour image for
+// the first level, along with its vertex map. Pass i reads each band of
+// rows of level i - 1 once, downsamples it into level i and computes its
+// vertex map, then finishes the normal map and the image gradients of the
+// rows it has just read. The last pass only finishes the smallest level.
+void BuildPyramid(const DeviceArray2D<unsigned short> & rawDepth,
+		const DeviceArray2D<uchar3> & rgb, DeviceArray2D<float> & range,
+		DeviceArray2D<float> * depth, DeviceArray2D<unsigned char> * image,
+		DeviceArray2D<float4> * vmap, DeviceArray2D<float4> * nmap,
+		DeviceArray2D<short> * dIdx, DeviceArray2D<short> * dIdy,
+		int noPyrs, Intrinsics K, float depthScale, float depthCutoff) {
+
+	static BilateralTable table;
+	if (table.depthScaleInv != (float) (1.0 / depthScale))
+		table.Create(1.0 / depthScale);
+
+	std::vector<std::vector<float>> rayX(noPyrs), rayY(noPyrs);
+	for (int i = 0; i < noPyrs; ++i) {
+		Intrinsics Ki = K(i);
+		float invfx = 1.0 / Ki.fx;
+		float invfy = 1.0 / Ki.fy;
+		rayX[i].resize(depth[i].cols);
+		rayY[i].resize(depth[i].rows);
+		for (int x = 0; x < depth[i].cols; ++x)
+			rayX[i][x] = (x - Ki.cx) * invfx;
+		for (int y = 0; y < depth[i].rows; ++y)
+			rayY[i][y] = (y - Ki.cy) * invfy;
+	}
+
+	ThreadPool & pool = ThreadPool::Global();
+	PtrStepSz<unsigned short> src = rawDepth;
+	PtrStepSz<uchar3> color = rgb;
+	PtrStep<float> raw = range;
+	pool.ParallelFor(0, depth[0].rows, [&](int y) {
+		FilterDepthRow(src, raw, depth[0], table, depthCutoff, y);
+		ImageToIntensityRow(color, image[0], y);
+		ComputeVMapRow(depth[0], vmap[0], rayX[0].data(), rayY[0][y], depthCutoff, y);
+	}, 4);
+
+	for (int i = 1; i <= noPyrs; ++i) {
+
+		int prevRows = depth[i - 1].rows;
+		int noTasks = i < noPyrs ? depth[i].rows : DivUp(prevRows, 2);
+		pool.ParallelFor(0, noTasks, [&](int y) {
+			if (i < noPyrs) {
+				PyrDownGaussRow<float>(depth[i - 1], depth[i], y);
+				PyrDownGaussRow<unsigned char>(image[i - 1], image[i], y);
+				ComputeVMapRow(depth[i], vmap[i], rayX[i].data(), rayY[i][y], depthCutoff, y);
+			}
+
+			int end = y == noTasks - 1 ? prevRows : std::min(2 * y + 2, prevRows);
+			for (int r = 2 * y; r < end; ++r) {
+				ComputeNMapRow(vmap[i - 1], nmap[i - 1], r);
+				ComputeDerivativeRow(image[i - 1], dIdx[i - 1], dIdy[i - 1], r);
+			}
+		}, 2);
+	}
+}
+
+void ResizeMap(const DeviceArray2D<float4> & vsrc, const DeviceArray2D<float4> & nsrc,
+		DeviceArray2D<float4> & vdst, DeviceArray2D<float4> & ndst) {
+
+	PtrStep<float4> vin = vsrc;
+	PtrStep<float4> nin = nsrc;
+	PtrStepSz<float4> vout = vdst;
+	PtrStep<float4> nout = ndst;
+	ThreadPool::Global().ParallelFor(0, vdst.rows, [&](int y) {
+		for (int x = 0; x < vout.cols; ++x) {
+			float4 v00 = vin.ptr(y * 2 + 0)[x * 2 + 0];
+			float4 v01 = vin.ptr(y * 2 + 0)[x * 2 + 1];
+			float4 v10 = vin.ptr(y * 2 + 1)[x * 2 + 0];
+			float4 v11 = vin.ptr(y * 2 + 1)[x * 2 + 1];
+			float4 n00 = nin.ptr(y * 2 + 0)[x * 2 + 0];
+			float4 n01 = nin.ptr(y * 2 + 0)[x * 2 + 1];
+			float4 n10 = nin.ptr(y * 2 + 1)[x * 2 + 0];
+			float4 n11 = nin.ptr(y * 2 + 1)[x * 2 + 1];
+
+			if (std::isnan(v00.x) || std::isnan(v01.x) || std::isnan(v10.x) || std::isnan(v11.x))
+				vout.ptr(y)[x] = make_float4(__int_as_float(0x7fffffff));
+			else
+				vout.ptr(y)[x] = (v00 + v01 + v10 + v11) / 4;
+
+			if (std::isnan(n00.x) || std::isnan(n01.x) || std::isnan(n10.x) || std::isnan(n11.x))
+				nout.ptr(y)[x] = make_float4(__int_as_float(0x7fffffff));
+			else
+				nout.ptr(y)[x] = normalised((n00 + n01 + n10 + n11) / 4);
+		}
+	}, 4);
+}
+
+static inline float Saturate(float val) {
+	return std::min(std::max(val, 0.f), 1.f);
+}
+
+void RenderImage(const DeviceArray2D<float4> & points,
+		const DeviceArray2D<float4> & normals, const float3 lightPose,
+		DeviceArray2D<uchar4> & image) {
+
+	PtrStep<float4> vmap = points;
+	PtrStep<float4> nmap = normals;
+	PtrStepSz<uchar4> dst = image;
+	ThreadPool::Global().ParallelFor(0, image.rows, [&](int y) {
+		for (int x = 0; x < dst.cols; ++x) {
+			float3 color;
+			float3 p = make_float3(vmap.ptr(y)[x]);
+			if (std::isnan(p.x)) {
+				const float3 bgr1 = make_float3(4.f / 255.f, 2.f / 255.f, 2.f / 255.f);
+				const float3 bgr2 = make_float3(236.f / 255.f, 120.f / 255.f, 120.f / 255.f);
+
+				float w = static_cast<float>(y) / dst.rows;
+				color = bgr1 * (1 - w) + bgr2 * w;
+			} else {
+				float3 P = p;
+				float3 N = make_float3(nmap.ptr(y)[x]);
+
+				const float Ka = 0.3f;  //ambient coeff
+				const float Kd = 0.5f;  //diffuse coeff
+				const float Ks = 0.2f;  //specular coeff
+				const float n = 20.f;  //specular power
+
+				const float Ax = 1.f;   //ambient color,  can be RGB
+				const float Dx = 1.f;   //diffuse color,  can be RGB
+				const float Sx = 1.f;   //specular color, can be RGB
+				const float Lx = 1.f;   //light color
+
+				float3 L = normalised(lightPose - P);
+				float3 V = normalised(make_float3(0.f, 0.f, 0.f) - P);
+				float3 R = normalised(2 * N * (N * L) - L);
+
+				float Ix = Ax * Ka * Dx + Lx * Kd * Dx * std::max(0.f, (N * L))
+						+ Lx * Ks * Sx * powf(std::max(0.f, (R * V)), n);
+				color = make_float3(Ix, Ix, Ix);
+			}
+
+			uchar4 out;
+			out.x = static_cast<unsigned char>(Saturate(color.x) * 255.f);
+			out.y = static_cast<unsigned char>(Saturate(color.y) * 255.f);
+			out.z = static_cast<unsigned char>(Saturate(color.z) * 255.f);
+			out.w = 255.0;
+			dst.ptr(y)[x] = out;
+		}
+	}, 4);
+}
+
+void DepthToImage(const DeviceArray2D<float> & depth,
+		DeviceArray2D<uchar4> & image) {
+
+	PtrStep<float> src = depth;
+	PtrStepSz<uchar4> dst = image;
+	ThreadPool::Global().ParallelFor(0, image.rows, [&](int y) {
+		for (int x = 0; x < dst.cols; ++x) {
+			float dp = src.ptr(y)[x] / 3.0;
+			int intdp = __float2int_rd(dp * 255);
+			intdp = intdp > 255 ? 255 : intdp;
+			if (std::isnan(dp))
+				intdp = 0;
+			dst.ptr(y)[x] = make_uchar4(intdp, intdp, intdp, 255);
+		}
+	}, 8);
+}
+
+void RgbImageToRgba(const DeviceArray2D<uchar3> & image,
+		DeviceArray2D<uchar4> & rgba) {
+
+	PtrStepSz<uchar3> src = image;
+	PtrStep<uchar4> dst = rgba;
+	ThreadPool::Global().ParallelFor(0, image.rows, [&](int y) {
+		for (int x = 0; x < src.cols; ++x) {
+			uchar3 rgb = src.ptr(y)[x];
+			dst.ptr(y)[x] = make_uchar4(rgb.x, rgb.y, rgb.z, 255);
+		}
+	}, 8);
+}
+
+// Points landing on the same pixel overwrite each other in the order the
+// source is scanned, so this runs on the calling thread.
+void ForwardWarping(const DeviceArray2D<float4> & srcVMap,
+		const DeviceArray2D<float4> & srcNMap, DeviceArray2D<float4> & dstVMap,
+		DeviceArray2D<float4> & dstNMap, Matrix3f srcRot, Matrix3f dstInvRot,
+		float3 srcTrans, float3 dstTrans, float fx, float fy, float cx,
+		float cy) {
+
+	dstVMap.clear();
+
+	PtrStepSz<float4> vsrc = srcVMap;
+	PtrStep<float4> nsrc = srcNMap;
+	PtrStep<float4> vdst = dstVMap;
+	PtrStep<float4> ndst = dstNMap;
+	for (int y = 0; y < vsrc.rows; ++y) {
+		for (int x = 0; x < vsrc.cols; ++x) {
+			float4 srcv = vsrc.ptr(y)[x];
+			float4 dstv = make_float4(dstInvRot * (srcRot * srcv + srcTrans - dstTrans), srcv.w);
+			// Drops points behind the camera and pixels without a point.
+			if (!(dstv.z > 0))
+				continue;
+
+			float u = fx * dstv.x / dstv.z + cx;
+			float v = fy * dstv.y / dstv.z + cy;
+			if (u < 0 || v < 0 || u >= vsrc.cols || v >= vsrc.rows)
+				continue;
+
+			float4 srcn = nsrc.ptr(y)[x];
+			float4 dstn = make_float4(dstInvRot * (srcRot * srcn));
+			vdst.ptr((int) v)[(int) u] = dstv;
+			ndst.ptr((int) v)[(int) u] = normalised(dstn);
+		}
+	}
+}
@@ -37,6 +37,15 @@ void ImageToIntensity(const DeviceArray2D<uchar3> & rgb,
 void ComputeDerivativeImage(DeviceArray2D<unsigned char> & image,
 		DeviceArray2D<short> & dx, DeviceArray2D<short> & dy);
 
+#ifdef HOST_BACKEND
+void BuildPyramid(const DeviceArray2D<unsigned short> & rawDepth,
+		const DeviceArray2D<uchar3> & rgb, DeviceArray2D<float> & range,
+		DeviceArray2D<float> * depth, DeviceArray2D<unsigned char> * image,
+		DeviceArray2D<float4> * vmap, DeviceArray2D<float4> * nmap,
+		DeviceArray2D<short> * dIdx, DeviceArray2D<short> * dIdy,
+		int noPyrs, Intrinsics K, float depthScale, float depthCutoff);
+#endif
+
 void ResizeMap(const DeviceArray2D<float4> & vsrc,
 		const DeviceArray2D<float4> & nsrc, DeviceArray2D<float4> & vdst,
 		DeviceArray2D<float4> & ndst);
@@ -82,6 +91,12 @@ void RGBStep(const DeviceArray2D<unsigned char> & nextImage,
 		DeviceArray<int> & outRes, float * residual, double * matrixA_host,
 		double * vectorB_host);
 
+#ifdef HOST_BACKEND
+void BuildAdjacencyMatrix(cv::Mat & adjecencyMatrix,
+		DeviceArray<SURF> & frameKeys,
+		DeviceArray<SURF> & mapKeys,
+		DeviceArray<float> & dist);
+#else
 void BuildAdjacencyMatrix(cv::cuda::GpuMat & adjecencyMatrix,
 		DeviceArray<SURF> & frameKeys,
 		DeviceArray<SURF> & mapKeys,
@@ -94,5 +109,6 @@ void FilterKeyMatching(cv::cuda::GpuMat & adjecencyMatrix,
 		DeviceArray<SURF> & queryKeyFiltered,
 		DeviceArray<int> & QueryIdx,
 		DeviceArray<int> & keyIdxFiltered);
+#endif
 
 #endif
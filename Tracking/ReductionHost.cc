@@ -0,0 +1,539 @@
+#include "Reduction.h"
+#include "ThreadPool.h"
+
+#include <climits>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define PacketSize 8
+
+template<int rows, int cols> void inline CreateMatrix(float* host_data, double* host_a, double* host_b) {
+	int shift = 0;
+	for (int i = 0; i < rows; ++i)
+		for (int j = i; j < cols; ++j) {
+			double value = (double) host_data[shift++];
+			if (j == rows)
+				host_b[i] = value;
+			else
+				host_a[j * rows + i] = host_a[i * rows + j] = value;
+		}
+}
+
+// Runs func(i, partial) for every chunk i in parallel, each chunk filling
+// its own partial sum, then adds the partials pairwise in a fixed order.
+// The result does not depend on how chunks were spread over threads.
+template<typename T, int size, class Func> void TreeReduce(int noChunks, Func func, T * result) {
+
+	std::vector<double> partial(noChunks * size, 0);
+	ThreadPool::Global().ParallelFor(0, noChunks, [&](int i) {
+		func(i, &partial[i * size]);
+	}, 4);
+
+	for (int step = 1; step < noChunks; step *= 2)
+		for (int i = 0; i + step < noChunks; i += 2 * step)
+			for (int j = 0; j < size; ++j)
+				partial[i * size + j] += partial[(i + step) * size + j];
+
+	for (int j = 0; j < size; ++j)
+		result[j] = (T) partial[j];
+}
+
+// Sums the upper triangle of row * row^T plus the number of valid rows,
+// for packets of eight rows stored lane by lane. Accumulates in single
+// precision across a chunk and hands the total over in double precision.
+template<int n> struct OuterProduct {
+
+	static const int size = n * (n + 1) / 2 + 1;
+
+	inline OuterProduct() {
+#ifdef __AVX2__
+		for (int k = 0; k < size; ++k)
+			acc[k] = _mm256_setzero_ps();
+#else
+		memset(acc, 0, sizeof(acc));
+#endif
+	}
+
+	inline void add(const float (&row)[n][PacketSize], const float * found) {
+#ifdef __AVX2__
+		__m256 r[n];
+		for (int i = 0; i < n; ++i)
+			r[i] = _mm256_load_ps(row[i]);
+
+		int count = 0;
+		for (int i = 0; i < n; ++i)
+			for (int j = i; j < n; ++j, ++count)
+				acc[count] = _mm256_add_ps(acc[count], _mm256_mul_ps(r[i], r[j]));
+		acc[count] = _mm256_add_ps(acc[count], _mm256_load_ps(found));
+#else
+		int count = 0;
+		for (int i = 0; i < n; ++i)
+			for (int j = i; j < n; ++j, ++count)
+				for (int l = 0; l < PacketSize; ++l)
+					acc[count][l] += row[i][l] * row[j][l];
+		for (int l = 0; l < PacketSize; ++l)
+			acc[count][l] += found[l];
+#endif
+	}
+
+	inline void store(double * sum) const {
+		alignas(32) float lanes[PacketSize];
+		for (int k = 0; k < size; ++k) {
+#ifdef __AVX2__
+			_mm256_store_ps(lanes, acc[k]);
+#else
+			memcpy(lanes, acc[k], sizeof(lanes));
+#endif
+			for (int l = 0; l < PacketSize; ++l)
+				sum[k] += lanes[l];
+		}
+	}
+
+#ifdef __AVX2__
+	__m256 acc[size];
+#else
+	float acc[size][PacketSize];
+#endif
+};
+
+struct SO3Reduce {
+
+	PtrStep<unsigned char> nextImage;
+	PtrStep<unsigned char> lastImage;
+	PtrStep<short> dIdx;
+	PtrStep<short> dIdy;
+	int cols, rows;
+	float fx, fy, cx, cy;
+	Matrix3f RcurrInv;
+	Matrix3f Rlast;
+
+	inline bool findCorresp(int & x, int & y, int & u,
+			int & v, float3 & vlastcurr) const {
+
+		float3 vlast;
+		vlast.x = (x - cx) / fx;
+		vlast.y = (y - cy) / fy;
+		vlast.z = 1.0f;
+		vlastcurr = RcurrInv * (Rlast * vlast);
+
+		u = __float2int_rn(fx * vlastcurr.x / vlastcurr.z + cx);
+		v = __float2int_rn(fy * vlastcurr.y / vlastcurr.z + cy);
+
+		return u >= 5 && v >= 5 && u < cols - 5 && v < rows - 5;
+	}
+
+	inline void getRow(int x, int y, int l, float (&row)[4][PacketSize], float * found) const {
+
+		float3 point;
+		int u = 0, v = 0;
+		if (!findCorresp(x, y, u, v, point))
+			return;
+
+		float gx = dIdx.ptr(v)[u] / 9.0f;
+		float gy = dIdy.ptr(v)[u] / 9.0f;
+		float invz = 1.0f / point.z;
+
+		float3 left;
+		left.x = gx * fx * invz;
+		left.y = gy * fy * invz;
+		left.z = -(point.x * left.x + point.y * left.y) * invz;
+
+		float3 j = -cross(left, point);
+		row[0][l] = j.x;
+		row[1][l] = j.y;
+		row[2][l] = j.z;
+		row[3][l] = -((int) nextImage.ptr(v)[u] - (int) lastImage.ptr(y)[x]);
+		found[l] = 1.0f;
+	}
+
+	inline void operator()(int y, double * sum) const {
+
+		if (y < 5 || y >= rows - 5)
+			return;
+
+		OuterProduct<4> acc;
+		for (int x = 5; x < cols - 5; x += PacketSize) {
+			alignas(32) float row[4][PacketSize] = { };
+			alignas(32) float found[PacketSize] = { };
+			int n = std::min(PacketSize, cols - 5 - x);
+			for (int l = 0; l < n; ++l)
+				getRow(x + l, y, l, row, found);
+			acc.add(row, found);
+		}
+
+		acc.store(sum);
+	}
+};
+
+void SO3Step(const DeviceArray2D<unsigned char> & nextImage,
+		     const DeviceArray2D<unsigned char> & lastImage,
+		     const DeviceArray2D<short> & dIdx,
+		     const DeviceArray2D<short> & dIdy,
+		     Matrix3f RcurrInv,
+		     Matrix3f Rlast,
+		     Intrinsics K,
+		     DeviceArray2D<float> & sum,
+		     DeviceArray<float> & out,
+		     float * residual,
+		     double * matrixA_host,
+		     double * vectorB_host) {
+
+	int cols = nextImage.cols;
+	int rows = nextImage.rows;
+
+	SO3Reduce so3;
+	so3.nextImage = nextImage;
+	so3.lastImage = lastImage;
+	so3.dIdx = dIdx;
+	so3.dIdy = dIdy;
+	so3.RcurrInv = RcurrInv;
+	so3.Rlast = Rlast;
+	so3.fx = K.fx;
+	so3.fy = K.fy;
+	so3.cx = K.cx;
+	so3.cy = K.cy;
+	so3.cols = cols;
+	so3.rows = rows;
+
+	float host_data[11];
+	TreeReduce<float, 11>(rows, so3, host_data);
+	out.upload(host_data);
+	CreateMatrix<3, 4>(host_data, matrixA_host, vectorB_host);
+
+	residual[0] = host_data[9];
+	residual[1] = host_data[10];
+}
+
+struct ICPReduce {
+
+	Matrix3f Rcurr;
+	Matrix3f Rlast;
+	Matrix3f RlastInv;
+	float3 tcurr;
+	float3 tlast;
+	PtrStep<float4> VMapCurr, VMapLast;
+	PtrStep<float4> NMapCurr, NMapLast;
+	int cols, rows;
+	float fx, fy, cx, cy;
+	float angleThresh, distThresh;
+
+	inline bool searchPoint(int& x, int& y, float3& vcurr_g,
+			float3& vlast_g, float3& nlast_g) const {
+
+		float3 vcurr_c = make_float3(VMapCurr.ptr(y)[x]);
+		if (std::isnan(vcurr_c.x) || vcurr_c.z < 1e-3)
+			return false;
+
+		vcurr_g = Rcurr * vcurr_c + tcurr;
+		float3 vcurr_p = RlastInv * (vcurr_g - tlast);
+
+		float invz = 1.0 / vcurr_p.z;
+		int u = (int) (vcurr_p.x * invz * fx + cx + 0.5);
+		int v = (int) (vcurr_p.y * invz * fy + cy + 0.5);
+		if (u < 0 || v < 0 || u >= cols || v >= rows)
+			return false;
+
+		float3 vlast_c = make_float3(VMapLast.ptr(v)[u]);
+		vlast_g = Rlast * vlast_c + tlast;
+
+		float3 ncurr_c = make_float3(NMapCurr.ptr(y)[x]);
+		float3 ncurr_g = Rcurr * ncurr_c;
+
+		float3 nlast_c = make_float3(NMapLast.ptr(v)[u]);
+		nlast_g = Rlast * nlast_c;
+
+		float dist = norm(vlast_g - vcurr_g);
+		float sine = norm(cross(ncurr_g, nlast_g));
+
+		return (sine < angleThresh && dist <= distThresh && !std::isnan(ncurr_c.x)
+				&& !std::isnan(nlast_c.x));
+	}
+
+	// Fills lane l of the packet with the point-to-plane row of pixel (x, y).
+	inline void getRow(int x, int y, int l, float (&row)[7][PacketSize], float * found) const {
+
+		float3 vcurr, vlast, nlast;
+		if (!searchPoint(x, y, vcurr, vlast, nlast))
+			return;
+
+		nlast = RlastInv * nlast;
+		vcurr = RlastInv * (vcurr - tlast);
+		vlast = RlastInv * (vlast - tlast);
+		float3 n = -nlast;
+		float3 c = cross(nlast, vlast);
+		row[0][l] = n.x;
+		row[1][l] = n.y;
+		row[2][l] = n.z;
+		row[3][l] = c.x;
+		row[4][l] = c.y;
+		row[5][l] = c.z;
+		row[6][l] = -nlast * (vcurr - vlast);
+		found[l] = 1.0f;
+	}
+
+	inline void operator()(int y, double * sum) const {
+
+		OuterProduct<7> acc;
+		for (int x = 0; x < cols; x += PacketSize) {
+			alignas(32) float row[7][PacketSize] = { };
+			alignas(32) float found[PacketSize] = { };
+			int n = std::min(PacketSize, cols - x);
+			for (int l = 0; l < n; ++l)
+				getRow(x + l, y, l, row, found);
+			acc.add(row, found);
+		}
+
+		acc.store(sum);
+	}
+};
+
+void ICPStep(DeviceArray2D<float4> & nextVMap,
+			 DeviceArray2D<float4> & lastVMap,
+			 DeviceArray2D<float4> & nextNMap,
+			 DeviceArray2D<float4> & lastNMap,
+			 Matrix3f Rcurr,
+			 float3 tcurr,
+			 Matrix3f Rlast,
+			 Matrix3f RlastInv,
+			 float3 tlast,
+			 Intrinsics K,
+			 DeviceArray2D<float> & sum,
+			 DeviceArray<float> & out,
+			 float * residual,
+			 double * matrixA_host,
+			 double * vectorB_host) {
+
+	int cols = nextVMap.cols;
+	int rows = nextVMap.rows;
+
+	ICPReduce icp;
+	icp.VMapCurr = nextVMap;
+	icp.NMapCurr = nextNMap;
+	icp.VMapLast = lastVMap;
+	icp.NMapLast = lastNMap;
+	icp.cols = cols;
+	icp.rows = rows;
+	icp.Rcurr = Rcurr;
+	icp.tcurr = tcurr;
+	icp.Rlast = Rlast;
+	icp.RlastInv = RlastInv;
+	icp.tlast = tlast;
+	icp.angleThresh = 0.6;
+	icp.distThresh = 0.1;
+	icp.fx = K.fx;
+	icp.fy = K.fy;
+	icp.cx = K.cx;
+	icp.cy = K.cy;
+
+	float host_data[29];
+	TreeReduce<float, 29>(rows, icp, host_data);
+	out.upload(host_data);
+	CreateMatrix<6, 7>(host_data, matrixA_host, vectorB_host);
+
+	residual[0] = host_data[27];
+	residual[1] = host_data[28];
+}
+
+struct RGBReduction {
+
+	int cols, rows;
+
+	Matrix3f Rcurr;
+	Matrix3f RcurrInv;
+	Matrix3f Rlast;
+	Matrix3f RlastInv;
+	float3 tlast, tcurr;
+
+	PtrStep<float4> nextVMap;
+	PtrStep<float4> lastVMap;
+	PtrStep<unsigned char> nextImage;
+	PtrStep<unsigned char> lastImage;
+	PtrStep<short> dIdx;
+	PtrStep<short> dIdy;
+
+	float sigma;
+	float fx, fy, cx, cy;
+
+	// Valid correspondences of each row, kept compact so the second pass
+	// only walks pixels that contribute.
+	std::vector<Residual> * RGBResidual;
+
+	// Same test as the device pre-pass. The intensity window check
+	// (rows y-2..y+1, columns x-2..x+1 all non-zero) is done with byte
+	// minimums over the whole row first, and the gradient test on the
+	// raw shorts, so no pixel is converted to float unless it survives.
+	inline void FindCorresp(int y, double * sum) const {
+
+		std::vector<Residual> & list = RGBResidual[y];
+		list.clear();
+		if (y < 5 || y >= rows - 5)
+			return;
+
+		std::vector<unsigned char> window(cols, 0);
+		const unsigned char * r0 = nextImage.ptr(y - 2);
+		const unsigned char * r1 = nextImage.ptr(y - 1);
+		const unsigned char * r2 = nextImage.ptr(y);
+		const unsigned char * r3 = nextImage.ptr(y + 1);
+		for (int x = 0; x < cols; ++x)
+			window[x] = std::min(std::min(r0[x], r1[x]), std::min(r2[x], r3[x]));
+		for (int x = 5; x < cols - 5; ++x)
+			window[x - 2] = std::min(std::min(window[x - 2], window[x - 1]),
+									 std::min(window[x], window[x + 1]));
+
+		const short * gx = dIdx.ptr(y);
+		const short * gy = dIdy.ptr(y);
+		int count = 0;
+		long long error = 0;
+		for (int x = 5; x < cols - 5; ++x) {
+
+			if (window[x - 2] == 0 || (gx[x] == 0 && gy[x] == 0))
+				continue;
+
+			float4 vcurr = nextVMap.ptr(y)[x];
+			if (std::isnan(vcurr.x))
+				continue;
+
+			float3 vcurr_g = Rcurr * vcurr + tcurr;
+			float3 vcurrlast = RlastInv * (vcurr_g - tlast);
+			int u = __float2int_rd(fx * vcurrlast.x / vcurrlast.z + cx + 0.5);
+			int v = __float2int_rd(fy * vcurrlast.y / vcurrlast.z + cy + 0.5);
+			if (u < 0 || v < 0 || u >= cols || v >= rows)
+				continue;
+
+			float4 vlast = lastVMap.ptr(v)[u];
+			if (std::isnan(vlast.x) || !(norm(vlast - vcurr) < 0.1) || lastImage.ptr(v)[u] == 0)
+				continue;
+
+			Residual res;
+			res.last = make_int2(u, v);
+			res.curr = make_int2(x, y);
+			res.diff = (int) nextImage.ptr(y)[x] - (int) lastImage.ptr(v)[u];
+			res.valid = true;
+			res.point = make_float3(vlast);
+			list.push_back(res);
+
+			count++;
+			error += res.diff * res.diff;
+		}
+
+		sum[0] += count;
+		sum[1] += error;
+	}
+
+	inline void getRow(const Residual & res, int l, float (&row)[7][PacketSize], float * found) const {
+
+		float w = sigma + abs(res.diff);
+		w = w < 1e-3 ? 1.0f : 1.0f / w;
+
+		if(sigma < 1e-6)
+			w = 1.0f;
+
+		float4 vlast = lastVMap.ptr(res.last.y)[res.last.x];
+		float3 point = RcurrInv * (Rlast * vlast + tlast - tcurr);
+		float gx = dIdx.ptr(res.curr.y)[res.curr.x] / 9.0f;
+		float gy = dIdy.ptr(res.curr.y)[res.curr.x] / 9.0f;
+
+		float3 left;
+		float invz = 1.0f / point.z;
+		left.x = gx * fx * invz;
+		left.y = gy * fy * invz;
+		left.z = -(left.x * point.x + left.y * point.y) * invz;
+
+		float3 j = w * left;
+		float3 k = w * cross(point, left);
+		row[0][l] = j.x;
+		row[1][l] = j.y;
+		row[2][l] = j.z;
+		row[3][l] = k.x;
+		row[4][l] = k.y;
+		row[5][l] = k.z;
+		row[6][l] = -w * res.diff;
+		found[l] = 1.0f;
+	}
+
+	inline void operator()(int y, double * sum) const {
+
+		const std::vector<Residual> & list = RGBResidual[y];
+		if (list.empty())
+			return;
+
+		OuterProduct<7> acc;
+		for (size_t i = 0; i < list.size(); i += PacketSize) {
+			alignas(32) float row[7][PacketSize] = { };
+			alignas(32) float found[PacketSize] = { };
+			int n = std::min((size_t) PacketSize, list.size() - i);
+			for (int l = 0; l < n; ++l)
+				getRow(list[i + l], l, row, found);
+			acc.add(row, found);
+		}
+
+		acc.store(sum);
+	}
+};
+
+void RGBStep(const DeviceArray2D<unsigned char> & nextImage,
+			 const DeviceArray2D<unsigned char> & lastImage,
+			 const DeviceArray2D<float4> & nextVMap,
+			 const DeviceArray2D<float4> & lastVMap,
+			 const DeviceArray2D<short> & dIdx,
+			 const DeviceArray2D<short> & dIdy,
+			 Matrix3f Rcurr,
+			 Matrix3f RcurrInv,
+			 Matrix3f Rlast,
+			 Matrix3f RlastInv,
+			 float3 tcurr,
+			 float3 tlast,
+			 Intrinsics K,
+			 DeviceArray2D<float> & sum,
+			 DeviceArray<float> & out,
+			 DeviceArray2D<int> & sumRes,
+			 DeviceArray<int> & outRes,
+			 float * residual,
+			 double * matrixA_host,
+			 double * vectorB_host) {
+
+	int cols = nextImage.cols;
+	int rows = nextImage.rows;
+
+	RGBReduction rgb;
+	std::vector<std::vector<Residual>> rgbResidual(rows);
+
+	rgb.cols = cols;
+	rgb.rows = rows;
+	rgb.nextImage = nextImage;
+	rgb.lastImage = lastImage;
+	rgb.nextVMap = nextVMap;
+	rgb.lastVMap = lastVMap;
+	rgb.dIdx = dIdx;
+	rgb.dIdy = dIdy;
+	rgb.Rcurr = Rcurr;
+	rgb.RcurrInv = RcurrInv;
+	rgb.Rlast = Rlast;
+	rgb.RlastInv = RlastInv;
+	rgb.tcurr = tcurr;
+	rgb.tlast = tlast;
+	rgb.RGBResidual = rgbResidual.data();
+	rgb.fx = K.fx;
+	rgb.fy = K.fy;
+	rgb.cx = K.cx;
+	rgb.cy = K.cy;
+
+	double res_host[2];
+	TreeReduce<double, 2>(rows, [&](int y, double * sum) {
+		rgb.FindCorresp(y, sum);
+	}, res_host);
+
+	int res_int[2] = { (int) res_host[0], (int) std::min(res_host[1], (double) INT_MAX) };
+	outRes.upload(res_int);
+	rgb.sigma = sqrt(res_host[1] / (res_host[0] == 0 ? 1 : res_host[0]));
+
+	float host_data[29];
+	TreeReduce<float, 29>(rows, rgb, host_data);
+	out.upload(host_data);
+	CreateMatrix<6, 7>(host_data, matrixA_host, vectorB_host);
+
+	residual[0] = host_data[27];
+	residual[1] = host_data[28];
+}
@@ -34,7 +34,11 @@ Tracker::Tracker(int cols_, int rows_, float fx, float fy, float cx, float cy) :
 	outRes.create(2);
 
 	K = Intrinsics(fx, fy, cx, cy);
+#ifdef HOST_BACKEND
+	matcher = BFMatcher::create(NORM_L2);
+#else
 	matcher = cuda::DescriptorMatcher::createBFMatcher(NORM_L2);
+#endif
 
 	NextFrame = new Frame();
 	LastFrame = new Frame();
@@ -158,7 +162,7 @@ bool Tracker::TrackFrame() {
 		NextFrame->pose = LastFrame->pose;
 	}
 
-//	ComputeSO3();
+	ComputeSO3();
 	valid = ComputeSE3(false, ITERATIONS_SE3, THRESH_ICP_SE3);
 	return valid;
 }
@@ -507,6 +511,17 @@ bool Tracker::GenerateGraph(int N) {
 	DeviceArray<SURF> cuFrameKeys(frameKeys);
 	DeviceArray<float> cuDistance(distance);
 
+	cv::Mat rank, rankIndex;
+#ifdef HOST_BACKEND
+	// Adjacency Matrix a.k.a. Consistency Matrix
+	cv::Mat conMatrix(frameKeys.size(), frameKeys.size(), CV_32FC1);
+
+	// build adjacency matrix from raw key point matches
+	BuildAdjacencyMatrix(conMatrix, cuFrameKeys, cuMapKeys, cuDistance);
+
+	// filtered out useful key points
+	cv::reduce(conMatrix, rank, 0, CV_REDUCE_SUM);
+#else
 	// Adjacency Matrix a.k.a. Consistency Matrix
 	cuda::GpuMat cuConMatrix(frameKeys.size(), frameKeys.size(), CV_32FC1);
 
@@ -516,15 +531,16 @@ bool Tracker::GenerateGraph(int N) {
 	// filtered out useful key points
 	cv::cuda::GpuMat cuRank;
 	cv::cuda::reduce(cuConMatrix, cuRank, 0, CV_REDUCE_SUM);
-	cv::Mat rank, rankIndex;
 	cuRank.download(rank);
 
+	cv::Mat conMatrix(cuConMatrix);
+#endif
+
 	if(rank.cols == 0)
 		return false;
 
 	cv::sortIdx(rank, rankIndex, CV_SORT_DESCENDING);
 
-	cv::Mat conMatrix(cuConMatrix);
 	std::vector<cv::Mat> vmSelectedIdx;
 	cv::Mat cvNoSelected;
 
@@ -651,8 +667,9 @@ bool Tracker::ValidatePose() {
 		if(no < 512)
 			continue;
 
-		map->RayTrace(no, LastFrame);
-		LastFrame->ResizeImages();
+		// Hypotheses are only checked on the coarsest level, so the model
+		// is rendered straight at that resolution.
+		map->RayTrace(no, LastFrame, Frame::NUM_PYRS - 1);
 		NextFrame->pose = LastFrame->pose;
 		bool valid = ComputeSE3(true, ITERATIONS_RELOC, THRESH_ICP_RELOC);
 
@@ -90,7 +90,11 @@ protected:
 
 	const int maxIter = 35;
 	const int maxIterReloc = 100;
+#ifdef HOST_BACKEND
+	cv::Ptr<cv::DescriptorMatcher> matcher;
+#else
 	cv::Ptr<cv::cuda::DescriptorMatcher> matcher;
+#endif
 
 	int noInliers;
 	int noMissedFrames;
@@ -98,7 +102,7 @@ protected:
 	// ICP Tracking
 	static const int NUM_PYRS = 3;
 	const int ITERATIONS_SE3[NUM_PYRS] = { 10, 5, 3 };
-	const int ITERATIONS_RELOC[NUM_PYRS] = { 3, 3, 2 };
+	const int ITERATIONS_RELOC[NUM_PYRS] = { 0, 0, 8 };
 	const int MIN_ICP_COUNT[NUM_PYRS] = { 2000, 1000, 100 };
 	const float THRESH_ICP_SE3 = 0.0001f;
 	const float THRESH_ICP_RELOC = 0.001f;
@@ -124,7 +128,7 @@ protected:
 
 	// Graph based relocalization
 	std::vector<Eigen::Vector3d> mapKeysAll;
-	cv::cuda::GpuMat descriptors;
+	DescriptorMat descriptors;
 
 	const int N_LISTS_SELECT = 5;
 	const int N_LISTS_SUB_GRAPH = 10;
@@ -5,6 +5,119 @@
 
 #include <vector>
 #include <atomic>
+#include <algorithm>
+
+//------------------------------------------------------------------
+// Memory Backend
+//------------------------------------------------------------------
+#ifdef HOST_BACKEND
+
+static constexpr size_t HostAlignment = 64;
+
+static inline void MemAlloc(void ** ptr, size_t size) {
+	if (posix_memalign(ptr, HostAlignment, size) != 0)
+		error("out of host memory", __FILE__, __LINE__, __func__);
+}
+
+static inline void MemAllocPitch(void ** ptr, size_t * step, size_t width, size_t rows) {
+	*step = (width + HostAlignment - 1) / HostAlignment * HostAlignment;
+	MemAlloc(ptr, *step * rows);
+}
+
+static inline void MemFree(void * ptr) {
+	free(ptr);
+}
+
+// Large buffers come from mmap, so glibc grows them by remapping pages
+// rather than copying; fall back to a copy if the result lost alignment.
+static inline void MemRealloc(void ** ptr, size_t oldSize, size_t size) {
+	void * data = realloc(*ptr, size);
+	if (!data)
+		error("out of host memory", __FILE__, __LINE__, __func__);
+
+	if ((size_t) data % HostAlignment != 0) {
+		void * aligned;
+		MemAlloc(&aligned, size);
+		memcpy(aligned, data, std::min(oldSize, size));
+		free(data);
+		data = aligned;
+	}
+	*ptr = data;
+}
+
+static inline void MemCopy(void * dst, const void * src, size_t size, cudaMemcpyKind kind) {
+	if (dst != src)
+		memcpy(dst, src, size);
+}
+
+static inline void MemCopy2D(void * dst, size_t dstStep, const void * src,
+		size_t srcStep, size_t width, size_t rows, cudaMemcpyKind kind) {
+	if (dst == src && dstStep == srcStep)
+		return;
+
+	if (dstStep == width && srcStep == width) {
+		memcpy(dst, src, width * rows);
+		return;
+	}
+
+	for (size_t y = 0; y < rows; ++y)
+		memcpy((char*) dst + y * dstStep, (const char*) src + y * srcStep, width);
+}
+
+static inline void MemSet(void * ptr, size_t size) {
+	memset(ptr, 0, size);
+}
+
+static inline void MemSet2D(void * ptr, size_t step, size_t width, size_t rows) {
+	if (step == width) {
+		memset(ptr, 0, width * rows);
+		return;
+	}
+
+	for (size_t y = 0; y < rows; ++y)
+		memset((char*) ptr + y * step, 0, width);
+}
+
+#else
+
+static inline void MemAlloc(void ** ptr, size_t size) {
+	SafeCall(cudaMalloc(ptr, size));
+}
+
+static inline void MemAllocPitch(void ** ptr, size_t * step, size_t width, size_t rows) {
+	SafeCall(cudaMallocPitch(ptr, step, width, rows));
+}
+
+static inline void MemFree(void * ptr) {
+	SafeCall(cudaFree(ptr));
+}
+
+static inline void MemRealloc(void ** ptr, size_t oldSize, size_t size) {
+	void * data;
+	SafeCall(cudaMalloc(&data, size));
+	SafeCall(cudaMemcpy(data, *ptr, std::min(oldSize, size), cudaMemcpyDeviceToDevice));
+	SafeCall(cudaFree(*ptr));
+	*ptr = data;
+}
+
+static inline void MemCopy(void * dst, const void * src, size_t size, cudaMemcpyKind kind) {
+	SafeCall(cudaMemcpy(dst, src, size, kind));
+}
+
+static inline void MemCopy2D(void * dst, size_t dstStep, const void * src,
+		size_t srcStep, size_t width, size_t rows, cudaMemcpyKind kind) {
+	SafeCall(cudaMemcpy2D(dst, dstStep, src, srcStep, width, rows, kind));
+}
+
+static inline void MemSet(void * ptr, size_t size) {
+	SafeCall(cudaMemset(ptr, 0, size));
+}
+
+static inline void MemSet2D(void * ptr, size_t step, size_t width, size_t rows) {
+	SafeCall(cudaMemset2D(ptr, step, 0, width, rows));
+}
+
+#endif
 
 template<class T> struct PtrSz {
 
@@ -49,8 +162,14 @@ template<class T> struct DeviceArray {
 
 	DeviceArray(const std::vector<T> & vec);
 
+	// Wraps memory owned elsewhere, which release leaves alone and resize
+	// copies out of.
+	DeviceArray(T * data_, size_t size_);
+
 	void create(size_t size_);
 
+	void resize(size_t size_);
+
 	void upload(const void * data_);
 
 	void upload(const std::vector<T> & vec);
@@ -63,6 +182,9 @@ template<class T> struct DeviceArray {
 
 	void download(void * data_, size_t size_) const;
 
+	// Copies size_ elements starting at element offset_.
+	void download(void * data_, size_t offset_, size_t size_) const;
+
 	void clear();
 
 	void release();
@@ -154,31 +276,54 @@ template<class T> __device__ inline T * PtrStepSz<T>::ptr(int y) const {
 // DeviceArray
 //------------------------------------------------------------------
 template<class T> DeviceArray<T>::DeviceArray() :
-		data(0), ref(0), size(0) {
+		data(0), size(0), ref(0) {
 }
 
 template<class T> DeviceArray<T>::DeviceArray(size_t size_) :
-		data(0), ref(0), size(size_) {
+		data(0), size(size_), ref(0) {
 	create(size_);
 }
 
 template<class T> DeviceArray<T>::DeviceArray(const std::vector<T> & vec) :
-		data(0), ref(0), size(vec.size()) {
+		data(0), size(vec.size()), ref(0) {
 	create(size);
 	upload(vec);
 }
 
+template<class T> DeviceArray<T>::DeviceArray(T * data_, size_t size_) :
+		data(data_), size(size_), ref(0) {
+}
+
 template<class T> DeviceArray<T>::~DeviceArray() {
 	release();
 }
 
 template<class T> void DeviceArray<T>::create(size_t size_) {
 	if (data) release();
-	SafeCall(cudaMalloc(&data, sizeof(T) * size_));
+	MemAlloc(&data, sizeof(T) * size_);
 	size = size_;
 	ref = new std::atomic<int>(1);
 }
 
+// Keeps the leading elements. Arrays sharing the old buffer keep it and
+// do not see the new size.
+template<class T> void DeviceArray<T>::resize(size_t size_) {
+	if (!data) {
+		create(size_);
+		return;
+	}
+
+	if (ref && *ref == 1) {
+		MemRealloc(&data, sizeof(T) * size, sizeof(T) * size_);
+		size = size_;
+		return;
+	}
+
+	DeviceArray<T> other(size_);
+	MemCopy(other.data, data, sizeof(T) * std::min(size, size_), cudaMemcpyDeviceToDevice);
+	*this = other;
+}
+
 template<class T> void DeviceArray<T>::upload(const void * data_) {
 	upload(data_, size);
 }
@@ -189,7 +334,7 @@ template<class T> void DeviceArray<T>::upload(const std::vector<T> & vec) {
 
 template<class T> void DeviceArray<T>::upload(const void * data_, size_t size_) {
 	if (size_ > size) return;
-	SafeCall(cudaMemcpy(data, data_, sizeof(T) * size_, cudaMemcpyHostToDevice));
+	MemCopy(data, data_, sizeof(T) * size_, cudaMemcpyHostToDevice);
 }
 
 template<class T> void DeviceArray<T>::download(void * data_) const {
@@ -203,18 +348,22 @@ template<class T> void DeviceArray<T>::download(std::vector<T> & vec) const {
 }
 
 template<class T> void DeviceArray<T>::download(void * data_, size_t size_) const {
-	SafeCall(cudaMemcpy(data_, data, sizeof(T) * size_,	cudaMemcpyDeviceToHost));
+	MemCopy(data_, data, sizeof(T) * size_, cudaMemcpyDeviceToHost);
+}
+
+template<class T> void DeviceArray<T>::download(void * data_, size_t offset_, size_t size_) const {
+	MemCopy(data_, (T*) data + offset_, sizeof(T) * size_, cudaMemcpyDeviceToHost);
 }
 
 template<class T> void DeviceArray<T>::clear() {
-	SafeCall(cudaMemset(data, 0, sizeof(T) * size));
+	MemSet(data, sizeof(T) * size);
 }
 
 template<class T> void DeviceArray<T>::release() {
 	if (ref && --*ref == 0) {
 		delete ref;
 		if (data) {
-			SafeCall(cudaFree(data));
+			MemFree(data);
 		}
 	}
 
@@ -230,7 +379,7 @@ template<class T> void DeviceArray<T>::copyTo(DeviceArray<T> & other) const {
 	}
 
 	other.create(size);
-	SafeCall(cudaMemcpy(other.data, data, sizeof(T) * size, cudaMemcpyDeviceToDevice));
+	MemCopy(other.data, data, sizeof(T) * size, cudaMemcpyDeviceToDevice);
 }
 
 template<class T> DeviceArray<T> & DeviceArray<T>::operator=(const DeviceArray<T> & other) {
@@ -282,7 +431,7 @@ template<class T> void DeviceArray2D<T>::create(int cols_, int rows_) {
 		if(data)
 			release();
 
-		SafeCall(cudaMallocPitch(&data, &step, sizeof(T) * cols_, rows_));
+		MemAllocPitch(&data, &step, sizeof(T) * cols_, rows_);
 
 		cols = cols_;
 
@@ -304,7 +453,7 @@ template<class T> void DeviceArray2D<T>::upload(const void * data_, size_t step_
 	if(!data)
 		create(cols_, rows_);
 
-	SafeCall(cudaMemcpy2D(data, step, data_, step_, sizeof(T) * cols_, rows_, cudaMemcpyHostToDevice));
+	MemCopy2D(data, step, data_, step_, sizeof(T) * cols_, rows_, cudaMemcpyHostToDevice);
 }
 
 template<class T> void DeviceArray2D<T>::swap(DeviceArray2D<T> & other) {
@@ -321,30 +470,32 @@ template<class T> void DeviceArray2D<T>::swap(DeviceArray2D<T> & other) {
 }
 
 template<class T> void DeviceArray2D<T>::clear() {
-	SafeCall(cudaMemset2D(data, step, 0, sizeof(T) * cols, rows));
+	MemSet2D(data, step, sizeof(T) * cols, rows);
 }
 
 template<class T> void DeviceArray2D<T>::download(void * data_, size_t step_) const {
 	if(!data)
 		return;
-	SafeCall(cudaMemcpy2D(data_, step_, data, step, sizeof(T) * cols, rows, cudaMemcpyDeviceToHost));
+	MemCopy2D(data_, step_, data, step, sizeof(T) * cols, rows, cudaMemcpyDeviceToHost);
 }
 
 template<class T> void DeviceArray2D<T>::release() {
 	if(ref && --*ref == 0) {
 		delete ref;
 		if(data)
-			SafeCall(cudaFree(data));
+			MemFree(data);
 	}
 	cols = rows = step = 0;
 	data = ref = 0;
 }
 
+// Reuses the buffer of other when it has the same size and is not shared.
 template<class T> void DeviceArray2D<T>::copyTo(DeviceArray2D<T> & other) const {
 	if(!data)
 		other.release();
-	other.create(cols, rows);
-	SafeCall(cudaMemcpy2D(other.data, other.step, data, step, sizeof(T) * cols, rows, cudaMemcpyDeviceToDevice));
+	if(other.cols != cols || other.rows != rows || !other.ref || *other.ref != 1)
+		other.create(cols, rows);
+	MemCopy2D(other.data, other.step, data, step, sizeof(T) * cols, rows, cudaMemcpyDeviceToDevice);
 }
 
 template<class T> DeviceArray2D<T>& DeviceArray2D<T>::operator=(const DeviceArray2D<T>& other) {
@@ -0,0 +1,161 @@
+#ifndef HOST_RUNTIME_H__
+#define HOST_RUNTIME_H__
+
+// Stand-in for cuda_runtime.h used by the HOST_BACKEND build.
+// Provides the vector types, function qualifiers and atomics
+// the shared headers rely on, so they compile with a plain C++ compiler.
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+
+#define __host__
+#define __device__
+#define __constant__
+#define __inline__ inline
+#define __forceinline__ inline __attribute__((always_inline))
+#define __align__(n) alignas(n)
+
+typedef unsigned int uint;
+
+enum cudaError_t {
+	cudaSuccess = 0
+};
+
+enum cudaMemcpyKind {
+	cudaMemcpyHostToHost = 0,
+	cudaMemcpyHostToDevice = 1,
+	cudaMemcpyDeviceToHost = 2,
+	cudaMemcpyDeviceToDevice = 3
+};
+
+static inline const char * cudaGetErrorString(cudaError_t err) {
+	return "no error";
+}
+
+static inline cudaError_t cudaGetLastError() {
+	return cudaSuccess;
+}
+
+static inline cudaError_t cudaDeviceSynchronize() {
+	return cudaSuccess;
+}
+
+//------------------------------------------------------------------
+// Vector Types
+//------------------------------------------------------------------
+struct uchar3 { unsigned char x, y, z; };
+struct __align__(4) uchar4 { unsigned char x, y, z, w; };
+struct __align__(4) short2 { short x, y; };
+struct __align__(8) int2 { int x, y; };
+struct int3 { int x, y, z; };
+struct __align__(16) int4 { int x, y, z, w; };
+struct __align__(8) uint2 { uint x, y; };
+struct uint3 { uint x, y, z; };
+struct __align__(8) float2 { float x, y; };
+struct float3 { float x, y, z; };
+struct __align__(16) float4 { float x, y, z, w; };
+struct __align__(16) double4 { double x, y, z, w; };
+
+static inline uchar3 make_uchar3(unsigned char x, unsigned char y, unsigned char z) {
+	uchar3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+static inline uchar4 make_uchar4(unsigned char x, unsigned char y, unsigned char z, unsigned char w) {
+	uchar4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+static inline short2 make_short2(short x, short y) {
+	short2 t; t.x = x; t.y = y; return t;
+}
+
+static inline int2 make_int2(int x, int y) {
+	int2 t; t.x = x; t.y = y; return t;
+}
+
+static inline int3 make_int3(int x, int y, int z) {
+	int3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+static inline int4 make_int4(int x, int y, int z, int w) {
+	int4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+static inline uint2 make_uint2(uint x, uint y) {
+	uint2 t; t.x = x; t.y = y; return t;
+}
+
+static inline uint3 make_uint3(uint x, uint y, uint z) {
+	uint3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+static inline float2 make_float2(float x, float y) {
+	float2 t; t.x = x; t.y = y; return t;
+}
+
+static inline float3 make_float3(float x, float y, float z) {
+	float3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+static inline float4 make_float4(float x, float y, float z, float w) {
+	float4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+static inline double4 make_double4(double x, double y, double z, double w) {
+	double4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+//------------------------------------------------------------------
+// Intrinsics
+//------------------------------------------------------------------
+static inline int __float_as_int(float val) {
+	int res;
+	memcpy(&res, &val, sizeof(float));
+	return res;
+}
+
+static inline float __int_as_float(int val) {
+	float res;
+	memcpy(&res, &val, sizeof(int));
+	return res;
+}
+
+static inline int __float2int_rd(float val) {
+	return (int) std::floor(val);
+}
+
+static inline int __float2int_ru(float val) {
+	return (int) std::ceil(val);
+}
+
+static inline int __float2int_rn(float val) {
+	return (int) std::nearbyint(val);
+}
+
+//------------------------------------------------------------------
+// Atomics
+//------------------------------------------------------------------
+static inline int atomicAdd(int * address, int val) {
+	return __atomic_fetch_add(address, val, __ATOMIC_SEQ_CST);
+}
+
+static inline uint atomicAdd(uint * address, uint val) {
+	return __atomic_fetch_add(address, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomicSub(int * address, int val) {
+	return __atomic_fetch_sub(address, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomicExch(int * address, int val) {
+	return __atomic_exchange_n(address, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomicCAS(int * address, int compare, int val) {
+	__atomic_compare_exchange_n(address, &compare, val, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+#endif
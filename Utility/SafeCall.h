@@ -2,7 +2,12 @@
 #define SAFECALL_H__
 
 #include <iostream>
+
+#ifdef HOST_BACKEND
+#include "HostRuntime.h"
+#else
 #include <cuda_runtime.h>
+#endif
 
 #if defined(__GNUC__)
     #define SafeCall(expr)  ___SafeCall(expr, __FILE__, __LINE__, __func__)
@@ -0,0 +1,123 @@
+#ifndef THREAD_POOL_H__
+#define THREAD_POOL_H__
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+// Fixed set of worker threads used by the host backend in place of
+// kernel launches. The calling thread takes part in every job, and
+// ParallelFor returns only after all iterations have finished.
+// Jobs must not call back into the pool.
+class ThreadPool {
+
+public:
+
+	ThreadPool(int noThreads = std::thread::hardware_concurrency()) :
+			generation(0), noPending(0), quit(false), task(nullptr) {
+		for (int i = 1; i < noThreads; ++i)
+			workers.push_back(std::thread(&ThreadPool::Run, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (std::thread & t : workers)
+			t.join();
+	}
+
+	static ThreadPool & Global() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	int NumThreads() const {
+		return workers.size() + 1;
+	}
+
+	// Calls func(i) for every i in [begin, end). Iterations are handed
+	// out in chunks of grain to whichever thread is free.
+	template<class Func> void ParallelFor(int begin, int end, Func func, int grain = 1) {
+
+		if (end <= begin)
+			return;
+
+		if (workers.empty() || end - begin <= grain) {
+			for (int i = begin; i < end; ++i)
+				func(i);
+			return;
+		}
+
+		std::atomic<int> next(begin);
+		std::function<void()> job = [&]() {
+			for (int i = next.fetch_add(grain); i < end; i = next.fetch_add(grain)) {
+				int last = std::min(i + grain, end);
+				for (int j = i; j < last; ++j)
+					func(j);
+			}
+		};
+
+		Dispatch(job);
+	}
+
+protected:
+
+	void Dispatch(std::function<void()> & job) {
+
+		std::lock_guard<std::mutex> serial(dispatchMutex);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = &job;
+			noPending = workers.size();
+			++generation;
+		}
+		wake.notify_all();
+
+		job();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&] { return noPending == 0; });
+		task = nullptr;
+	}
+
+	void Run() {
+
+		unsigned long seen = 0;
+		while (true) {
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+
+			seen = generation;
+			std::function<void()> * job = task;
+			lock.unlock();
+
+			(*job)();
+
+			lock.lock();
+			if (--noPending == 0)
+				finished.notify_one();
+		}
+	}
+
+	unsigned long generation;
+	int noPending;
+	bool quit;
+	std::function<void()> * task;
+
+	std::mutex mutex;
+	std::mutex dispatchMutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	std::vector<std::thread> workers;
+};
+
+#endif
@@ -2,8 +2,13 @@
 #define MATH_LIB_H__
 
 #include <cmath>
+
+#ifdef HOST_BACKEND
+#include "HostRuntime.h"
+#else
 #include <cuda_runtime.h>
 #include <cuda_runtime_api.h>
+#endif
 
 __host__ __device__ __forceinline__ uchar3 make_uchar3(int a) {
 	return make_uchar3(a, a, a);